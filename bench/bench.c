@@ -0,0 +1,747 @@
+// Throughput and latency benchmarks for the enigma library. Every benchmark runs for at
+// least the minimum time (-t) and reports one result row. Results go to stdout as JSON
+// (default) or CSV (-f csv) so runs can be compared by scripts.
+
+#include "ctxpool.h"
+#include "enigma.h"
+#include "enigma_fixed.h"
+#include "key.h"
+#include "keydb.h"
+#include "keybatch.h"
+#include "keystream.h"
+#include "pool.h"
+#include "tablecache.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN_SIZE 1024
+#define SEEK_CHUNK (1 << 20) // bytes per task in the thread scaling benchmark
+#define KEY_TEXT 250         // letters of ciphertext scored by the key search benchmarks
+#define KEYDB_KEYS 100000    // keys in the key database benchmarks
+
+// the machines of make_machine, fixed at build time
+ENIGMA_FIXED(fixed_m3, MODE_M3, ROTOR_III, ROTOR_II, ROTOR_I, ROTOR_B, REFLECTOR_B)
+ENIGMA_FIXED(fixed_m4, MODE_M4, ROTOR_III, ROTOR_II, ROTOR_I, ROTOR_B, REFLECTOR_B_THIN)
+
+struct result {
+	const char *name, *variant;
+	size_t bytes;
+	int threads;
+	uint64_t iterations;
+	double seconds;
+};
+
+// a benchmark body runs iters iterations of whatever it measures
+typedef void (*bench_fn)(void *arg, uint64_t iters);
+
+static double g_min_time = 0.2;
+static size_t g_max_size = 64 << 20;
+static int g_max_threads = 0;
+static int g_csv = 0;
+static int g_rows = 0;
+
+static double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Runs fn with a growing iteration count until one run lasts at least g_min_time
+static void
+run(struct result *r, bench_fn fn, void *arg) {
+	uint64_t iters = 1;
+	double t;
+
+	for (;;) {
+		t = now();
+		fn(arg, iters);
+		t = now() - t;
+		if (t >= g_min_time || iters >= (UINT64_C(1) << 40)) {
+			break;
+		}
+		iters = (t < g_min_time / 100) ? iters * 100 : iters * (g_min_time * 1.2 / t) + 1;
+	}
+
+	r->iterations = iters;
+	r->seconds = t;
+}
+
+static void
+report(struct result *r) {
+	double ns = r->seconds * 1e9 / r->iterations;
+	double mbs = r->bytes ? r->bytes * (double)r->iterations / r->seconds / 1e6 : 0;
+
+	if (g_csv) {
+		if (!g_rows) {
+			printf("name,variant,bytes,threads,iterations,seconds,ns_per_op,mb_per_s\n");
+		}
+		printf("%s,%s,%zu,%d,%llu,%.6f,%.2f,%.2f\n", r->name, r->variant, r->bytes,
+			r->threads, (unsigned long long)r->iterations, r->seconds, ns, mbs);
+	} else {
+		printf("%s\n    {\"name\": \"%s\", \"variant\": \"%s\", \"bytes\": %zu, "
+			"\"threads\": %d, \"iterations\": %llu, \"seconds\": %.6f, "
+			"\"ns_per_op\": %.2f, \"mb_per_s\": %.2f}", g_rows ? "," : "[",
+			r->name, r->variant, r->bytes, r->threads,
+			(unsigned long long)r->iterations, r->seconds, ns, mbs);
+	}
+	fflush(stdout);
+	g_rows++;
+}
+
+// Synthetic plaintext: mostly letters of both cases, with spaces and punctuation
+static char *
+make_corpus(size_t n) {
+	static const char other[] = " .,\n";
+	uint64_t x = 88172645463325252ull;
+	char *buf = malloc(n);
+	size_t i;
+
+	if (!buf) {
+		fprintf(stderr, "Unable to allocate %zu byte corpus\n", n);
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17; // xorshift64
+		if (x % 100 < 85) {
+			buf[i] = (x >> 8) % 26 + ((x >> 16) & 1 ? 'a' : 'A');
+		} else {
+			buf[i] = other[(x >> 8) % 4];
+		}
+	}
+
+	return buf;
+}
+
+static enigma_ctx *
+make_machine(int mode, int plugs, int compiled) {
+	static const char pairs[] = "AQWERTZUIOPSDFGHJKLY";
+	enigma_ctx *ctx = enigma_ctx_create();
+	int i;
+
+	if (!ctx) {
+		fprintf(stderr, "Unable to allocate enigma machine\n");
+		exit(1);
+	}
+	enigma_set_mode_ctx(ctx, mode);
+	if (mode == MODE_M4) {
+		enigma_load_reflector_ctx(ctx, REFLECTOR_B_THIN);
+	}
+	for (i = 0; i < plugs; i++) {
+		enigma_plugboard_map_ctx(ctx, pairs[2 * i], pairs[2 * i + 1]);
+	}
+	enigma_set_compiled_ctx(ctx, compiled);
+
+	return ctx;
+}
+
+static void
+make_fixed(struct enigma_fixed *m, int plugs) {
+	static const char pairs[] = "AQWERTZUIOPSDFGHJKLY";
+	int i;
+
+	enigma_fixed_init(m);
+	for (i = 0; i < plugs; i++) {
+		enigma_fixed_plugboard_map(m, pairs[2 * i], pairs[2 * i + 1]);
+	}
+}
+
+struct encode_arg {
+	enigma_ctx *ctx;
+	struct enigma_fixed fixed;
+	const char *in;
+	char *out;
+	size_t len;
+	int threads;
+};
+
+static void
+bench_encode_char(void *p, uint64_t iters) {
+	struct encode_arg *a = p;
+	uint64_t i;
+	char c = 'A';
+
+	for (i = 0; i < iters; i++) {
+		c = enigma_encode_ctx(a->ctx, 'A' + (c & 15)); // chain results, no overlap
+	}
+	if (c == 0) {
+		puts("");
+	}
+}
+
+// seeks of every length up to a few cycles, as -j chunks make
+static void
+bench_seek(void *p, uint64_t iters) {
+	struct encode_arg *a = p;
+	uint64_t i;
+
+	for (i = 0; i < iters; i++) {
+		enigma_seek_ctx(a->ctx, i * 7919 % 60000);
+	}
+}
+
+static void
+bench_encode_loop(void *p, uint64_t iters) {
+	struct encode_arg *a = p;
+	size_t i;
+
+	while (iters--) {
+		for (i = 0; i < a->len; i++) {
+			a->out[i] = enigma_encode_ctx(a->ctx, a->in[i]);
+		}
+	}
+}
+
+static void
+bench_encode_buf(void *p, uint64_t iters) {
+	struct encode_arg *a = p;
+
+	while (iters--) {
+		enigma_encode_buf_ctx(a->ctx, a->in, a->out, a->len);
+	}
+}
+
+static void
+bench_encode_fixed_m3(void *p, uint64_t iters) {
+	struct encode_arg *a = p;
+
+	while (iters--) {
+		fixed_m3_encode_buf(&a->fixed, a->in, a->out, a->len);
+	}
+}
+
+static void
+bench_encode_fixed_m4(void *p, uint64_t iters) {
+	struct encode_arg *a = p;
+
+	while (iters--) {
+		fixed_m4_encode_buf(&a->fixed, a->in, a->out, a->len);
+	}
+}
+
+static void
+encode_task(void *p, size_t task, int worker) {
+	struct encode_arg *a = p;
+	size_t off = task * SEEK_CHUNK;
+	size_t len = a->len - off < SEEK_CHUNK ? a->len - off : SEEK_CHUNK;
+	enigma_ctx *ctx = enigma_ctx_clone(a->ctx);
+
+	(void)worker;
+	// chunks are independent, the seek is what a real -j run would pay
+	enigma_seek_ctx(ctx, off);
+	enigma_encode_buf_ctx(ctx, a->in + off, a->out + off, len);
+	enigma_ctx_destroy(ctx);
+}
+
+static void
+bench_encode_threads(void *p, uint64_t iters) {
+	struct encode_arg *a = p;
+
+	while (iters--) {
+		pool_run(a->threads, (a->len + SEEK_CHUNK - 1) / SEEK_CHUNK, encode_task, a);
+	}
+}
+
+struct state_arg {
+	enigma_ctx *ctx;
+	char *fname;
+};
+
+static void
+bench_state_save(void *p, uint64_t iters) {
+	struct state_arg *a = p;
+
+	while (iters--) {
+		enigma_state_save_ctx(a->ctx, a->fname);
+	}
+}
+
+static void
+bench_state_load(void *p, uint64_t iters) {
+	struct state_arg *a = p;
+
+	while (iters--) {
+		enigma_state_load_ctx(a->ctx, a->fname);
+	}
+}
+
+struct key_arg {
+	struct enigma_key key;
+	char line[KEY_TEXT_MAX];
+	size_t len;
+};
+
+static void
+bench_key_format(void *p, uint64_t iters) {
+	struct key_arg *a = p;
+
+	while (iters--) {
+		a->len = key_format(&a->key, a->line);
+	}
+}
+
+static void
+bench_key_parse(void *p, uint64_t iters) {
+	struct key_arg *a = p;
+
+	while (iters--) {
+		if (key_parse(a->line, a->len, &a->key)) {
+			fprintf(stderr, "Unable to parse %s\n", a->line);
+			exit(1);
+		}
+	}
+}
+
+struct keydb_arg {
+	keydb *db;
+	struct enigma_key key;
+	enigma_ctx *ctx;
+};
+
+// setting a machine up from a key, as -s KEYS#N does once the entry is read
+static void
+bench_key_to_ctx(void *p, uint64_t iters) {
+	struct keydb_arg *a = p;
+
+	while (iters--) {
+		key_to_ctx(&a->key, a->ctx);
+	}
+}
+
+static void
+bench_keydb_copy(void *p, uint64_t iters) {
+	struct keydb_arg *a = p;
+	uint32_t id = 0;
+	long i;
+
+	while (iters--) {
+		id = id == KEYDB_KEYS ? 1 : id + 1;
+		if ((i = keydb_find(a->db, id, 19410501)) < 0) {
+			fprintf(stderr, "Unable to find key %u\n", id);
+			exit(1);
+		}
+		keydb_copy(a->db, i, a->ctx);
+	}
+}
+
+struct clone_arg {
+	enigma_ctx *tmpl;
+	ctx_pool *pool;
+};
+
+// a machine per message, as batch and server sessions start them
+static void
+bench_ctx_clone(void *p, uint64_t iters) {
+	struct clone_arg *a = p;
+
+	while (iters--) {
+		enigma_ctx_destroy(enigma_ctx_clone(a->tmpl));
+	}
+}
+
+static void
+bench_ctx_pool_clone(void *p, uint64_t iters) {
+	struct clone_arg *a = p;
+
+	while (iters--) {
+		ctx_pool_put(a->pool, 0, ctx_pool_clone(a->pool, 0, a->tmpl));
+	}
+}
+
+struct table_arg {
+	enigma_ctx *ctx;
+	const char *fname;
+};
+
+// what a compiled machine costs to start, built or taken from the table cache in use
+static void
+bench_table(void *p, uint64_t iters) {
+	struct table_arg *a = p;
+
+	while (iters--) {
+		enigma_set_compiled_ctx(a->ctx, 0);
+		enigma_set_compiled_ctx(a->ctx, 1);
+	}
+}
+
+static void
+bench_table_cache_open(void *p, uint64_t iters) {
+	struct table_arg *a = p;
+
+	while (iters--) {
+		table_cache_close(table_cache_open(a->fname));
+	}
+}
+
+struct keys_arg {
+	enigma_ctx *base, *keys[KEYBATCH_LANES];
+	struct keybatch batch;
+	const char *in;
+	char *out;
+};
+
+// what a key search did before the batch kernel: decrypt under each key, then count
+static void
+bench_keys_loop(void *p, uint64_t iters) {
+	struct keys_arg *a = p;
+	uint32_t freq[26];
+	enigma_ctx *ctx;
+	size_t i, n;
+	int k;
+
+	while (iters--) {
+		for (k = 0; k < KEYBATCH_LANES; k++) {
+			ctx = enigma_ctx_clone(a->keys[k]);
+			n = enigma_encode_buf_ctx(ctx, a->in, a->out, KEY_TEXT);
+			memset(freq, 0, sizeof(freq));
+			for (i = 0; i < n; i++) {
+				freq[a->out[i] - 'A']++;
+			}
+			enigma_ctx_destroy(ctx);
+		}
+	}
+}
+
+static void
+bench_keys_batch(void *p, uint64_t iters) {
+	struct keys_arg *a = p;
+	struct keybatch_scores scores;
+
+	while (iters--) {
+		keybatch_score(a->base, &a->batch, a->in, KEY_TEXT, &scores);
+	}
+}
+
+static void
+keys(const char *corpus, char *out) {
+	struct keys_arg a = { .in = corpus, .out = out };
+	struct result r = { .variant = "M3/plugs10/32keys", .bytes = KEY_TEXT * KEYBATCH_LANES,
+		.threads = 1 };
+	int k;
+
+	a.base = make_machine(MODE_M3, 10, 0);
+	memset(&a.batch, 0, sizeof(a.batch));
+	for (k = 0; k < KEYBATCH_LANES; k++) {
+		a.keys[k] = enigma_ctx_clone(a.base);
+		enigma_set_rotation_ctx(a.keys[k], 0, k);
+		enigma_set_rotation_ctx(a.keys[k], 1, k / 3);
+		enigma_set_ringset_ctx(a.keys[k], 0, k / 2);
+		keybatch_set(&a.batch, k, a.keys[k]);
+	}
+
+	r.name = "keys_loop";
+	run(&r, bench_keys_loop, &a);
+	report(&r);
+
+	r.name = "keys_batch";
+	run(&r, bench_keys_batch, &a);
+	report(&r);
+
+	for (k = 0; k < KEYBATCH_LANES; k++) {
+		enigma_ctx_destroy(a.keys[k]);
+	}
+	enigma_ctx_destroy(a.base);
+}
+
+static void
+latency(void) {
+	struct encode_arg a = {0};
+	struct result r = { .name = "encode_char", .threads = 1 };
+	int compiled;
+
+	for (compiled = 0; compiled <= 1; compiled++) {
+		a.ctx = make_machine(MODE_M3, 10, compiled);
+		r.variant = compiled ? "M3/plugs10/compiled" : "M3/plugs10/interpreted";
+		run(&r, bench_encode_char, &a);
+		report(&r);
+		enigma_ctx_destroy(a.ctx);
+	}
+
+	a.ctx = make_machine(MODE_M3, 10, 0);
+	r.name = "seek";
+	r.variant = "M3/plugs10";
+	run(&r, bench_seek, &a);
+	report(&r);
+	enigma_ctx_destroy(a.ctx);
+}
+
+static void
+throughput(const char *corpus, char *out) {
+	static const char *names[2][2][2] = {
+		{ { "M3/plugs0/interpreted", "M3/plugs0/compiled" },
+		  { "M3/plugs10/interpreted", "M3/plugs10/compiled" } },
+		{ { "M4/plugs0/interpreted", "M4/plugs0/compiled" },
+		  { "M4/plugs10/interpreted", "M4/plugs10/compiled" } },
+	};
+	static const char *fixed_names[2][2] = {
+		{ "M3/plugs0", "M3/plugs10" }, { "M4/plugs0", "M4/plugs10" }
+	};
+	struct encode_arg a = { .in = corpus, .out = out, .threads = 1 };
+	struct result r = { .threads = 1 };
+	int mode, plugs, compiled;
+
+	for (a.len = MIN_SIZE; a.len <= g_max_size; a.len *= 8) {
+		r.bytes = a.len;
+		for (mode = MODE_M3; mode <= MODE_M4; mode++) {
+			for (plugs = 0; plugs <= 1; plugs++) {
+				// the character at a time loop is the path the buffer API replaces
+				a.ctx = make_machine(mode, plugs * 10, 0);
+				r.name = "encode_loop";
+				r.variant = names[mode][plugs][0];
+				run(&r, bench_encode_loop, &a);
+				report(&r);
+				enigma_ctx_destroy(a.ctx);
+
+				for (compiled = 0; compiled <= 1; compiled++) {
+					a.ctx = make_machine(mode, plugs * 10, compiled);
+					r.name = "encode_buf";
+					r.variant = names[mode][plugs][compiled];
+					run(&r, bench_encode_buf, &a);
+					report(&r);
+					enigma_ctx_destroy(a.ctx);
+				}
+
+				make_fixed(&a.fixed, plugs * 10);
+				r.name = "encode_fixed";
+				r.variant = fixed_names[mode][plugs];
+				run(&r, mode == MODE_M3 ? bench_encode_fixed_m3 : bench_encode_fixed_m4, &a);
+				report(&r);
+			}
+		}
+	}
+}
+
+static void
+scaling(const char *corpus, char *out) {
+	struct encode_arg a = { .in = corpus, .out = out, .len = g_max_size };
+	struct result r = { .name = "encode_threads", .bytes = g_max_size };
+	int compiled;
+
+	for (compiled = 0; compiled <= 1; compiled++) {
+		a.ctx = make_machine(MODE_M3, 10, compiled);
+		r.variant = compiled ? "M3/plugs10/compiled" : "M3/plugs10/interpreted";
+		for (a.threads = 1; a.threads <= g_max_threads; a.threads *= 2) {
+			r.threads = a.threads;
+			run(&r, bench_encode_threads, &a);
+			report(&r);
+		}
+		enigma_ctx_destroy(a.ctx);
+	}
+}
+
+static void
+settings(void) {
+	char fname[] = "/tmp/enigma_bench_XXXXXX";
+	struct state_arg a;
+	struct key_arg k;
+	struct keydb_arg d;
+	struct clone_arg c;
+	struct result r = { .variant = "M4/plugs10", .threads = 1 };
+	int fd, i;
+
+	if ((fd = mkstemp(fname)) < 0) {
+		perror("mkstemp");
+		return;
+	}
+	close(fd);
+
+	a.fname = fname;
+	a.ctx = make_machine(MODE_M4, 10, 0);
+
+	r.name = "state_save";
+	run(&r, bench_state_save, &a);
+	report(&r);
+
+	r.name = "state_load";
+	run(&r, bench_state_load, &a);
+	report(&r);
+
+	// the single line key format
+	key_from_ctx(&k.key, a.ctx);
+	k.len = key_format(&k.key, k.line);
+
+	r.name = "key_format";
+	run(&r, bench_key_format, &k);
+	report(&r);
+
+	r.name = "key_parse";
+	run(&r, bench_key_parse, &k);
+	report(&r);
+
+	// picking one of many keys
+	d.key = k.key;
+	d.ctx = a.ctx;
+	if (!(d.db = keydb_create())) {
+		fprintf(stderr, "Unable to allocate key database\n");
+		exit(1);
+	}
+	d.key.date = 19410501;
+	for (i = 0; i < KEYDB_KEYS; i++) {
+		d.key.id = i + 1;
+		d.key.rotation[0] = i % 26;
+		key_seal(&d.key);
+		if (keydb_add(d.db, &d.key)) {
+			fprintf(stderr, "Unable to add key %d\n", i + 1);
+			exit(1);
+		}
+	}
+
+	r.name = "key_to_ctx";
+	run(&r, bench_key_to_ctx, &d);
+	report(&r);
+
+	r.variant = "M4/plugs10/100000keys";
+	r.name = "keydb_find_copy";
+	run(&r, bench_keydb_copy, &d);
+	report(&r);
+
+	keydb_destroy(d.db);
+
+	c.tmpl = a.ctx;
+	if (!(c.pool = ctx_pool_create(1))) {
+		fprintf(stderr, "Unable to allocate context pool\n");
+		exit(1);
+	}
+	r.variant = "M4/plugs10";
+	r.name = "ctx_clone";
+	run(&r, bench_ctx_clone, &c);
+	report(&r);
+
+	r.name = "ctx_pool_clone";
+	run(&r, bench_ctx_pool_clone, &c);
+	report(&r);
+	ctx_pool_destroy(c.pool);
+
+	enigma_ctx_destroy(a.ctx);
+	unlink(fname);
+}
+
+// Compiled machines built, taken from a table cache of the wheel orders of rotors
+// I-III (the machines of make_machine among them), and shared with an earlier machine
+// of the same settings through the keystream cache
+static void
+tables(void) {
+	char fname[] = "/tmp/enigma_bench_XXXXXX";
+	struct result r = { .threads = 1 };
+	struct table_arg a = { .fname = fname };
+	table_cache *c;
+	int fd, plugs;
+
+	if ((fd = mkstemp(fname)) < 0) {
+		perror("mkstemp");
+		return;
+	}
+	close(fd);
+	if (table_cache_build(fname, MODE_M3, 7, 1) < 0 || !(c = table_cache_open(fname))) {
+		unlink(fname);
+		return;
+	}
+
+	r.name = "table_cache_open";
+	r.variant = "M3/12tables";
+	run(&r, bench_table_cache_open, &a);
+	report(&r);
+
+	for (plugs = 0; plugs <= 10; plugs += 10) {
+		a.ctx = make_machine(MODE_M3, plugs, 1);
+		r.variant = plugs ? "M3/plugs10" : "M3/plugs0";
+
+		r.name = "table_build";
+		run(&r, bench_table, &a);
+		report(&r);
+
+		table_cache_use(c);
+		r.name = "table_cache";
+		run(&r, bench_table, &a);
+		report(&r);
+		table_cache_use(NULL);
+
+		keystream_cache_limit(64 << 20);
+		r.name = "keystream_hit";
+		run(&r, bench_table, &a);
+		report(&r);
+		keystream_cache_limit(0);
+
+		enigma_ctx_destroy(a.ctx);
+	}
+
+	table_cache_close(c);
+	unlink(fname);
+}
+
+static void
+usage(void) {
+	fprintf(stderr, "usage: enigma_bench [-f json|csv] [-m MB] [-j MAX_THREADS] "
+		"[-t SECONDS]\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t-f Output format (default json)\n");
+	fprintf(stderr, "\t-m Largest corpus in megabytes, at most 1024. Corpora run from 1 KB "
+		"up to it in\n\t   steps of 8x (default 64)\n");
+	fprintf(stderr, "\t-j Largest thread count for the scaling runs (default: CPUs)\n");
+	fprintf(stderr, "\t-t Minimum time per benchmark (default 0.2)\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[]) {
+	unsigned long long mb = g_max_size >> 20;
+	char *corpus, *out;
+	int c;
+
+	while ((c = getopt(argc, argv, "f:m:j:t:h")) != -1) {
+		switch (c) {
+		case 'f':
+			g_csv = !strcmp(optarg, "csv");
+			break;
+		case 'm':
+			mb = strtoull(optarg, NULL, 0);
+			break;
+		case 'j':
+			g_max_threads = atoi(optarg);
+			break;
+		case 't':
+			g_min_time = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (mb < 1 || mb > 1024) {
+		usage();
+	}
+	g_max_size = (size_t)mb << 20;
+	if (g_max_threads < 1) {
+		g_max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (g_max_threads < 1) {
+			g_max_threads = 1;
+		}
+	}
+
+	corpus = make_corpus(g_max_size);
+	out = malloc(g_max_size);
+	if (!out) {
+		fprintf(stderr, "Unable to allocate output buffer\n");
+		return EXIT_FAILURE;
+	}
+
+	latency();
+	throughput(corpus, out);
+	scaling(corpus, out);
+	keys(corpus, out);
+	settings();
+	tables();
+
+	if (!g_csv) {
+		printf("\n]\n");
+	}
+
+	free(out);
+	free(corpus);
+	return EXIT_SUCCESS;
+}
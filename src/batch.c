@@ -0,0 +1,241 @@
+#include "batch.h"
+#include "ctxpool.h"
+#include "io.h"
+#include "key.h"
+#include "pool.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define BATCH_WINDOW 1024 // messages encrypted before their output is written
+#define CONFIG_BUCKETS 1024
+
+// a parsed settings file
+struct config {
+	char *path;
+	enigma_ctx *ctx;
+	struct config *next;
+};
+
+struct message {
+	char *path;
+	enigma_ctx *tmpl;
+	char *out;
+	size_t out_len;
+	int failed;
+};
+
+// messages encrypted by a pool_run
+struct window {
+	struct message *msgs;
+	ctx_pool *ctxs;
+};
+
+struct batch {
+	struct config *configs[CONFIG_BUCKETS];
+	struct message *msgs;
+	size_t num_msgs, cap_msgs;
+	enigma_ctx *base;
+	int compiled;
+};
+
+static unsigned int
+hash(const char *s) {
+	unsigned int h = 2166136261u; // FNV-1a
+
+	while (*s) {
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	}
+
+	return h;
+}
+
+static enigma_ctx *
+lookup_config(struct batch *b, char *path) {
+	struct config **bucket, *c;
+	int err;
+
+	if (!strcmp(path, "-")) {
+		return b->base;
+	}
+
+	bucket = &b->configs[hash(path) % CONFIG_BUCKETS];
+	for (c = *bucket; c; c = c->next) {
+		if (!strcmp(c->path, path)) {
+			return c->ctx;
+		}
+	}
+
+	c = malloc(sizeof(*c));
+	if (!c || !(c->path = strdup(path)) || !(c->ctx = enigma_ctx_create())) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		exit(1);
+	}
+	if ((err = key_load_settings(c->ctx, path))) {
+		// its messages fail, but the other messages go ahead
+		fprintf(stderr, "Unable to load %s: %s\n", path, key_strerror(err));
+		enigma_ctx_destroy(c->ctx);
+		c->ctx = NULL;
+	} else {
+		enigma_set_compiled_ctx(c->ctx, b->compiled);
+	}
+	c->next = *bucket;
+	*bucket = c;
+
+	return c->ctx;
+}
+
+static int
+read_manifest(struct batch *b, char *manifest) {
+	char *line = NULL, *settings, *msg;
+	size_t cap = 0;
+	struct message *m;
+	FILE *f;
+
+	f = fopen(manifest, "r");
+	if (!f) {
+		fprintf(stderr, "Unable to open %s\n", manifest);
+		return -1;
+	}
+
+	while (getline(&line, &cap, f) != -1) {
+		settings = strtok(line, " \t\r\n");
+		if (!settings || settings[0] == '#') {
+			continue;
+		}
+		if (!(msg = strtok(NULL, " \t\r\n"))) {
+			fprintf(stderr, "%s: no message file for %s\n", manifest, settings);
+			continue;
+		}
+
+		if (b->num_msgs == b->cap_msgs) {
+			b->cap_msgs = b->cap_msgs ? b->cap_msgs * 2 : 64;
+			m = realloc(b->msgs, b->cap_msgs * sizeof(*m));
+			if (!m) {
+				fprintf(stderr, "Unable to allocate memory\n");
+				exit(1);
+			}
+			b->msgs = m;
+		}
+
+		m = &b->msgs[b->num_msgs++];
+		memset(m, 0, sizeof(*m));
+		m->tmpl = lookup_config(b, settings);
+		if (!(m->path = strdup(msg))) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			exit(1);
+		}
+	}
+
+	free(line);
+	fclose(f);
+	return 0;
+}
+
+static void
+encrypt_message(void *arg, size_t task, int worker) {
+	struct window *win = arg;
+	struct message *m = win->msgs + task;
+	enigma_ctx *ctx;
+	char *in, *letters;
+	size_t len = 0, n;
+	int fd, mapped = 0;
+
+	m->failed = 1;
+	m->out_len = 0;
+
+	if (!m->tmpl) { // its settings could not be loaded
+		return;
+	}
+	if ((fd = open(m->path, O_RDONLY)) < 0) {
+		fprintf(stderr, "Unable to open %s\n", m->path);
+		return;
+	}
+	if ((in = map_input(fd, &len))) {
+		mapped = 1;
+	} else if (!(in = read_input(fd, &len))) {
+		fprintf(stderr, "Unable to read %s\n", m->path);
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	letters = malloc(len ? len : 1);
+	m->out = malloc(GROUPED_SIZE(len) + 1);
+	ctx = ctx_pool_clone(win->ctxs, worker, m->tmpl);
+	if (letters && m->out && ctx) {
+		n = enigma_encode_buf_ctx(ctx, in, letters, len);
+		m->out_len = group(letters, n, 0, m->out);
+		m->out[m->out_len++] = '\n';
+		m->failed = 0;
+	} else {
+		fprintf(stderr, "Unable to allocate memory for %s\n", m->path);
+	}
+
+	ctx_pool_put(win->ctxs, worker, ctx);
+	free(letters);
+	if (mapped) {
+		munmap(in, len);
+	} else {
+		free(in);
+	}
+}
+
+int
+batch_run(char *manifest, enigma_ctx *base, int threads, int compiled) {
+	static char newline[] = "\n";
+	struct batch b = { .base = base, .compiled = compiled };
+	struct iovec iov[BATCH_WINDOW];
+	struct window win;
+	struct config *c, *next;
+	size_t i, j, n;
+	int failed = 0;
+
+	if (read_manifest(&b, manifest)) {
+		return 1;
+	}
+	if (!(win.ctxs = ctx_pool_create(threads))) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		exit(1);
+	}
+
+	// encrypt a window of messages at a time, so output memory stays bounded
+	for (i = 0; i < b.num_msgs; i += n) {
+		n = b.num_msgs - i < BATCH_WINDOW ? b.num_msgs - i : BATCH_WINDOW;
+		win.msgs = &b.msgs[i];
+		pool_run(threads, n, encrypt_message, &win);
+
+		for (j = 0; j < n; j++) {
+			if (b.msgs[i + j].failed) {
+				iov[j].iov_base = newline; // keep one line per message
+				iov[j].iov_len = 1;
+				failed = 1;
+			} else {
+				iov[j].iov_base = b.msgs[i + j].out;
+				iov[j].iov_len = b.msgs[i + j].out_len;
+			}
+		}
+		writev_all(STDOUT_FILENO, iov, n);
+
+		for (j = 0; j < n; j++) {
+			free(b.msgs[i + j].out);
+			free(b.msgs[i + j].path);
+		}
+	}
+
+	for (i = 0; i < CONFIG_BUCKETS; i++) {
+		for (c = b.configs[i]; c; c = next) {
+			next = c->next;
+			enigma_ctx_destroy(c->ctx);
+			free(c->path);
+			free(c);
+		}
+	}
+	free(b.msgs);
+	ctx_pool_destroy(win.ctxs);
+
+	return failed;
+}
@@ -0,0 +1,17 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "enigma.h"
+
+// Encrypts every message listed in a manifest file. Each line of the manifest names a
+// settings file and a message file, separated by whitespace, for example
+//     keys/monday.conf msgs/0001.txt
+// Settings are anything key_load_settings takes, so keys/may.keys#12 names entry 12 of
+// a key list, and - uses base instead. Blank lines and lines starting with # are
+// skipped. Settings are parsed once, however many messages use them, and every
+// message is encrypted by its own clone of the parsed machine. Messages are spread over
+// threads, and each ciphertext is written to stdout on its own line in manifest order.
+// Returns 0 if every message was encrypted
+int batch_run(char *manifest, enigma_ctx *base, int threads, int compiled);
+
+#endif
@@ -0,0 +1,380 @@
+#include "crib.h"
+#include "enigma_internal.h"
+#include "pool.h"
+#include "wheels.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EDGE(k, y) ((k) << 5 | (y))      // menu edge to letter y through crib letter k
+
+// The crib laid against the ciphertext at one offset. Crib letter k and the ciphertext
+// letter under it are joined by the scrambler at position offset + k, so the menu is a
+// graph of letters with one edge per crib letter, stored as adjacency lists
+struct menu {
+	long offset;
+	int len;
+	int first[MAP_SIZE + 1];      // edges of letter x are adj[first[x]] to adj[first[x+1]]
+	uint16_t adj[2 * CRIB_MAX];
+	int roots[MAP_SIZE];          // a letter in each connected part, largest part first
+	int num_parts;
+};
+
+struct search {
+	struct crib_search *s;
+	struct menu *menus;
+	int num_menus;
+	long span; // key presses from the ground setting to the end of the last crib
+	struct wheels *wheels; // one task each
+	long found;
+	pthread_mutex_t lock;
+};
+
+// stecker deduction for one candidate setting
+struct bombe {
+	const struct menu *m;
+	const unsigned char *row[CRIB_MAX]; // scrambler under each crib letter
+	signed char plug[MAP_SIZE];         // stecker partner of each letter, -1 if unknown
+	int stack[MAP_SIZE], top;           // letters whose edges are still to be followed
+};
+
+static void
+build_menu(struct menu *m, const int *plain, const int *cipher, int len, long offset) {
+	int seen[MAP_SIZE] = {0}, size[MAP_SIZE], stack[MAP_SIZE];
+	int pos[MAP_SIZE], x, y, k, e, top, n, best, i;
+
+	m->offset = offset;
+	m->len = len;
+	memset(m->first, 0, sizeof(m->first));
+	for (k = 0; k < len; k++) {
+		m->first[plain[k] + 1]++;
+		m->first[cipher[k] + 1]++;
+	}
+	for (x = 0; x < MAP_SIZE; x++) {
+		m->first[x + 1] += m->first[x];
+		pos[x] = m->first[x];
+	}
+	for (k = 0; k < len; k++) {
+		m->adj[pos[plain[k]]++] = EDGE(k, cipher[k]);
+		m->adj[pos[cipher[k]]++] = EDGE(k, plain[k]);
+	}
+
+	// connected parts, each represented by its best connected letter
+	m->num_parts = 0;
+	for (x = 0; x < MAP_SIZE; x++) {
+		if (seen[x] || m->first[x] == m->first[x + 1]) {
+			continue;
+		}
+		seen[x] = 1;
+		stack[0] = x;
+		top = 1;
+		n = 0;
+		best = x;
+		while (top) {
+			y = stack[--top];
+			n++;
+			if (m->first[y + 1] - m->first[y] > m->first[best + 1] - m->first[best]) {
+				best = y;
+			}
+			for (e = m->first[y]; e < m->first[y + 1]; e++) {
+				if (!seen[m->adj[e] & 31]) {
+					seen[m->adj[e] & 31] = 1;
+					stack[top++] = m->adj[e] & 31;
+				}
+			}
+		}
+
+		// insertion sort, largest part first
+		for (i = m->num_parts; i > 0 && size[i - 1] < n; i--) {
+			size[i] = size[i - 1];
+			m->roots[i] = m->roots[i - 1];
+		}
+		size[i] = n;
+		m->roots[i] = best;
+		m->num_parts++;
+	}
+}
+
+// Steckers x to v. Returns 0 if either already has a different partner
+static int
+stecker(struct bombe *b, int x, int v) {
+	if (b->plug[x] >= 0 || b->plug[v] >= 0) {
+		return b->plug[x] == v;
+	}
+	b->plug[x] = v;
+	b->plug[v] = x;
+	b->stack[b->top++] = x;
+	if (v != x) {
+		b->stack[b->top++] = v;
+	}
+	return 1;
+}
+
+// Follows the menu from every newly steckered letter. If x is steckered to P(x) then
+// the letter y joined to x through crib letter k is steckered to row[k][P(x)]
+static int
+propagate(struct bombe *b) {
+	const struct menu *m = b->m;
+	int x, e;
+
+	while (b->top) {
+		x = b->stack[--b->top];
+		for (e = m->first[x]; e < m->first[x + 1]; e++) {
+			if (!stecker(b, m->adj[e] & 31, b->row[m->adj[e] >> 5][(int)b->plug[x]])) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+// Guesses the stecker of the root of each part from part up to end, backtracking on
+// contradictions. Returns 0 if no guess works
+static int
+solve(struct bombe *b, int part, int end) {
+	signed char saved[MAP_SIZE];
+	int root, v;
+
+	if (part == end) {
+		return 1;
+	}
+
+	root = b->m->roots[part];
+	if (b->plug[root] >= 0) {
+		return solve(b, part + 1, end); // reached from an earlier part already
+	}
+
+	memcpy(saved, b->plug, sizeof(saved));
+	for (v = 0; v < MAP_SIZE; v++) {
+		b->top = 0;
+		if (stecker(b, root, v) && propagate(b) && solve(b, part + 1, end)) {
+			return 1;
+		}
+		memcpy(b->plug, saved, sizeof(saved));
+	}
+
+	return 0;
+}
+
+static int
+consistent(struct bombe *b) {
+	int part;
+
+	// each part on its own first, which throws out nearly every wrong setting cheaply
+	for (part = 0; part < b->m->num_parts; part++) {
+		memset(b->plug, -1, sizeof(b->plug));
+		if (!solve(b, part, part + 1)) {
+			return 0;
+		}
+	}
+
+	if (b->m->num_parts == 1) {
+		return 1;
+	}
+	memset(b->plug, -1, sizeof(b->plug));
+	return solve(b, 0, b->m->num_parts);
+}
+
+static void
+report(struct search *sr, const struct wheels *w, int ground, int r0, int r1,
+		const struct bombe *b) {
+	struct crib_search *s = sr->s;
+	struct crib_result r;
+	int i;
+
+	memset(&r, 0, sizeof(r));
+	r.mode = s->mode;
+	r.reflector = w->reflector;
+	for (i = 0; i < RACK_SIZE; i++) {
+		r.rotor[i] = w->rotor[i];
+	}
+	r.rotation[0] = ground % MAP_SIZE;
+	r.rotation[1] = ground / MAP_SIZE % MAP_SIZE;
+	r.rotation[2] = ground / (MAP_SIZE * MAP_SIZE);
+	r.rotation[3] = w->rotation3;
+	r.ringset[0] = r0;
+	r.ringset[1] = r1;
+	r.offset = b->m->offset;
+	for (i = 0; i < MAP_SIZE; i++) {
+		r.plugboard[i] = b->plug[i] >= 0 ? DECODE(b->plug[i]) : '?';
+	}
+
+	pthread_mutex_lock(&sr->lock);
+	sr->found++;
+	if (s->found) {
+		s->found(&r, s->arg);
+	}
+	pthread_mutex_unlock(&sr->lock);
+}
+
+// Tries every ground and ring setting of one wheel order. The stepping only depends on
+// the rotations, and the wiring only on rotation - ringset, so the positions under the
+// cribs are stepped once for each ground setting and reused for every ring setting
+static void
+search_wheels(void *arg, size_t task, int worker) {
+	struct search *sr = arg;
+	struct crib_search *s = sr->s;
+	const struct wheels *w = &sr->wheels[task];
+	int rings0 = s->rings >= 1 ? MAP_SIZE : 1, rings1 = s->rings >= 2 ? MAP_SIZE : 1;
+	unsigned char *d0, *d1;
+	struct enigma_table *t;
+	struct bombe b;
+	enigma_ctx *ctx;
+	int *hi, g, p, r0, r1, i, k, x, y;
+	long j;
+
+	(void)worker;
+	ctx = enigma_ctx_create();
+	d0 = malloc(sr->span);
+	d1 = malloc(sr->span);
+	hi = malloc(sr->span * sizeof(*hi));
+	if (!ctx || !d0 || !d1 || !hi) {
+		fprintf(stderr, "Unable to allocate memory for wheel order %zu\n", task);
+		goto done;
+	}
+
+	if (!(t = wheels_table(ctx, s->mode, w, 0))) {
+		fprintf(stderr, "Unable to build tables for wheel order %zu\n", task);
+		goto done;
+	}
+
+	for (g = 0; g < POSITIONS; g++) {
+		for (p = g, j = 0; j < sr->span; j++) {
+			p = t->next[p];
+			d0[j] = p % MAP_SIZE;
+			d1[j] = p / MAP_SIZE % MAP_SIZE;
+			hi[j] = p - p % (MAP_SIZE * MAP_SIZE);
+		}
+
+		for (r1 = 0; r1 < rings1; r1++) {
+			for (r0 = 0; r0 < rings0; r0++) {
+				for (i = 0; i < sr->num_menus; i++) {
+					b.m = &sr->menus[i];
+					for (k = 0; k < b.m->len; k++) {
+						j = b.m->offset + k;
+						x = d0[j] - r0 + (d0[j] < r0 ? MAP_SIZE : 0);
+						y = d1[j] - r1 + (d1[j] < r1 ? MAP_SIZE : 0);
+						b.row[k] = t->perm[x + MAP_SIZE * y + hi[j]];
+					}
+					if (consistent(&b)) {
+						report(sr, w, g, r0, r1, &b);
+					}
+				}
+			}
+		}
+	}
+
+done:
+	enigma_ctx_destroy(ctx);
+	free(hi);
+	free(d1);
+	free(d0);
+}
+
+// letter indexes of the letters in s, returns how many there were
+static size_t
+letters(const char *s, size_t n, int *out, size_t max) {
+	size_t i, k = 0;
+	int c;
+
+	for (i = 0; i < n && k < max; i++) {
+		c = ENCODE(toupper((unsigned char)s[i]));
+		if (IS_VALID(c)) {
+			out[k++] = c;
+		}
+	}
+
+	return k;
+}
+
+long
+crib_search(struct crib_search *s) {
+	struct search sr = { .s = s };
+	int *cipher, plain[CRIB_MAX + 1];
+	size_t n, len, nwheels, k;
+	long o;
+
+	cipher = malloc((s->cipher_len ? s->cipher_len : 1) * sizeof(*cipher));
+	if (!cipher) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return -1;
+	}
+	n = letters(s->cipher, s->cipher_len, cipher, s->cipher_len);
+	len = letters(s->crib, strlen(s->crib), plain, CRIB_MAX + 1);
+	if (len == 0 || len > CRIB_MAX || len > n) {
+		fprintf(stderr, "Crib must have 1 to %d letters, and no more than the "
+			"ciphertext\n", CRIB_MAX);
+		free(cipher);
+		return -1;
+	}
+	if (s->offset >= 0 && (size_t)s->offset + len > n) {
+		fprintf(stderr, "Crib at offset %ld runs past the end of the ciphertext\n",
+			s->offset);
+		free(cipher);
+		return -1;
+	}
+
+	// a letter never encrypts to itself, which rules out most offsets straight away
+	sr.menus = malloc((s->offset >= 0 ? 1 : n - len + 1) * sizeof(*sr.menus));
+	if (!sr.menus) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		free(cipher);
+		return -1;
+	}
+	for (o = s->offset >= 0 ? s->offset : 0; (size_t)o + len <= n; o++) {
+		for (k = 0; k < len && plain[k] != cipher[o + k]; k++);
+		if (k == len) {
+			build_menu(&sr.menus[sr.num_menus++], plain, cipher + o, len, o);
+			sr.span = o + len;
+		}
+		if (s->offset >= 0) {
+			break;
+		}
+	}
+	free(cipher);
+
+	if (!sr.num_menus) {
+		free(sr.menus);
+		return 0;
+	}
+
+	if (!(nwheels = wheels_list(s->mode, s->rotor_mask, &sr.wheels))) {
+		fprintf(stderr, "No wheel orders to search\n");
+		free(sr.menus);
+		return -1;
+	}
+
+	pthread_mutex_init(&sr.lock, NULL);
+	pool_run(s->threads > 0 ? s->threads : 1, nwheels, search_wheels, &sr);
+	pthread_mutex_destroy(&sr.lock);
+
+	free(sr.wheels);
+	free(sr.menus);
+	return sr.found;
+}
+
+void
+crib_print(FILE *f, const struct crib_result *r) {
+	int i, unknown = 0;
+
+	fprintf(f, "# crib at offset %ld", r->offset);
+	for (i = 0; i < MAP_SIZE; i++) {
+		if (r->plugboard[i] == '?') {
+			fprintf(f, "%s%c", unknown++ ? "" : ", no stecker found for ", DECODE(i));
+		}
+	}
+	fprintf(f, "\n");
+
+	fprintf(f, "mode=%d\n", r->mode);
+	for (i = 0; i < (r->mode == MODE_M4 ? RACK_SIZE : RACK_SIZE - 1); i++) {
+		fprintf(f, "r%d=%d %d %d\n", i, r->rotor[i], r->rotation[i], r->ringset[i]);
+	}
+	fprintf(f, "reflector=%d\n", r->reflector);
+	for (i = 0; i < MAP_SIZE; i++) {
+		if (r->plugboard[i] != '?' && r->plugboard[i] > DECODE(i)) {
+			fprintf(f, "%c=%c\n", DECODE(i), r->plugboard[i]);
+		}
+	}
+}
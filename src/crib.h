@@ -0,0 +1,55 @@
+#ifndef CRIB_H
+#define CRIB_H
+
+#include "enigma.h"
+#include <stdio.h>
+
+#define CRIB_MAX 256 // longest crib searched
+
+// A setting which survived the search. Rotors are given by slot, as in settings.conf,
+// with the rotations being the ground setting at the start of the message
+struct crib_result {
+	int mode, reflector;
+	int rotor[4], rotation[4], ringset[4];
+	long offset;         // where the crib sits in the ciphertext
+	char plugboard[26];  // stecker partner of each letter, '?' where the crib says nothing
+};
+
+typedef void (*crib_found_fn)(const struct crib_result *r, void *arg);
+
+// Known plaintext attack. Every wheel order (drawn from rotor_mask), reflector, ground
+// setting and (depending on rings) ring setting is tried against the crib. Candidates
+// are rejected by the fact that the enigma never encrypts a letter to itself, and by
+// bombe style deduction of the plugboard: each crib letter and its ciphertext letter
+// are joined by the scrambler at that position, and a guess for the stecker of one
+// letter implies the steckers of every letter joined to it. A setting survives if the
+// steckers can be guessed without contradiction.
+//
+// A wheel order and reflector is one task for the thread pool, which builds the
+// compiled tables of an unplugged machine and runs every ground and ring setting
+// through them.
+//
+// Ring settings only matter where turnovers happen (otherwise they are equivalent to a
+// different ground setting), so rings = 0 searches ground settings only, 1 adds the
+// ring of the fast rotor and 2 the ring of the middle rotor too.
+struct crib_search {
+	const char *cipher;       // ciphertext, anything but letters is ignored
+	size_t cipher_len;
+	const char *crib;         // known plaintext (a string), anything but letters is ignored
+	long offset;              // position of the crib in the ciphertext, -1 for anywhere
+	int mode;                 // MODE_M3 or MODE_M4
+	int rings;                // 0, 1 or 2 as above
+	int threads;
+	unsigned int rotor_mask;  // bit (1 << ROTOR_x) for each rotor allowed in slots 0-2,
+	                          // 0 for rotors I-VIII
+	crib_found_fn found;      // called (one call at a time) for each surviving setting
+	void *arg;
+};
+
+// Returns the number of surviving settings, or -1 if the search could not be started
+long crib_search(struct crib_search *s);
+
+// writes a result in the format of a settings file
+void crib_print(FILE *f, const struct crib_result *r);
+
+#endif
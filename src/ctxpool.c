@@ -0,0 +1,175 @@
+#include "ctxpool.h"
+#include "enigma_internal.h"
+#include "stats.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_SIZE 64 // contexts in a slab
+
+struct slab {
+	struct enigma_ctx ctx[SLAB_SIZE];
+	struct slab *next;
+};
+
+// a free context holds the next free context in place of its contents
+struct free_ctx {
+	struct free_ctx *next;
+};
+
+// one cache line (or more) each, so workers never share a line
+struct worker {
+	_Alignas(CACHE_LINE)
+	struct free_ctx *free;
+	struct slab *slabs;
+};
+
+// the counters are shared by every worker, so they are atomic, and relaxed since
+// nothing else is ordered by them
+struct ctx_pool {
+	int workers;
+	_Atomic long in_use, peak;
+	_Atomic size_t slabs;
+	struct worker w[];
+};
+
+static void
+read_gauges(const void *arg, uint64_t gauge[GAUGES]) {
+	struct ctx_pool_usage u;
+
+	ctx_pool_usage(arg, &u);
+	gauge[GAUGE_CTXS_IN_USE] = u.in_use;
+	gauge[GAUGE_CTXS_PEAK] = u.peak;
+	gauge[GAUGE_CTXS_CAPACITY] = u.capacity;
+	gauge[GAUGE_CTX_BYTES] = u.bytes;
+}
+
+ctx_pool *
+ctx_pool_create(int workers) {
+	ctx_pool *p;
+	size_t size;
+
+	if (workers < 1) {
+		workers = 1;
+	}
+	size = sizeof(*p) + workers * sizeof(p->w[0]);
+	size = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+	p = aligned_alloc(CACHE_LINE, size);
+	if (p) {
+		memset(p, 0, size);
+		p->workers = workers;
+		stats_gauges(read_gauges, p);
+	}
+
+	return p;
+}
+
+void
+ctx_pool_destroy(ctx_pool *p) {
+	struct slab *s, *next;
+	int i;
+
+	if (!p) {
+		return;
+	}
+	stats_gauges_drop(p);
+	for (i = 0; i < p->workers; i++) {
+		for (s = p->w[i].slabs; s; s = next) {
+			next = s->next;
+			free(s);
+		}
+	}
+	free(p);
+}
+
+// a context off the free list of worker, growing the pool by a slab if it is empty
+static struct enigma_ctx *
+take(ctx_pool *p, int worker) {
+	struct worker *w = &p->w[worker];
+	struct free_ctx *f;
+	struct slab *s;
+	long n, peak;
+	int i;
+
+	if (!w->free) {
+		s = aligned_alloc(CACHE_LINE, sizeof(*s));
+		if (!s) {
+			return NULL;
+		}
+		s->next = w->slabs;
+		w->slabs = s;
+		atomic_fetch_add_explicit(&p->slabs, 1, memory_order_relaxed);
+		for (i = SLAB_SIZE - 1; i >= 0; i--) {
+			f = (struct free_ctx *)&s->ctx[i];
+			f->next = w->free;
+			w->free = f;
+		}
+	}
+
+	f = w->free;
+	w->free = f->next;
+	n = atomic_fetch_add_explicit(&p->in_use, 1, memory_order_relaxed) + 1;
+	peak = atomic_load_explicit(&p->peak, memory_order_relaxed);
+	while (n > peak && !atomic_compare_exchange_weak_explicit(&p->peak, &peak, n,
+		memory_order_relaxed, memory_order_relaxed)) {
+		;
+	}
+	return (struct enigma_ctx *)f;
+}
+
+enigma_ctx *
+ctx_pool_get(ctx_pool *p, int worker) {
+	struct enigma_ctx *ctx = take(p, worker);
+
+	if (ctx) {
+		memset(ctx, 0, sizeof(*ctx));
+		enigma_init_ctx(ctx);
+	}
+
+	return ctx;
+}
+
+enigma_ctx *
+ctx_pool_clone(ctx_pool *p, int worker, const enigma_ctx *tmpl) {
+	struct enigma_ctx *ctx = take(p, worker);
+
+	if (ctx) {
+		enigma_ctx_copy(ctx, tmpl);
+	}
+
+	return ctx;
+}
+
+void
+ctx_pool_reset(enigma_ctx *ctx, const enigma_ctx *tmpl) {
+	enigma_set_compiled_ctx(ctx, 0); // drops its tables
+	if (tmpl) {
+		enigma_ctx_copy(ctx, tmpl);
+	} else {
+		enigma_init_ctx(ctx);
+	}
+}
+
+void
+ctx_pool_put(ctx_pool *p, int worker, enigma_ctx *ctx) {
+	struct worker *w = &p->w[worker];
+	struct free_ctx *f = (struct free_ctx *)ctx;
+
+	if (!ctx) {
+		return;
+	}
+	enigma_set_compiled_ctx(ctx, 0);
+	f->next = w->free;
+	w->free = f;
+	atomic_fetch_sub_explicit(&p->in_use, 1, memory_order_relaxed);
+}
+
+void
+ctx_pool_usage(const ctx_pool *p, struct ctx_pool_usage *u) {
+	size_t slabs = atomic_load_explicit(&p->slabs, memory_order_relaxed);
+
+	u->in_use = atomic_load_explicit(&p->in_use, memory_order_relaxed);
+	u->peak = atomic_load_explicit(&p->peak, memory_order_relaxed);
+	u->capacity = slabs * SLAB_SIZE;
+	u->bytes = slabs * sizeof(struct slab);
+}
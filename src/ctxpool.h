@@ -0,0 +1,43 @@
+#ifndef CTXPOOL_H
+#define CTXPOOL_H
+
+#include "enigma.h"
+#include <stddef.h>
+
+// Machines for workloads which start and finish a great many of them, such as the
+// sessions of a server or the messages of a batch. Contexts are carved out of slabs
+// and go back on a free list when put, so once the pool has grown to its working size
+// nothing is allocated or freed. Each worker (numbered as by pool_run) has a free list
+// of its own and must be the only thread using that worker number, so nothing is
+// locked. A context may be put by a different worker than the one which got it.
+// Contexts must not be passed to enigma_ctx_destroy. The usage of the pool most
+// recently created is reported with the gauges of stats.h
+typedef struct ctx_pool ctx_pool;
+
+struct ctx_pool_usage {
+	size_t in_use;   // contexts got and not yet put
+	size_t peak;     // highest in_use so far
+	size_t capacity; // contexts in slabs, in use or free
+	size_t bytes;    // memory held by the slabs
+};
+
+ctx_pool *ctx_pool_create(int workers);
+
+// Frees every slab. Contexts still in use become invalid
+void ctx_pool_destroy(ctx_pool *p);
+
+// A machine in its initial state, as from enigma_ctx_create, or NULL if out of memory
+enigma_ctx *ctx_pool_get(ctx_pool *p, int worker);
+
+// A copy of tmpl, as from enigma_ctx_clone, or NULL if out of memory
+enigma_ctx *ctx_pool_clone(ctx_pool *p, int worker, const enigma_ctx *tmpl);
+
+// Sets ctx back to the initial state, or to a copy of tmpl if it is not NULL, without
+// returning it to the pool
+void ctx_pool_reset(enigma_ctx *ctx, const enigma_ctx *tmpl);
+
+void ctx_pool_put(ctx_pool *p, int worker, enigma_ctx *ctx);
+
+void ctx_pool_usage(const ctx_pool *p, struct ctx_pool_usage *u);
+
+#endif
@@ -1,246 +1,815 @@
 #include "enigma.h"
+#include "enigma_internal.h"
+#include "io.h"
+#include "keystream.h"
+#include "stats.h"
+#include "tablecache.h"
+#include "wiring.h"
 #include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define RACK_SIZE   4
-#define MAX_NOTCHES 2
-#define MAP_SIZE    26
-#define BUF_MAX     32
+#define BUF_MAX 32
 
-#define DECODE(x)((x)+'A') // index to letter
-#define ENCODE(x)((x)-'A') // letter to index
-#define IS_VALID(x)(((x)>=0) && ((x)<MAP_SIZE)) // check if x can be encrypted
+// bit mask of the notches listed in a wiring.h NOTCHES macro
+#define NOTCH_MASK(n) NOTCH_BITS(n)
+#define NOTCH_BITS(a, b) (((a) < 0 ? 0 : 1u << (a)) | ((b) < 0 ? 0 : 1u << (b)))
 
-struct encrypter {
-	int rotation, ringset, num_notches, code;
-	int notches[MAX_NOTCHES];   
-	char map[MAP_SIZE];  // input to output map (for forward pass)
-	char inv[MAP_SIZE];  // output to input maps (for backward pass)
+// Forward and backward wiring of each rotor, by ROTOR_ code, as letters
+static const char *rotor_wiring[ROTORS][2] = {
+	{ ROTOR_I_MAP, ROTOR_I_INV },
+	{ ROTOR_II_MAP, ROTOR_II_INV },
+	{ ROTOR_III_MAP, ROTOR_III_INV },
+	{ ROTOR_IV_MAP, ROTOR_IV_INV },
+	{ ROTOR_V_MAP, ROTOR_V_INV },
+	{ ROTOR_VI_MAP, ROTOR_VI_INV },
+	{ ROTOR_VII_MAP, ROTOR_VII_INV },
+	{ ROTOR_VIII_MAP, ROTOR_VIII_INV },
+	{ ROTOR_B_MAP, ROTOR_B_INV }, // beta
+	{ ROTOR_G_MAP, ROTOR_G_INV }  // gamma
 };
 
-static struct encrypter rotors[] = {
-	// Rotor I
-	{ .rotation=0, .ringset=0, .num_notches=1, .notches={16}, .code=ROTOR_I,
-		.map="EKMFLGDQVZNTOWYHXUSPAIBRCJ", .inv="UWYGADFPVZBECKMTHXSLRINQOJ" },
-	// Rotor II
-	{ .rotation=0, .ringset=0, .num_notches=1, .notches={4}, .code=ROTOR_II,
-		.map="AJDKSIRUXBLHWTMCQGZNPYFVOE", .inv="AJPCZWRLFBDKOTYUQGENHXMIVS" },
-	// Rotor III
-	{ .rotation=0, .ringset=0, .num_notches=1, .notches={21}, .code=ROTOR_III,
-		.map="BDFHJLCPRTXVZNYEIWGAKMUSQO", .inv="TAGBPCSDQEUFVNZHYIXJWLRKOM" },
-	// Rotor IV
-	{ .rotation=0, .ringset=0, .num_notches=1, .notches={9}, .code=ROTOR_IV,
-		.map="ESOVPZJAYQUIRHXLNFTGKDCMWB", .inv="HZWVARTNLGUPXQCEJMBSKDYOIF" },
-	// Rotor V
-	{ .rotation=0, .ringset=0, .num_notches=1, .notches={25}, .code=ROTOR_V,
-		.map="VZBRGITYUPSDNHLXAWMJQOFECK", .inv="QCYLXWENFTZOSMVJUDKGIARPHB" },
-	// Rotor VI
-	{ .rotation=0, .ringset=0, .num_notches=2, .notches={25,12}, .code=ROTOR_VI,
-		.map="JPGVOUMFYQBENHZRDKASXLICTW", .inv="SKXQLHCNWARVGMEBJPTYFDZUIO" },
-	// Rotor VII
-	{ .rotation=0, .ringset=0, .num_notches=2, .notches={25,12}, .code=ROTOR_VII,
-		.map="NZJHGRCXMYSWBOUFAIVLPEKQDT", .inv="QMGYVPEDRCWTIANUXFKZOSLHJB" },
-	// Rotor VIII
-	{ .rotation=0, .ringset=0, .num_notches=2, .notches={25,12}, .code=ROTOR_VIII,
-		.map="FKQHTLXOCBJSPDZRAMEWNIUYGV", .inv="QJINSAYDVKBFRUHMCPLEWZTGXO" },
-	// Rotor b (beta)
-	{ .rotation=0, .ringset=0, .num_notches=0, .code=ROTOR_B,
-		.map="LEYJVCNIXWPBQMDRTAKZGFUHOS", .inv="RLFOBVUXHDSANGYKMPZQWEJICT" },
-	// Rotor g (gamma)
-	{ .rotation=0, .ringset=0, .num_notches=0, .code=ROTOR_G,
-		.map="FSOKANUERHMBTIYCWLQPZXVGJD", .inv="ELPZHAXJNYDRKFCTSIBMGWQVOU" }
+static const uint32_t rotor_notches[ROTORS] = {
+	NOTCH_MASK(ROTOR_I_NOTCHES), NOTCH_MASK(ROTOR_II_NOTCHES),
+	NOTCH_MASK(ROTOR_III_NOTCHES), NOTCH_MASK(ROTOR_IV_NOTCHES),
+	NOTCH_MASK(ROTOR_V_NOTCHES), NOTCH_MASK(ROTOR_VI_NOTCHES),
+	NOTCH_MASK(ROTOR_VII_NOTCHES), NOTCH_MASK(ROTOR_VIII_NOTCHES),
+	NOTCH_MASK(ROTOR_B_NOTCHES), NOTCH_MASK(ROTOR_G_NOTCHES)
 };
 
 // On the physical machine, the reflector would sit at the end of the rack and 
 // **reflect** the electrical impulse representing the encoded character back through
 // the series of rotors in the rack.
-static struct encrypter reflectors[] = {
-	{ .map = "YRUHQSLDPXNGOKMIEBFZCWVJAT", .code=REFLECTOR_B },      // M3 B
-	{ .map = "FVPJIAOYEDRZXWGCTKUQSBNMHL", .code=REFLECTOR_C },      // M3 C
-	{ .map = "ENKQAUYWJICOPBLMDXZVFTHRGS", .code=REFLECTOR_B_THIN }, // M4 B thin
-	{ .map = "RDOBJNTKVEHMLFCWZAXGYIPSUQ", .code=REFLECTOR_C_THIN }, // M4 C thin
+static const char *reflector_wiring[REFLECTORS] = {
+	REFLECTOR_B_MAP,      // M3 B
+	REFLECTOR_C_MAP,      // M3 C
+	REFLECTOR_B_THIN_MAP, // M4 B thin
+	REFLECTOR_C_THIN_MAP  // M4 C thin
 };
 
-// The plugboard was used by the enigma operator to specifically wire an input/output
-// to a different value before and after it hit the rack. By default every character in
-// the plugboard maps to itself.
-static struct encrypter plugboard = { .map = "ABCDEFGHIJKLMNOPQRSTUVWXYZ" };
+unsigned char enigma_rotor_fwd[ROTORS][2 * MAP_SIZE];
+unsigned char enigma_rotor_inv[ROTORS][2 * MAP_SIZE];
+unsigned char enigma_reflector_map[REFLECTORS][2 * MAP_SIZE];
 
-// Rotor configurations in the rack. Note that the rotor in the fourth position is only 
-// used if we are in MODE_M4
-static struct encrypter rack[RACK_SIZE]; // Sequence of rotors to be used for encryption
-static struct encrypter reflector;       // Index of chosen reflector
-static int mode = MODE_M3;               // Type of Enigma machine being emulated
-static int num_rotors = 3;               // Number of rotors in the rack (mode dependent)
+static pthread_once_t wiring_once = PTHREAD_ONCE_INIT;
 
-static int
-offset(struct encrypter *e, int c) {
-	c = (MAP_SIZE + (c - e->ringset)) % MAP_SIZE; // ringset offset - negative modulus
-	return (c + e->rotation) % MAP_SIZE;          // rotation offset
+// by ROTOR_ code of the first and second rotor
+static _Atomic(struct enigma_schedule *) schedules[ROTORS][ROTORS];
+
+// Machine used by the original, context free, API
+static struct enigma_ctx machine = {
+	.plugboard = {
+		0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21,
+		22, 23, 24, 25, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17,
+		18, 19, 20, 21, 22, 23, 24, 25
+	},
+	.mode = MODE_M3,
+	.num_rotors = 3
+};
+
+static void
+build_wiring(void) {
+	int i, x;
+
+	for (x = 0; x < 2 * MAP_SIZE; x++) {
+		for (i = 0; i < ROTORS; i++) {
+			enigma_rotor_fwd[i][x] = ENCODE(rotor_wiring[i][0][x % MAP_SIZE]);
+			enigma_rotor_inv[i][x] = ENCODE(rotor_wiring[i][1][x % MAP_SIZE]);
+		}
+		for (i = 0; i < REFLECTORS; i++) {
+			enigma_reflector_map[i][x] = ENCODE(reflector_wiring[i][x % MAP_SIZE]);
+		}
+	}
 }
 
+// how far the core of a rotor is turned from A: its rotation less its ring setting
 static int
-undo_offset(struct encrypter *e, int c) {
-	c = (MAP_SIZE + (c - e->rotation)) % MAP_SIZE; // undo rotation offset - neg modulo
-	return (c + e->ringset) % MAP_SIZE;            // undo ringset offset
+core_offset(const struct rotor *e) {
+	return WRAP(e->rotation + MAP_SIZE - e->ringset);
 }
 
+// through rotor e forwards (or backwards) with its core turned to off
 static int
-inv_crypt(struct encrypter *e, int c) {
-	c = offset(e, c);         // offset for rotation and ringset
-	c = ENCODE(e->inv[c]);    // crypt
-	return undo_offset(e, c); // undo offset for rotation and ringset
+crypt(const struct rotor *e, int off, int c) {
+	return WRAP(enigma_rotor_fwd[e->code][c + off] + MAP_SIZE - off);
 }
 
 static int
-crypt(struct encrypter *e, int c) {
-	c = offset(e, c);         // offset for rotation and ringset
-	c = ENCODE(e->map[c]);    // crypt
-	return undo_offset(e, c); // undo offset for rotation and ringset
+inv_crypt(const struct rotor *e, int off, int c) {
+	return WRAP(enigma_rotor_inv[e->code][c + off] + MAP_SIZE - off);
 }
 
 static int
-is_notched(struct encrypter *e) {
-	int i;
-
-	for (i = 0; i < e->num_notches; i++) {
-		if (e->notches[i] == e->rotation)
-			return 1;
-	}
-
-	return 0;
+is_notched(const struct rotor *e) {
+	return (e->notches >> e->rotation) & 1;
 }
 
 static void
-spin_rotors ( void ) {
+spin_rotors(struct enigma_ctx *ctx) {
+	struct rotor *rack = ctx->rack;
+
 	// check if rotor 2 is in the notch position
 	if(is_notched(&rack[1])){
 		// if so, rotate rotors 2 and 3 forwards, implementing double stepping
-		rack[1].rotation = (++rack[1].rotation) % MAP_SIZE;
-		rack[2].rotation = (++rack[2].rotation) % MAP_SIZE;
+		rack[1].rotation = WRAP(rack[1].rotation + 1);
+		rack[2].rotation = WRAP(rack[2].rotation + 1);
 	}
 
 	// if rotor 1 is in the notched position, rotate rotor 2 forwards
 	if(is_notched(&rack[0]))
-		rack[1].rotation = (++rack[1].rotation) % MAP_SIZE;
+		rack[1].rotation = WRAP(rack[1].rotation + 1);
 
 	// rotor 1 always rotates.
-	rack[0].rotation = (++rack[0].rotation) % MAP_SIZE;
+	rack[0].rotation = WRAP(rack[0].rotation + 1);
+}
+
+// key presses before the rotor next sits at one of its notches
+static int
+to_notch(const struct rotor *e) {
+	uint32_t m = e->notches >> e->rotation | e->notches << (MAP_SIZE - e->rotation);
+
+	m &= (1u << MAP_SIZE) - 1; // notches ahead of the rotor, nearest in bit 0
+	return m ? __builtin_ctz(m) : MAP_SIZE;
+}
+
+// Presses n keys. Between turnovers only rotor 1 moves, so rather than spinning the
+// rotors for every key, rotor 1 is jumped straight to its next notch
+static void
+advance(struct enigma_ctx *ctx, uint64_t n) {
+	struct rotor *rack = ctx->rack;
+	uint64_t d;
+
+	while (n) {
+		if (!is_notched(&rack[1])) {
+			d = to_notch(&rack[0]);
+			if (d >= n) {
+				rack[0].rotation = (rack[0].rotation + n % MAP_SIZE) % MAP_SIZE;
+				return;
+			}
+			rack[0].rotation = (rack[0].rotation + d) % MAP_SIZE;
+			n -= d;
+		}
+		spin_rotors(ctx);
+		n--;
+	}
 }
 
+#ifdef ENIGMA_STATS
+// As advance, on a copy of the stepping rotors, counting their steps
 void
-enigma_init ( void ) {    
-	enigma_load_rotor(0, ROTOR_III);
-	enigma_load_rotor(1, ROTOR_II);
-	enigma_load_rotor(2, ROTOR_I);
-	enigma_load_rotor(3, ROTOR_B);
-	enigma_load_reflector(REFLECTOR_B);
-	enigma_set_mode(MODE_M3);
+enigma_count_steps(const struct enigma_ctx *ctx, uint64_t n) {
+	struct rotor rack[3] = { ctx->rack[0], ctx->rack[1], ctx->rack[2] };
+	uint64_t d, steps1 = 0, steps2 = 0;
+
+	if (ctx->rotation_stale) {
+		rack[0].rotation = ctx->pos % MAP_SIZE;
+		rack[1].rotation = ctx->pos / MAP_SIZE % MAP_SIZE;
+		rack[2].rotation = ctx->pos / (MAP_SIZE * MAP_SIZE);
+	}
+
+	STATS_ADD(STAT_STEPS_0, n);
+	while (n) {
+		if (!is_notched(&rack[1])) {
+			d = to_notch(&rack[0]);
+			if (d >= n) {
+				break;
+			}
+			rack[0].rotation = (rack[0].rotation + d) % MAP_SIZE;
+			n -= d;
+		}
+		if (is_notched(&rack[1])) {
+			rack[1].rotation = WRAP(rack[1].rotation + 1);
+			rack[2].rotation = WRAP(rack[2].rotation + 1);
+			steps1++;
+			steps2++;
+		}
+		if (is_notched(&rack[0])) {
+			rack[1].rotation = WRAP(rack[1].rotation + 1);
+			steps1++;
+		}
+		rack[0].rotation = WRAP(rack[0].rotation + 1);
+		n--;
+	}
+	STATS_ADD(STAT_STEPS_1, steps1);
+	STATS_ADD(STAT_STEPS_2, steps2);
+	STATS_ADD(STAT_DOUBLE_STEPS, steps2);
 }
+#endif
 
-char
-enigma_encode(char c) {
-	int i;
-	char ec = ENCODE(toupper(c));
-	
-	if (IS_VALID(ec)) {
-		// first, rotors spin on key press
-		spin_rotors();
+// After its first key press a machine is always on a cycle of positions, whose length
+// only depends on how many notches the first two rotors have. Rotor 2 steps every
+// 26/k1 presses, and moves on twice (double stepping) at one of its 26/k2 notches,
+// so rotor 3 turns once every 26/k1 * (26/k2 - 1) presses
+static uint64_t
+cycle_length(struct enigma_ctx *ctx) {
+	return (uint64_t)(MAP_SIZE / __builtin_popcount(ctx->rack[0].notches)) * 
+		(MAP_SIZE / __builtin_popcount(ctx->rack[1].notches) - 1) * MAP_SIZE;
+}
+
+static int
+position(struct enigma_ctx *ctx) {
+	return ctx->rack[0].rotation + MAP_SIZE * 
+		(ctx->rack[1].rotation + MAP_SIZE * ctx->rack[2].rotation);
+}
+
+static void
+set_position(struct enigma_ctx *ctx, int pos) {
+	ctx->rack[0].rotation = pos % MAP_SIZE;
+	ctx->rack[1].rotation = pos / MAP_SIZE % MAP_SIZE;
+	ctx->rack[2].rotation = pos / (MAP_SIZE * MAP_SIZE);
+}
+
+// write rotor positions held by compiled mode back into the rack
+static void
+sync_rotation(struct enigma_ctx *ctx) {
+	if (ctx->rotation_stale) {
+		set_position(ctx, ctx->pos);
+		ctx->rotation_stale = 0;
+	}
+}
+
+static struct enigma_schedule *
+build_schedule(int r0, int r1) {
+	unsigned char seen[POSITIONS] = {0}; // 1 on the current walk, 2 done
+	struct enigma_schedule *s;
+	struct enigma_ctx tmp = {0};
+	int p, q, r, n = 0;
+
+	s = malloc(sizeof(*s));
+	if (!s) {
+		return NULL;
+	}
+
+	// stepping sequence, using the interpreted machine
+	tmp.rack[0].notches = rotor_notches[r0];
+	tmp.rack[1].notches = rotor_notches[r1];
+	for (p = 0; p < POSITIONS; p++) {
+		set_position(&tmp, p);
+		spin_rotors(&tmp);
+		s->next[p] = position(&tmp);
+	}
+	for (p = POSITIONS - 1; p >= 0; p--) {
+		r = 0;
+		if (s->next[p] == p + 1) {
+			r = (p + 1 < POSITIONS) ? s->run[p + 1] : 0;
+			r = (r < 255) ? r + 1 : 255;
+		}
+		s->run[p] = r;
+	}
+
+	// Walks on from every position not yet seen. A walk which runs into itself has
+	// found a new cycle
+	memset(s->slot, 0xff, sizeof(s->slot));
+	s->length = 0;
+	for (p = 0; p < POSITIONS; p++) {
+		for (q = p; !seen[q]; q = s->next[q]) {
+			seen[q] = 1;
+		}
+		if (seen[q] == 1) {
+			r = q;
+			do {
+				s->slot[r] = n;
+				s->order[n++] = r;
+				r = s->next[r];
+			} while (r != q);
+			s->length = n - s->slot[q];
+		}
+		for (q = p; seen[q] == 1; q = s->next[q]) {
+			seen[q] = 2;
+		}
+	}
+
+	return s;
+}
+
+const struct enigma_schedule *
+enigma_schedule_get(int r0, int r1) {
+	struct enigma_schedule *s, *built = NULL;
+
+	s = atomic_load(&schedules[r0][r1]);
+	if (!s && (s = build_schedule(r0, r1)) &&
+		!atomic_compare_exchange_strong(&schedules[r0][r1], &built, s)) {
+		free(s); // built by another thread in the meantime
+		s = built;
+	}
+
+	return s;
+}
 
-		// letter passes through plugboard
-		ec = crypt(&plugboard, ec);
+static const struct enigma_schedule *
+schedule(const struct enigma_ctx *ctx) {
+	return enigma_schedule_get(ctx->rack[0].code, ctx->rack[1].code);
+}
+
+static void
+release_table(struct enigma_ctx *ctx) {
+	sync_rotation(ctx);
+	if (ctx->table) {
+		enigma_table_release(ctx->table);
+	}
+	ctx->table = NULL;
+}
+
+void
+enigma_table_release(struct enigma_table *t) {
+	if (atomic_fetch_sub(&t->refs, 1) == 1) {
+		free(t);
+	}
+}
+
+// forward and inverse maps of a rotor turned to the given rotation
+static void
+rotor_maps(const struct rotor *e, int rotation, int *fwd, int *inv) {
+	int i, off = WRAP(rotation + MAP_SIZE - e->ringset);
+
+	for (i = 0; i < MAP_SIZE; i++) {
+		fwd[i] = crypt(e, off, i);
+		inv[i] = inv_crypt(e, off, i);
+	}
+}
+
+// Takes the rows of a table from the unplugged table with rings at 0 of the same
+// wheels, found in the table cache. The row at rotations p is the cached row at p less
+// the ring settings, wrapped in the plugboard
+static void
+copy_table(struct enigma_ctx *ctx, struct enigma_table *t, const table_row *cached) {
+	const unsigned char *plug = ctx->plugboard, *row;
+	int r0 = ctx->rack[0].ringset, r1 = ctx->rack[1].ringset, r2 = ctx->rack[2].ringset;
+	int a, b, c, p, x;
+
+	for (p = c = 0; c < MAP_SIZE; c++) {
+		for (b = 0; b < MAP_SIZE; b++) {
+			for (a = 0; a < MAP_SIZE; a++, p++) {
+				row = cached[WRAP(a + MAP_SIZE - r0) + MAP_SIZE *
+					(WRAP(b + MAP_SIZE - r1) + MAP_SIZE * WRAP(c + MAP_SIZE - r2))];
+				for (x = 0; x < MAP_SIZE; x++) {
+					t->rows[p][x] = plug[row[plug[x]]];
+				}
+				memset(&t->rows[p][MAP_SIZE], 0, ROW_SIZE - MAP_SIZE);
+			}
+		}
+	}
+}
+
+// Builds the tables from the inside of the machine out. The reflector (and the static
+// fourth rotor) are folded into each position of rotor 3, those into each position of
+// rotors 2 and 3, and finally rotor 1 and the plugboard wrap each of the 26^3 positions.
+// With lookup set and a table cache in use the rows come from the cache instead:
+// unplugged machines with rings at 0 use the cached rows as they are, others copy them
+static struct enigma_table *
+make_table(struct enigma_ctx *ctx, int lookup) {
+	int fwd[RACK_SIZE][MAP_SIZE][MAP_SIZE], inv[RACK_SIZE][MAP_SIZE][MAP_SIZE];
+	int plug[MAP_SIZE], core[MAP_SIZE], m2[MAP_SIZE][MAP_SIZE], m1[MAP_SIZE][MAP_SIZE];
+	const struct enigma_schedule *s;
+	const table_row *cached;
+	struct enigma_table *t;
+	int i, r, a, b, c, p, x, plain;
+
+	s = schedule(ctx);
+	cached = lookup ? table_cache_rows(ctx) : NULL;
+	for (plain = 1, i = 0; i < MAP_SIZE; i++) {
+		plain &= ctx->plugboard[i] == i;
+	}
+	plain &= !ctx->rack[0].ringset && !ctx->rack[1].ringset && !ctx->rack[2].ringset;
+	t = malloc(sizeof(*t) + (cached && plain ? 0 : sizeof(t->rows[0]) * POSITIONS));
+	if (!s || !t) {
+		free(t);
+		return NULL;
+	}
+	atomic_init(&t->refs, 1);
+	t->next = s->next;
+	t->run = s->run;
+	t->owns_rows = !cached || !plain;
+	t->perm = t->owns_rows ? t->rows : cached;
+	if (cached) {
+		if (!plain) {
+			copy_table(ctx, t, cached);
+		}
+		return t;
+	}
 
-		// then through each of the rotors in turn
-		for(i = 0; i < num_rotors; i++) {
-			ec = crypt(&rack[i], ec);
+	for (i = 0; i < ctx->num_rotors; i++) {
+		for (r = 0; r < MAP_SIZE; r++) {
+			rotor_maps(&ctx->rack[i], r, fwd[i][r], inv[i][r]);
 		}
+	}
 
-		// bounce through the reflector
-		ec = crypt(&reflector, ec);
+	// reflector, with the fourth rotor on either side of it in MODE_M4
+	for (x = 0; x < MAP_SIZE; x++) {
+		plug[x] = ctx->plugboard[x];
+		if (ctx->num_rotors > 3) {
+			r = ctx->rack[3].rotation;
+			core[x] = inv[3][r][enigma_reflector_map[ctx->reflector][fwd[3][r][x]]];
+		} else {
+			core[x] = enigma_reflector_map[ctx->reflector][x];
+		}
+	}
 
-		// back through the rotors in the opposite direction
-		for (--i; i >= 0; i--) {
-			ec = inv_crypt(&rack[i], ec);
+	for (c = 0; c < MAP_SIZE; c++) {
+		for (x = 0; x < MAP_SIZE; x++) {
+			m2[c][x] = inv[2][c][core[fwd[2][c][x]]];
+		}
+	}
+
+	for (c = 0; c < MAP_SIZE; c++) {
+		for (b = 0; b < MAP_SIZE; b++) {
+			for (x = 0; x < MAP_SIZE; x++) {
+				m1[b][x] = inv[1][b][m2[c][fwd[1][b][x]]];
+			}
+			for (a = 0; a < MAP_SIZE; a++) {
+				p = a + MAP_SIZE * (b + MAP_SIZE * c);
+				for (x = 0; x < MAP_SIZE; x++) {
+					t->rows[p][x] = plug[inv[0][a][m1[b][fwd[0][a][plug[x]]]]];
+				}
+				memset(&t->rows[p][MAP_SIZE], 0, ROW_SIZE - MAP_SIZE);
+			}
 		}
+	}
+
+	return t;
+}
+
+// Machines with the same settings but for their ground settings share one table
+// through the keystream cache, when it is on
+static struct enigma_table *
+build_table(struct enigma_ctx *ctx) {
+	struct enigma_table *t;
+
+	if (!(t = keystream_get(ctx)) && (t = make_table(ctx, 1))) {
+		t = keystream_put(ctx, t);
+	}
+	return t;
+}
+
+struct enigma_table *
+enigma_table_build(struct enigma_ctx *ctx) {
+	return make_table(ctx, 0);
+}
+
+uint32_t
+enigma_wiring_crc(void) {
+	uint32_t crc;
+
+	pthread_once(&wiring_once, build_wiring);
+	crc = crc32(0, enigma_rotor_fwd, sizeof(enigma_rotor_fwd));
+	crc = crc32(crc, enigma_rotor_inv, sizeof(enigma_rotor_inv));
+	return crc32(crc, enigma_reflector_map, sizeof(enigma_reflector_map));
+}
+
+int
+enigma_table_ready(struct enigma_ctx *ctx) {
+	if (!ctx->compiled || (!ctx->table && !(ctx->table = build_table(ctx)))) {
+		return 0;
+	}
+	if (!ctx->rotation_stale) {
+		ctx->pos = position(ctx);
+		ctx->rotation_stale = 1;
+	}
+	return 1;
+}
+
+// Between the rotors the letter is carried as a contact of the core it has just left
+// rather than of the machine, so moving it into the next core is a single add of the
+// difference between the two core offsets, and the doubled tables take the sum as is
+int
+enigma_encode_index(struct enigma_ctx *ctx, int ec) {
+	const struct rotor *rack = ctx->rack;
+	int off[RACK_SIZE];
+	int i, prev;
+
+	if (enigma_table_ready(ctx)) {
+		ctx->pos = ctx->table->next[ctx->pos];
+		return ctx->table->perm[ctx->pos][ec];
+	}
+
+	// first, rotors spin on key press
+	sync_rotation(ctx);
+	spin_rotors(ctx);
+
+	// letter passes through plugboard
+	ec = ctx->plugboard[ec];
+
+	// then through each of the rotors in turn
+	for (i = 0, prev = 0; i < ctx->num_rotors; i++) {
+		off[i] = core_offset(&rack[i]);
+		ec = enigma_rotor_fwd[rack[i].code][ec + WRAP(off[i] + MAP_SIZE - prev)];
+		prev = off[i];
+	}
+
+	// bounce through the reflector, which does not turn
+	ec = enigma_reflector_map[ctx->reflector][ec + MAP_SIZE - prev];
+
+	// back through the rotors in the opposite direction
+	for (--i, prev = 0; i >= 0; i--) {
+		ec = enigma_rotor_inv[rack[i].code][ec + WRAP(off[i] + MAP_SIZE - prev)];
+		prev = off[i];
+	}
+
+	// lastly, through the plugboard again
+	return ctx->plugboard[ec + MAP_SIZE - prev];
+}
+
+enigma_ctx *
+enigma_ctx_create(void) {
+	enigma_ctx *ctx;
+
+	ctx = aligned_alloc(CACHE_LINE, sizeof(*ctx));
+	if (ctx) {
+		memset(ctx, 0, sizeof(*ctx));
+		enigma_init_ctx(ctx);
+	}
+
+	return ctx;
+}
+
+enigma_ctx *
+enigma_ctx_clone(const enigma_ctx *ctx) {
+	enigma_ctx *copy;
 
-		// lastly, through the plugboard again
-		ec = crypt(&plugboard, ec);
+	copy = aligned_alloc(CACHE_LINE, sizeof(*copy));
+	if (copy) {
+		enigma_ctx_copy(copy, ctx);
+	}
+
+	return copy;
+}
+
+void
+enigma_ctx_copy(struct enigma_ctx *dst, const struct enigma_ctx *src) {
+	*dst = *src;
+	if (dst->table) {
+		atomic_fetch_add(&dst->table->refs, 1);
+	}
+}
+
+void
+enigma_ctx_destroy(enigma_ctx *ctx) {
+	if (ctx) {
+		release_table(ctx);
+	}
+	free(ctx);
+}
+
+void
+enigma_init_ctx(enigma_ctx *ctx) {
+	int i;
 
+	release_table(ctx);
+	for (i = 0; i < 2 * MAP_SIZE; i++) {
+		ctx->plugboard[i] = i % MAP_SIZE;
+	}
+	enigma_load_rotor_ctx(ctx, 0, ROTOR_III);
+	enigma_load_rotor_ctx(ctx, 1, ROTOR_II);
+	enigma_load_rotor_ctx(ctx, 2, ROTOR_I);
+	enigma_load_rotor_ctx(ctx, 3, ROTOR_B);
+	ctx->mode = MODE_M3;
+	enigma_load_reflector_ctx(ctx, REFLECTOR_B);
+	enigma_set_mode_ctx(ctx, MODE_M3);
+}
+
+char
+enigma_encode_ctx(enigma_ctx *ctx, char c) {
+	char ec = ENCODE(toupper(c));
+	
+	if (IS_VALID(ec)) {
+#ifdef ENIGMA_STATS
+		STATS_ADD(STAT_ENCODED, 1);
+		enigma_count_steps(ctx, 1);
+#endif
 		// get the encrypted letter as a char
-		c = DECODE(ec);
+		c = DECODE(enigma_encode_index(ctx, ec));
+	} else {
+		STATS_ADD(STAT_SKIPPED, 1);
 	}
 
 	return c; // return encrypted letter or original symbol if not valid for encryption
 }
 
 void
-enigma_plugboard_map(char a, char b) {
-
+enigma_plugboard_map_ctx(enigma_ctx *ctx, char a, char b) {
+	unsigned char *plugboard = ctx->plugboard;
 	int tmp, ea, eb;
+
 	a = toupper(a); b = toupper(b); // upper case inputs
 	ea = ENCODE(a); eb = ENCODE(b); // convert ASCII codes to zeroed indexes
 
 	if (IS_VALID(ea) && IS_VALID(eb)) {        
+		release_table(ctx);
+
 		// remove any existing connections which a and b might have
-		if((tmp=crypt(&plugboard, ea)) != ea) { plugboard.map[tmp] = DECODE(tmp); }
-		if((tmp=crypt(&plugboard, eb)) != eb) { plugboard.map[tmp] = DECODE(tmp); }
+		tmp = plugboard[ea]; plugboard[tmp] = plugboard[MAP_SIZE + tmp] = tmp;
+		tmp = plugboard[eb]; plugboard[tmp] = plugboard[MAP_SIZE + tmp] = tmp;
 
 		// wire a to b and vice versa
-		plugboard.map[ea] = b;
-		plugboard.map[eb] = a;
+		plugboard[ea] = plugboard[MAP_SIZE + ea] = eb;
+		plugboard[eb] = plugboard[MAP_SIZE + eb] = ea;
 	}
 }
 
 void
-enigma_load_rotor(int slot, int rotor) {
+enigma_load_rotor_ctx(enigma_ctx *ctx, int slot, int rotor) {
 	if ((rotor >= ROTOR_B && slot == (RACK_SIZE - 1)) || 
 		(rotor < ROTOR_B && slot < (RACK_SIZE - 1) ) ) {
-		rack[slot] = rotors[rotor];
+		pthread_once(&wiring_once, build_wiring);
+		release_table(ctx);
+		ctx->rack[slot] = (struct rotor){ .code = rotor, .notches = rotor_notches[rotor] };
 	} 
 }
 
 void
-enigma_set_rotation(int slot, int rotation) {
+enigma_set_rotation_ctx(enigma_ctx *ctx, int slot, int rotation) {
 	rotation = (MAP_SIZE + rotation%MAP_SIZE) % MAP_SIZE;
-	rack[slot].rotation = rotation;
+	if (slot == RACK_SIZE - 1) {
+		release_table(ctx); // the fourth rotor is folded into the tables
+	}
+	sync_rotation(ctx);
+	ctx->rack[slot].rotation = rotation;
 }
 
 void
-enigma_set_ringset(int slot, int ringset) {
+enigma_set_ringset_ctx(enigma_ctx *ctx, int slot, int ringset) {
 	ringset = (MAP_SIZE + ringset % MAP_SIZE) % MAP_SIZE;
-	rack[slot].ringset = ringset;
+	release_table(ctx);
+	ctx->rack[slot].ringset = ringset;
 }
 
 void
-enigma_load_reflector(int ref) {
+enigma_load_reflector_ctx(enigma_ctx *ctx, int ref) {
+	int mode = ctx->mode;
+
 	if ((mode && ref >= REFLECTOR_B_THIN) || (!mode && ref < REFLECTOR_B_THIN)) {
-		reflector = reflectors[ref];
+		pthread_once(&wiring_once, build_wiring);
+		release_table(ctx);
+		ctx->reflector = ref;
 	}
 }
 
 void
-enigma_set_mode(int m) {
+enigma_set_mode_ctx(enigma_ctx *ctx, int m) {
 	if (m >= 0 && m <= MODE_M4) {
-		mode = m;
-		switch(mode) {
+		release_table(ctx);
+		ctx->mode = m;
+		switch(ctx->mode) {
 		case MODE_M3:
-			num_rotors = 3;
-			if (reflector.code > REFLECTOR_C) {
-				reflector = reflectors[reflector.code - REFLECTOR_B_THIN];
+			ctx->num_rotors = 3;
+			if (ctx->reflector > REFLECTOR_C) {
+				ctx->reflector -= REFLECTOR_B_THIN;
 			}
 			break;
 		case MODE_M4:            
-			num_rotors = 4;
-			if (reflector.code < REFLECTOR_B_THIN) {
-				reflector = reflectors[reflector.code + REFLECTOR_B_THIN];
+			ctx->num_rotors = 4;
+			if (ctx->reflector < REFLECTOR_B_THIN) {
+				ctx->reflector += REFLECTOR_B_THIN;
 			}
 			break;
 		}
 	}    
 }
 
+void
+enigma_seek_ctx(enigma_ctx *ctx, uint64_t n) {
+	const struct enigma_schedule *s = schedule(ctx);
+	int p, i;
+
+	sync_rotation(ctx);
+	if (!s) {
+		if (n > 1) {
+			advance(ctx, 1);
+			n = (n - 1) % cycle_length(ctx);
+		}
+		advance(ctx, n);
+		return;
+	}
+
+	// onto a cycle, then straight to the position n presses round it
+	for (p = position(ctx); n && s->slot[p] == NO_SLOT; n--) {
+		p = s->next[p];
+	}
+	if (n) {
+		i = s->slot[p] % s->length;
+		p = s->order[s->slot[p] - i + (i + n % s->length) % s->length];
+	}
+	set_position(ctx, p);
+}
+
+int
+enigma_cycle_ctx(enigma_ctx *ctx, int *tail, int *length) {
+	const struct enigma_schedule *s = schedule(ctx);
+	int p;
+
+	if (!s) {
+		return -1;
+	}
+	sync_rotation(ctx);
+	for (p = position(ctx), *tail = 0; s->slot[p] == NO_SLOT; p = s->next[p]) {
+		++*tail;
+	}
+	*length = s->length;
+
+	return 0;
+}
+
+int
+enigma_positions_ctx(enigma_ctx *ctx, uint16_t *out, size_t n) {
+	const struct enigma_schedule *s = schedule(ctx);
+	size_t i;
+	int p;
+
+	if (!s) {
+		return -1;
+	}
+	sync_rotation(ctx);
+	for (i = 0, p = position(ctx); i < n; i++) {
+		out[i] = p = s->next[p];
+	}
+
+	return 0;
+}
+
+void
+enigma_set_compiled_ctx(enigma_ctx *ctx, int on) {
+	if (!on) {
+		release_table(ctx);
+	} else if (!ctx->table) {
+		ctx->table = build_table(ctx);
+	}
+	ctx->compiled = on;
+}
+
+// The original API drives a single, process wide machine
+
+void
+enigma_init(void) {
+	enigma_init_ctx(&machine);
+}
+
+char
+enigma_encode(char c) {
+	return enigma_encode_ctx(&machine, c);
+}
+
+void
+enigma_plugboard_map(char a, char b) {
+	enigma_plugboard_map_ctx(&machine, a, b);
+}
+
+void
+enigma_load_rotor(int slot, int rotor) {
+	enigma_load_rotor_ctx(&machine, slot, rotor);
+}
+
+void
+enigma_set_rotation(int slot, int rotation) {
+	enigma_set_rotation_ctx(&machine, slot, rotation);
+}
+
+void
+enigma_set_ringset(int slot, int ringset) {
+	enigma_set_ringset_ctx(&machine, slot, ringset);
+}
+
+void
+enigma_load_reflector(int ref) {
+	enigma_load_reflector_ctx(&machine, ref);
+}
+
+void
+enigma_set_mode(int m) {
+	enigma_set_mode_ctx(&machine, m);
+}
+
+void
+enigma_set_compiled(int on) {
+	enigma_set_compiled_ctx(&machine, on);
+}
+
+void
+enigma_seek(uint64_t n) {
+	enigma_seek_ctx(&machine, n);
+}
+
+size_t
+enigma_encode_buf(const char *in, char *out, size_t n) {
+	return enigma_encode_buf_ctx(&machine, in, out, n);
+}
+
+void
+enigma_state_save(char *fname) {
+	enigma_state_save_ctx(&machine, fname);
+}
+
+void
+enigma_state_load(char *fname) {
+	enigma_state_load_ctx(&machine, fname);
+}
+
+void
+enigma_print(void) {
+	enigma_print_ctx(&machine);
+}
+
 //=====================================================================================
 //
 // Everything past this point is just utilities for I/O and other boring stuff.
@@ -248,9 +817,10 @@ enigma_set_mode(int m) {
 //=====================================================================================
 
 void
-enigma_state_save(char *fname) {
+enigma_state_save_ctx(enigma_ctx *ctx, char *fname) {
 	FILE *f;
 	int i;
+	STATS_TIMER(t);
 
 	f = fopen(fname, "w");
 
@@ -259,6 +829,8 @@ enigma_state_save(char *fname) {
 		return;
 	}
 
+	sync_rotation(ctx);
+
 	fprintf(f, "#==================================================================\n");
 	fprintf(f, "# ENIGMA MACHINE SETTINGS\n"                                          );
 	fprintf(f, "#==================================================================\n");
@@ -291,7 +863,7 @@ enigma_state_save(char *fname) {
 	fprintf(f, "#     - mode=0 [emulates M3 engima with three rotors]              \n");
 	fprintf(f, "#     - mode=1 [emulates M4 engima with four rotors]               \n");
 	fprintf(f, "#------------------------------------------------------------------\n");
-	fprintf(f, "mode=%d\n", mode                                                      );
+	fprintf(f, "mode=%d\n", ctx->mode                                                 );
 	fprintf(f, "\n"                                                                   );
 	fprintf(f, "#------------------------------------------------------------------\n");
 	fprintf(f, "# RACK SETTINGS\n"                                                    );
@@ -329,10 +901,11 @@ enigma_state_save(char *fname) {
 	fprintf(f, "#     - 2 [Reflector B Thin (mode M4 only)]\n"                        );
 	fprintf(f, "#     - 3 [Reflector C Thin (mode M4 only)]\n"                        );
 	fprintf(f, "#------------------------------------------------------------------\n");
-	for (i = 0; i < num_rotors; i++) {
-		fprintf(f, "r%d=%d %d %d\n", i, rack[i].code, rack[i].rotation, rack[i].ringset);
+	for (i = 0; i < ctx->num_rotors; i++) {
+		fprintf(f, "r%d=%d %d %d\n", i, ctx->rack[i].code, ctx->rack[i].rotation,
+			ctx->rack[i].ringset);
 	}
-	fprintf(f, "reflector=%d\n", reflector.code                                       );
+	fprintf(f, "reflector=%d\n", ctx->reflector                                       );
 	fprintf(f, "\n");
 	fprintf(f, "#------------------------------------------------------------------\n");
 	fprintf(f, "# PLUGBOARD MAPPINGS\n"                                               );
@@ -345,23 +918,69 @@ enigma_state_save(char *fname) {
 	fprintf(f, "# writing A=C is enough to create both A=C and C=A mapping).\n"       );
 	fprintf(f, "#------------------------------------------------------------------\n");
 	for (i = 0; i < MAP_SIZE; i++) {
-		if (plugboard.map[i] != DECODE(i)) {
-			fprintf(f, "%c=%c\n", DECODE(i), plugboard.map[i]);
+		if (ctx->plugboard[i] != i) {
+			fprintf(f, "%c=%c\n", DECODE(i), DECODE(ctx->plugboard[i]));
 		}
 	}
 	fclose(f);
+	STATS_TIMER_END(t, STAT_SAVE_NS);
 }
 
-void
-enigma_state_load(char *fname) {
+// Applies one line of a settings file, with any comment cut off. Returns 0 if it is
+// not a setting the machine can take, which leaves the machine as it was
+static int
+apply_setting(enigma_ctx *ctx, const char *buf) {
+	int x, y, z, slot;
+
+	if (!buf[strspn(buf, " \t\r")]) {
+		return 1; // blank
+	}
+	switch (buf[0]) {
+	case 'm':
+		if (strncmp(buf, "mode", 4) || sscanf(&buf[4], "=%d", &x) != 1 ||
+			x < MODE_M3 || x > MODE_M4) {
+			return 0;
+		}
+		enigma_set_mode_ctx(ctx, x);
+		return 1;
+	case 'r':
+		if (!strncmp(buf, "reflector", 9)) {
+			if (sscanf(&buf[9], "=%d", &x) != 1 || x < REFLECTOR_B ||
+				x > REFLECTOR_C_THIN) {
+				return 0;
+			}
+			enigma_load_reflector_ctx(ctx, x); // ignored if the mode can not take it
+			return 1;
+		}
+		slot = buf[1] - '0';
+		if (slot < 0 || slot >= RACK_SIZE || sscanf(&buf[2], "=%d %d %d", &x, &y, &z) != 3 ||
+			x < ROTOR_I || x >= ROTORS || (x >= ROTOR_B) != (slot == RACK_SIZE - 1)) {
+			return 0;
+		}
+		enigma_load_rotor_ctx(ctx, slot, x);
+		enigma_set_rotation_ctx(ctx, slot, y);
+		enigma_set_ringset_ctx(ctx, slot, z);
+		return 1;
+	default:
+		if (!IS_VALID(ENCODE(toupper((unsigned char)buf[0]))) || !buf[1] ||
+			!IS_VALID(ENCODE(toupper((unsigned char)buf[2])))) {
+			return 0;
+		}
+		enigma_plugboard_map_ctx(ctx, buf[0], buf[2]);
+		return 1;
+	}
+}
+
+int
+enigma_state_read_ctx(enigma_ctx *ctx, const char *fname) {
 	FILE *f;
-	int i, c, x, y, z;
+	int i, c, line = 0, bad = 0;
 	char buf[BUF_MAX] = {0};
+	STATS_TIMER(t);
 
 	f = fopen(fname, "r");
 	if (!f) {
-		fprintf(stderr, "Unable to open %s\n", fname);
-		return;
+		return -1;
 	}
 
 	while (!feof(f)) {
@@ -373,82 +992,77 @@ enigma_state_load(char *fname) {
 			if (++i >= BUF_MAX || c) { --i; } 
 		}
 		buf[i] = 0;
-		if (i) {
-			switch (buf[0]) {
-			case 'm':                    
-				if(!strncmp( buf, "mode", 4 )) {
-					sscanf(&buf[4], "=%d", &x);
-					enigma_set_mode(x);
-				}
-				break;
-			case 'r':
-				if(!strncmp( buf, "reflector", 9 )) {
-					sscanf(&buf[9], "=%d", &x);
-					enigma_load_reflector(x);
-				} else {
-					sscanf(&buf[3], "%d %d %d", &x, &y, &z);
-					enigma_load_rotor(buf[1]-'0', x);
-					enigma_set_rotation(buf[1]-'0', y);
-					enigma_set_ringset(buf[1]-'0', z);
-
-				}
-				break;
-			default:
-				enigma_plugboard_map(buf[0],buf[2]);
-			}
+		line++;
+		if (i && !apply_setting(ctx, buf) && !bad) {
+			bad = line;
 		}
 	}
 
 	fclose(f);
+	STATS_TIMER_END(t, STAT_LOAD_NS);
+	return bad;
 }
 
 void
-enigma_print(void) {
+enigma_state_load_ctx(enigma_ctx *ctx, char *fname) {
+	int line = enigma_state_read_ctx(ctx, fname);
+
+	if (line < 0) {
+		fprintf(stderr, "Unable to open %s\n", fname);
+	} else if (line) {
+		fprintf(stderr, "%s:%d: not a valid setting\n", fname, line);
+	}
+}
+
+void
+enigma_print_ctx(enigma_ctx *ctx) {
 	static char *reflector_strings[] = { "B", "C", "Bt", "Ct" };
 	static char *rotor_strings[] = {
 		" I ", " II", "III", " IV", " V ", " VI", "VII", "VIII", "b", "g"
 	};
 	
 	int i;
+
+	sync_rotation(ctx);
 	printf("====================\n");
 	printf("ENIGMA CONFIGURATION\n");
 	printf("====================\n\n");
-	printf("Mode: %s\n\n", (mode)? "M4" : "M3");
+	printf("Mode: %s\n\n", (ctx->mode)? "M4" : "M3");
 	printf("Rack:\n");
-	printf(" Ref %s   R3      R2      R1   \n", (mode)? "  R4   ":"");
-	printf(" --- %s  -----   -----   ----- \n", (mode)? "  --- ":"");
+	printf(" Ref %s   R3      R2      R1   \n", (ctx->mode)? "  R4   ":"");
+	printf(" --- %s  -----   -----   ----- \n", (ctx->mode)? "  --- ":"");
 	
-	printf("|%2s | ", reflector_strings[reflector.code]);
-	if (mode) {
-		printf("| %s | ", rotor_strings[rack[3].code]);
+	printf("|%2s | ", reflector_strings[ctx->reflector]);
+	if (ctx->mode) {
+		printf("| %s | ", rotor_strings[ctx->rack[3].code]);
 	}
 	printf("| %3s | | %3s | | %3s | <- wheel code\n", 
-			rotor_strings[rack[2].code],
-			rotor_strings[rack[1].code],
-			rotor_strings[rack[0].code]
+			rotor_strings[ctx->rack[2].code],
+			rotor_strings[ctx->rack[1].code],
+			rotor_strings[ctx->rack[0].code]
 		);
 
 	printf("|   | ");
-	if (mode) {
-		printf("| %c | ", DECODE(rack[3].rotation));
+	if (ctx->mode) {
+		printf("| %c | ", DECODE(ctx->rack[3].rotation));
 	}
 	printf("|  %c  | |  %c  | |  %c  | <- ground setting\n", 
-			DECODE(rack[2].rotation),
-			DECODE(rack[1].rotation),
-			DECODE(rack[0].rotation)
+			DECODE(ctx->rack[2].rotation),
+			DECODE(ctx->rack[1].rotation),
+			DECODE(ctx->rack[0].rotation)
 		);
 
 	printf("|   | ");
-	if (mode) {
-		printf("|%2d | ", rack[3].ringset);
+	if (ctx->mode) {
+		printf("|%2d | ", ctx->rack[3].ringset);
 	}
 	printf("| %2d  | | %2d  | | %2d  | <- ring setting\n", 
-			rack[2].ringset,
-			rack[1].ringset,
-			rack[0].ringset
+			ctx->rack[2].ringset,
+			ctx->rack[1].ringset,
+			ctx->rack[0].ringset
 		);
 	
-	printf(" --- %s  -----   -----   ----- \n",(mode)? "  --- ":"");    
+	printf(" --- %s  -----   -----   ----- \n",(ctx->mode)? "  --- ":"");    
 	printf("\n");
 	printf("Plugboard:\n\t");
 	for (i = 0; i < MAP_SIZE; i++) {
@@ -460,7 +1074,7 @@ enigma_print(void) {
 	}
 	printf("\n\t");
 	for (i = 0; i < MAP_SIZE; i++) {
-		printf("%c", plugboard.map[i]);
+		printf("%c", DECODE(ctx->plugboard[i]));
 	}
 	printf("\n");
 }
\ No newline at end of file
@@ -1,6 +1,9 @@
 #ifndef ENIGMA_H
 #define ENIGMA_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 // operational modes
 enum { MODE_M3, MODE_M4 };
 
@@ -13,6 +16,65 @@ enum { ROTOR_I, ROTOR_II, ROTOR_III, ROTOR_IV, ROTOR_V, ROTOR_VI, ROTOR_VII, ROT
 // MODE_M4 uses thin reflectors. MODE_M3 uses regular reflectors.
 enum { REFLECTOR_B, REFLECTOR_C, REFLECTOR_B_THIN, REFLECTOR_C_THIN };
 
+// An independent enigma machine. Every function of the original API has a _ctx
+// counterpart which operates on a context instead of the single process wide machine.
+// Contexts share no state, so different contexts may be driven from different threads
+typedef struct enigma_ctx enigma_ctx;
+
+enigma_ctx *enigma_ctx_create(void);
+enigma_ctx *enigma_ctx_clone(const enigma_ctx *ctx);
+void enigma_ctx_destroy(enigma_ctx *ctx);
+
+void enigma_init_ctx(enigma_ctx *ctx);
+char enigma_encode_ctx(enigma_ctx *ctx, char c);
+void enigma_plugboard_map_ctx(enigma_ctx *ctx, char a, char b);
+void enigma_load_rotor_ctx(enigma_ctx *ctx, int slot, int rotor);
+void enigma_set_rotation_ctx(enigma_ctx *ctx, int slot, int rotation);
+void enigma_set_ringset_ctx(enigma_ctx *ctx, int slot, int ringset);
+void enigma_load_reflector_ctx(enigma_ctx *ctx, int ref);
+void enigma_set_mode_ctx(enigma_ctx *ctx, int m);
+
+// Moves the rotors to where they would be after n more key presses, without pressing
+// them. Takes the same (short) time whatever the size of n
+void enigma_seek_ctx(enigma_ctx *ctx, uint64_t n);
+
+// Stepping analysis. Only the first three rotors step, and where they go only depends
+// on the notches of the first two, so the rest of the settings (ring settings
+// included) play no part. Positions are numbered r0 + 26*r1 + 676*r2 from the
+// rotations of slots 0-2. Each wheel order's schedule is worked out when first needed
+// and kept for every machine in the process; seeking and compiled mode use it too
+#define ENIGMA_POSITIONS 17576
+
+// After tail key presses (0 or 1) the machine is on a cycle, and comes back to the
+// same position every length presses from then on. Returns -1 if out of memory
+int enigma_cycle_ctx(enigma_ctx *ctx, int *tail, int *length);
+
+// Writes the positions the machine will be in after each of the next n key presses to
+// out, without pressing them. Returns -1 if out of memory
+int enigma_positions_ctx(enigma_ctx *ctx, uint16_t *out, size_t n);
+
+// Compiled mode precomputes the machine's full substitution for every rotor position,
+// so each key press costs a couple of table lookups. Building the tables takes around
+// a millisecond and half a megabyte. They are built when compiled mode is switched on,
+// and rebuilt on the first key press after the wiring (rotors, ring settings,
+// reflector, plugboard or mode) changes. Clones share the tables of their original
+void enigma_set_compiled_ctx(enigma_ctx *ctx, int on);
+
+// Encrypts n bytes from in, writing the result to out as upper case letters. Bytes
+// which are not letters are dropped, so the return value (the number of letters
+// written) may be less than n. out must have room for n bytes and may equal in
+size_t enigma_encode_buf_ctx(enigma_ctx *ctx, const char *in, char *out, size_t n);
+
+void enigma_state_save_ctx(enigma_ctx *ctx, char *fname);
+void enigma_state_load_ctx(enigma_ctx *ctx, char *fname);
+
+// Loads the settings file fname as enigma_state_load_ctx does, skipping any line which
+// is not a setting the machine can take. Returns 0 if every line was taken, -1 if the
+// file could not be opened, or else the number (from 1) of the first line skipped
+int enigma_state_read_ctx(enigma_ctx *ctx, const char *fname);
+void enigma_print_ctx(enigma_ctx *ctx);
+
+// Original API. Operates on a single machine shared by the whole process
 void enigma_init(void);
 char enigma_encode(char c);
 void enigma_plugboard_map(char a, char b);
@@ -21,6 +83,9 @@ void enigma_set_rotation(int slot, int rotation);
 void enigma_set_ringset(int slot, int ringset);
 void enigma_load_reflector(int ref);
 void enigma_set_mode(int m);
+void enigma_seek(uint64_t n);
+void enigma_set_compiled(int on);
+size_t enigma_encode_buf(const char *in, char *out, size_t n);
 
 void enigma_state_save(char *fname);
 void enigma_state_load(char *fname);
@@ -0,0 +1,199 @@
+#include "enigma.h"
+#include "enigma_internal.h"
+#include "stats.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+// Bulk encryption happens in two passes. The first turns the input into letter indexes
+// (0-25), dropping anything which is not a letter. The second pushes the indexes
+// through the machine and writes them out as upper case letters. Both passes have a
+// portable version and, on x86, vectorized versions picked at runtime.
+
+typedef size_t (*filter_fn)(const char *in, unsigned char *out, size_t n);
+typedef void (*subst_fn)(const struct enigma_table *t, int *pos, const unsigned char *in,
+	char *out, size_t n);
+
+static size_t
+filter_scalar(const char *in, unsigned char *out, size_t n) {
+	size_t i, j;
+	unsigned char ec;
+
+	for (i = j = 0; i < n; i++) {
+		ec = (in[i] | 0x20) - 'a'; // lower case, then letter to index
+		if (ec < MAP_SIZE) {
+			out[j++] = ec;
+		}
+	}
+
+	return j;
+}
+
+static void
+subst_scalar(const struct enigma_table *t, int *pos, const unsigned char *in, char *out,
+	size_t n) {
+	size_t i;
+	int p = *pos;
+
+	for (i = 0; i < n; i++) {
+		p = t->next[p];
+		out[i] = DECODE(t->perm[p][in[i]]);
+	}
+
+	*pos = p;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// pshufb controls which pack the bytes selected by an 8 bit mask to the front of an
+// 8 byte group (the classic "left pack")
+static unsigned char pack_lut[256][8];
+
+static void
+init_pack_lut(void) {
+	int m, i, j;
+
+	for (m = 0; m < 256; m++) {
+		for (i = j = 0; i < 8; i++) {
+			if (m & (1 << i)) {
+				pack_lut[m][j++] = i;
+			}
+		}
+		while (j < 8) {
+			pack_lut[m][j++] = 0x80;
+		}
+	}
+}
+
+// Classifies 16 bytes at a time and compacts the letters with a shuffle. Stores are
+// 8 bytes wide, but never reach past the end of the block being read, so out may be
+// the same buffer as in
+__attribute__((target("ssse3,popcnt")))
+static size_t
+filter_ssse3(const char *in, unsigned char *out, size_t n) {
+	const __m128i lower = _mm_set1_epi8(0x20);
+	const __m128i a = _mm_set1_epi8('a');
+	const __m128i lo = _mm_set1_epi8(-1);
+	const __m128i hi = _mm_set1_epi8(MAP_SIZE);
+	__m128i v, ctl;
+	size_t i, j = 0;
+	unsigned int m;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(in + i));
+		v = _mm_sub_epi8(_mm_or_si128(v, lower), a);
+		m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi)));
+
+		if (m == 0xffff) {
+			_mm_storeu_si128((__m128i *)(out + j), v);
+			j += 16;
+			continue;
+		}
+
+		ctl = _mm_loadl_epi64((const __m128i *)pack_lut[m & 0xff]);
+		_mm_storel_epi64((__m128i *)(out + j), _mm_shuffle_epi8(v, ctl));
+		j += _mm_popcnt_u32(m & 0xff);
+
+		ctl = _mm_loadl_epi64((const __m128i *)pack_lut[m >> 8]);
+		_mm_storel_epi64((__m128i *)(out + j), _mm_shuffle_epi8(_mm_srli_si128(v, 8), ctl));
+		j += _mm_popcnt_u32(m >> 8);
+	}
+
+	return j + filter_scalar(in + i, out + j, n - i);
+}
+
+// Every key press uses a different table row, so a single shuffle can not substitute
+// a whole vector. Instead the rows are walked in scalar code (a dependent chain of
+// next[] loads) and the 8 substitutions are fetched with one gather. Rows are padded
+// to ROW_SIZE bytes so the 4 byte gather reads never leave the row
+__attribute__((target("avx2")))
+static void
+subst_avx2(const struct enigma_table *t, int *pos, const unsigned char *in, char *out,
+	size_t n) {
+	const __m256i low_bytes = _mm256_setr_epi8(
+		0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m256i step = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8);
+	int p0, p1, p2, p3, p4, p5, p6, p7;
+	uint32_t lane;
+	uint64_t letters;
+	__m256i v;
+	size_t i;
+	int p = *pos;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		if (t->run[p] >= 8) {
+			v = _mm256_add_epi32(_mm256_set1_epi32(p), step);
+			p += 8;
+		} else {
+			p0 = t->next[p];  p1 = t->next[p0]; p2 = t->next[p1]; p3 = t->next[p2];
+			p4 = t->next[p3]; p5 = t->next[p4]; p6 = t->next[p5]; p7 = t->next[p6];
+			v = _mm256_setr_epi32(p0, p1, p2, p3, p4, p5, p6, p7);
+			p = p7;
+		}
+
+		memcpy(&letters, in + i, 8);
+		v = _mm256_add_epi32(_mm256_slli_epi32(v, 5), // ROW_SIZE == 32
+			_mm256_cvtepu8_epi32(_mm_cvtsi64_si128(letters)));
+		v = _mm256_i32gather_epi32((const int *)t->perm, v, 1);
+		v = _mm256_shuffle_epi8(v, low_bytes);
+
+		lane = _mm256_extract_epi32(v, 0) + 0x41414141; // + 'A' in every byte
+		memcpy(out + i, &lane, 4);
+		lane = _mm256_extract_epi32(v, 4) + 0x41414141;
+		memcpy(out + i + 4, &lane, 4);
+	}
+
+	*pos = p;
+	subst_scalar(t, pos, in + i, out + i, n - i);
+}
+
+#endif
+
+static filter_fn filter_kernel = filter_scalar;
+static subst_fn subst_kernel = subst_scalar;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void
+select_kernels(void) {
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("popcnt")) {
+		init_pack_lut();
+		filter_kernel = filter_ssse3;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		subst_kernel = subst_avx2;
+	}
+#endif
+}
+
+size_t
+enigma_encode_buf_ctx(enigma_ctx *ctx, const char *in, char *out, size_t n) {
+	unsigned char *idx = (unsigned char *)out;
+	size_t i, len;
+	STATS_TIMER(t);
+
+	pthread_once(&kernels_once, select_kernels);
+	len = filter_kernel(in, idx, n);
+#ifdef ENIGMA_STATS
+	STATS_ADD(STAT_ENCODED, len);
+	STATS_ADD(STAT_SKIPPED, n - len);
+	enigma_count_steps(ctx, len);
+#endif
+
+	if (enigma_table_ready(ctx)) {
+		subst_kernel(ctx->table, &ctx->pos, idx, out, len);
+	} else {
+		for (i = 0; i < len; i++) {
+			out[i] = DECODE(enigma_encode_index(ctx, idx[i]));
+		}
+	}
+
+	STATS_TIMER_END(t, STAT_ENCODE_NS);
+	return len;
+}
@@ -0,0 +1,194 @@
+#ifndef ENIGMA_FIXED_H
+#define ENIGMA_FIXED_H
+
+// Machines whose mode, wheel order and reflector are fixed when the program is built,
+// for programs which only ever need one configuration. Nothing here needs linking.
+//
+//     ENIGMA_FIXED(name, mode, r0, r1, r2, r3, reflector)
+//
+// defines, for rotors r0-r3 by slot as in settings.conf (r3 is ignored in MODE_M3),
+//
+//     char name_encode(struct enigma_fixed *m, char c);
+//     size_t name_encode_buf(struct enigma_fixed *m, const char *in, char *out, size_t n);
+//
+// which behave exactly like enigma_encode_ctx and enigma_encode_buf_ctx on a context
+// loaded with the same rotors and reflector. The configuration is passed down as
+// constants to always inlined functions, so the compiler resolves the wiring tables and
+// notches, unrolls the rack and drops the fourth rotor in MODE_M3. Rotor positions,
+// ring settings and the plugboard are set on the struct as on a context. For example
+//
+//     ENIGMA_FIXED(m3_default, MODE_M3, ROTOR_III, ROTOR_II, ROTOR_I, ROTOR_B,
+//         REFLECTOR_B)
+//
+//     struct enigma_fixed m;
+//     enigma_fixed_init(&m);
+//     enigma_fixed_plugboard_map(&m, 'A', 'Z');
+//     c = m3_default_encode(&m, 'H');
+//
+// Key presses cost a few dozen instructions and no memory beyond the struct, where
+// compiled mode costs two lookups after half a megabyte of tables per configuration.
+
+#include "enigma.h"
+#include "wiring.h"
+#include <ctype.h>
+#include <stddef.h>
+
+struct enigma_fixed {
+	int rotation[4], ringset[4]; // by rotor slot, 0-25
+	unsigned char plug[52];      // stecker partner of each letter index, twice over
+};
+
+// Wiring tables are written out twice over, so that a letter index plus an offset below
+// 26 needs no wrapping
+#define ENIGMA_FIXED_TWICE(s) s s
+
+static const char enigma_fixed_map[][52] = {
+	ENIGMA_FIXED_TWICE(ROTOR_I_MAP), ENIGMA_FIXED_TWICE(ROTOR_II_MAP),
+	ENIGMA_FIXED_TWICE(ROTOR_III_MAP), ENIGMA_FIXED_TWICE(ROTOR_IV_MAP),
+	ENIGMA_FIXED_TWICE(ROTOR_V_MAP), ENIGMA_FIXED_TWICE(ROTOR_VI_MAP),
+	ENIGMA_FIXED_TWICE(ROTOR_VII_MAP), ENIGMA_FIXED_TWICE(ROTOR_VIII_MAP),
+	ENIGMA_FIXED_TWICE(ROTOR_B_MAP), ENIGMA_FIXED_TWICE(ROTOR_G_MAP)
+};
+
+static const char enigma_fixed_inv[][52] = {
+	ENIGMA_FIXED_TWICE(ROTOR_I_INV), ENIGMA_FIXED_TWICE(ROTOR_II_INV),
+	ENIGMA_FIXED_TWICE(ROTOR_III_INV), ENIGMA_FIXED_TWICE(ROTOR_IV_INV),
+	ENIGMA_FIXED_TWICE(ROTOR_V_INV), ENIGMA_FIXED_TWICE(ROTOR_VI_INV),
+	ENIGMA_FIXED_TWICE(ROTOR_VII_INV), ENIGMA_FIXED_TWICE(ROTOR_VIII_INV),
+	ENIGMA_FIXED_TWICE(ROTOR_B_INV), ENIGMA_FIXED_TWICE(ROTOR_G_INV)
+};
+
+static const signed char enigma_fixed_notch[][2] = {
+	{ ROTOR_I_NOTCHES }, { ROTOR_II_NOTCHES }, { ROTOR_III_NOTCHES },
+	{ ROTOR_IV_NOTCHES }, { ROTOR_V_NOTCHES }, { ROTOR_VI_NOTCHES },
+	{ ROTOR_VII_NOTCHES }, { ROTOR_VIII_NOTCHES }, { ROTOR_B_NOTCHES },
+	{ ROTOR_G_NOTCHES }
+};
+
+static const char enigma_fixed_reflector[][52] = {
+	ENIGMA_FIXED_TWICE(REFLECTOR_B_MAP), ENIGMA_FIXED_TWICE(REFLECTOR_C_MAP),
+	ENIGMA_FIXED_TWICE(REFLECTOR_B_THIN_MAP), ENIGMA_FIXED_TWICE(REFLECTOR_C_THIN_MAP)
+};
+
+#define ENIGMA_FIXED_INLINE static inline __attribute__((always_inline))
+#define ENIGMA_FIXED_WRAP(x) ((x) >= 26 ? (x) - 26 : (x))
+
+// all rotors at A, rings at A and nothing plugged, as after enigma_init_ctx
+static inline void
+enigma_fixed_init(struct enigma_fixed *m) {
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		m->rotation[i] = 0;
+		m->ringset[i] = 0;
+	}
+	for (i = 0; i < 52; i++) {
+		m->plug[i] = i % 26;
+	}
+}
+
+static inline void
+enigma_fixed_set_rotation(struct enigma_fixed *m, int slot, int rotation) {
+	m->rotation[slot] = (26 + rotation % 26) % 26;
+}
+
+static inline void
+enigma_fixed_set_ringset(struct enigma_fixed *m, int slot, int ringset) {
+	m->ringset[slot] = (26 + ringset % 26) % 26;
+}
+
+// wires a to b, first removing any existing connections which a and b might have
+static inline void
+enigma_fixed_plugboard_map(struct enigma_fixed *m, char a, char b) {
+	int ea = toupper(a) - 'A', eb = toupper(b) - 'A';
+
+	int tmp;
+
+	if (ea >= 0 && ea < 26 && eb >= 0 && eb < 26) {
+		tmp = m->plug[ea]; m->plug[tmp] = m->plug[26 + tmp] = tmp;
+		tmp = m->plug[eb]; m->plug[tmp] = m->plug[26 + tmp] = tmp;
+		m->plug[ea] = m->plug[26 + ea] = eb;
+		m->plug[eb] = m->plug[26 + eb] = ea;
+	}
+}
+
+ENIGMA_FIXED_INLINE int
+enigma_fixed_notched(int rotor, int rotation) {
+	return rotation == enigma_fixed_notch[rotor][0] ||
+		rotation == enigma_fixed_notch[rotor][1];
+}
+
+// Presses the key for letter index c. As in enigma_encode_index, between rotors the
+// letter is carried as a contact of the core it has just left, and d is the difference
+// between the offsets of one core and the next
+ENIGMA_FIXED_INLINE int
+enigma_fixed_press(struct enigma_fixed *m, int mode, int r0, int r1, int r2, int r3,
+	int reflector, int c) {
+	int o0, o1, o2, o3 = 0, d01, d12, d23 = 0;
+
+	// double stepping, as spin_rotors in enigma.c
+	if (enigma_fixed_notched(r1, m->rotation[1])) {
+		m->rotation[1] = ENIGMA_FIXED_WRAP(m->rotation[1] + 1);
+		m->rotation[2] = ENIGMA_FIXED_WRAP(m->rotation[2] + 1);
+	}
+	if (enigma_fixed_notched(r0, m->rotation[0])) {
+		m->rotation[1] = ENIGMA_FIXED_WRAP(m->rotation[1] + 1);
+	}
+	m->rotation[0] = ENIGMA_FIXED_WRAP(m->rotation[0] + 1);
+
+	// the wiring of a rotor only depends on how far its core is turned
+	o0 = ENIGMA_FIXED_WRAP(m->rotation[0] + 26 - m->ringset[0]);
+	o1 = ENIGMA_FIXED_WRAP(m->rotation[1] + 26 - m->ringset[1]);
+	o2 = ENIGMA_FIXED_WRAP(m->rotation[2] + 26 - m->ringset[2]);
+	if (mode == MODE_M4) {
+		o3 = ENIGMA_FIXED_WRAP(m->rotation[3] + 26 - m->ringset[3]);
+	}
+
+	d01 = ENIGMA_FIXED_WRAP(o1 + 26 - o0);
+	d12 = ENIGMA_FIXED_WRAP(o2 + 26 - o1);
+	if (mode == MODE_M4) {
+		d23 = ENIGMA_FIXED_WRAP(o3 + 26 - o2);
+	}
+
+	c = enigma_fixed_map[r0][m->plug[c] + o0] - 'A';
+	c = enigma_fixed_map[r1][c + d01] - 'A';
+	c = enigma_fixed_map[r2][c + d12] - 'A';
+	if (mode == MODE_M4) {
+		c = enigma_fixed_map[r3][c + d23] - 'A';
+		c = enigma_fixed_reflector[reflector][c + 26 - o3] - 'A';
+		c = enigma_fixed_inv[r3][c + o3] - 'A';
+		c = enigma_fixed_inv[r2][c + 26 - d23] - 'A';
+	} else {
+		c = enigma_fixed_reflector[reflector][c + 26 - o2] - 'A';
+		c = enigma_fixed_inv[r2][c + o2] - 'A';
+	}
+	c = enigma_fixed_inv[r1][c + 26 - d12] - 'A';
+	c = enigma_fixed_inv[r0][c + 26 - d01] - 'A';
+	return m->plug[c + 26 - o0];
+}
+
+#define ENIGMA_FIXED(name, mode, r0, r1, r2, r3, reflector)                          \
+static inline char                                                                    \
+name##_encode(struct enigma_fixed *m, char c) {                                       \
+	int ec = toupper(c) - 'A';                                                        \
+	if (ec < 0 || ec >= 26) {                                                         \
+		return c;                                                                     \
+	}                                                                                 \
+	return 'A' + enigma_fixed_press(m, mode, r0, r1, r2, r3, reflector, ec);          \
+}                                                                                     \
+                                                                                      \
+static inline size_t                                                                  \
+name##_encode_buf(struct enigma_fixed *m, const char *in, char *out, size_t n) {      \
+	size_t i, len = 0;                                                                \
+	int ec;                                                                           \
+	for (i = 0; i < n; i++) {                                                         \
+		ec = (in[i] | 0x20) - 'a';                                                    \
+		if (ec >= 0 && ec < 26) {                                                     \
+			out[len++] = 'A' + enigma_fixed_press(m, mode, r0, r1, r2, r3, reflector, \
+				ec);                                                                  \
+		}                                                                             \
+	}                                                                                 \
+	return len;                                                                       \
+}
+
+#endif
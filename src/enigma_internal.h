@@ -0,0 +1,125 @@
+#ifndef ENIGMA_INTERNAL_H
+#define ENIGMA_INTERNAL_H
+
+// Machine internals shared between the source files of the library. Nothing outside
+// of the library should include this file.
+
+#include "enigma.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define RACK_SIZE   4
+#define MAX_NOTCHES 2
+#define MAP_SIZE    26
+#define ROW_SIZE    32                              // padded width of a table row
+#define CACHE_LINE  64
+#define POSITIONS   (MAP_SIZE * MAP_SIZE * MAP_SIZE) // positions of the stepping rotors
+
+#define DECODE(x)((x)+'A') // index to letter
+#define ENCODE(x)((x)-'A') // letter to index
+#define IS_VALID(x)(((x)>=0) && ((x)<MAP_SIZE)) // check if x can be encrypted
+
+#define ROTORS      (ROTOR_G + 1)
+#define REFLECTORS  (REFLECTOR_C_THIN + 1)
+
+#define WRAP(x) ((x) >= MAP_SIZE ? (x) - MAP_SIZE : (x)) // for x < 2 * MAP_SIZE
+
+// Wiring of every rotor (by ROTOR_ code) and reflector (by REFLECTOR_ code) as letter
+// indexes. Each table is written out twice over, so that a letter index plus an offset
+// below 26 needs no modulo. Shared by all machines and filled in before the first
+// rotor or reflector is loaded
+extern unsigned char enigma_rotor_fwd[ROTORS][2 * MAP_SIZE];
+extern unsigned char enigma_rotor_inv[ROTORS][2 * MAP_SIZE];
+extern unsigned char enigma_reflector_map[REFLECTORS][2 * MAP_SIZE];
+
+// Rotor in the rack. Its wiring is looked up in the shared tables by code
+struct rotor {
+	uint32_t notches;       // bit r set if the rotor turns its neighbour at rotation r
+	unsigned char code;     // ROTOR_ code
+	unsigned char rotation; // 0-25
+	unsigned char ringset;  // 0-25
+};
+
+// Where the stepping rotors go on each key press. Stepping only looks at the rotations
+// and notches of the first two rotors, so a wheel order has a single schedule whatever
+// its ring settings. From any position the machine joins a cycle within a key press;
+// every cycle of a schedule has the same length, and order lists the positions of each
+// cycle in the order they are visited, one cycle after another
+#define NO_SLOT 0xffff
+
+struct enigma_schedule {
+	uint32_t length;                // key presses around each cycle
+	uint16_t next[POSITIONS];       // position after a key press
+	unsigned char run[POSITIONS];   // key presses before next[p] != p + 1
+	uint16_t order[POSITIONS];      // positions on cycles
+	uint16_t slot[POSITIONS];       // index in order of a position, or NO_SLOT if it is
+	                                // on no cycle
+};
+
+// Schedule of the wheel order with rotors r0 and r1 (ROTOR_ codes) in the first two
+// slots. Built on first use, shared by every machine and never freed. NULL if it could
+// not be built
+const struct enigma_schedule *enigma_schedule_get(int r0, int r1);
+
+// Precomputed form of a machine. Only the first three rotors ever move, so the whole
+// substitution performed by the machine (plugboard, rotors and reflector) is a function
+// of their 26^3 possible positions. A position is stored as r0 + 26*r1 + 676*r2. Tables
+// are never modified once built, so contexts cloned from each other share them. The
+// rows are those of the table itself, or of a table cache file (see tablecache.h)
+struct enigma_table {
+	atomic_int refs;
+	const uint16_t *next;                    // of the schedule of the wheel order
+	const unsigned char *run;
+	const unsigned char (*perm)[ROW_SIZE];   // letter index to letter index map
+	int owns_rows;                           // perm is rows, not a table cache file
+	unsigned char rows[][ROW_SIZE];          // POSITIONS of them if owns_rows
+};
+
+// A single enigma machine. Everything a key press reads comes first and fits in two
+// cache lines; the wiring itself is in the shared tables above, so any number of
+// machines may be in use at the same time. Note that the rotor in the fourth position
+// is only used if we are in MODE_M4
+struct enigma_ctx {
+	_Alignas(CACHE_LINE)
+	struct rotor rack[RACK_SIZE];          // Sequence of rotors to be used for encryption
+	unsigned char plugboard[2 * MAP_SIZE]; // stecker partner of each letter index, twice
+	unsigned char reflector;               // REFLECTOR_ code of the chosen reflector
+	int num_rotors;                        // Number of rotors in the rack (mode dependent)
+
+	// compiled mode. While rotation_stale is set the rotor positions live in pos
+	// and the rotation fields of the first three rotors are out of date
+	int compiled;
+	int rotation_stale;
+	int pos;
+	struct enigma_table *table;
+
+	int mode;                              // Type of Enigma machine being emulated
+};
+
+// Builds the table of ctx from the wiring, never taking it from the table cache or the
+// keystream cache. The caller holds the only reference, or NULL if out of memory
+struct enigma_table *enigma_table_build(struct enigma_ctx *ctx);
+
+// Drops a reference to t, freeing it with the last
+void enigma_table_release(struct enigma_table *t);
+
+// Copies src into dst, which must hold no tables, sharing the tables of src
+void enigma_ctx_copy(struct enigma_ctx *dst, const struct enigma_ctx *src);
+
+// CRC-32 of the wiring of every rotor and reflector, which compiled tables depend on
+uint32_t enigma_wiring_crc(void);
+
+// encrypt a single letter index (0-25) with the machine, stepping the rotors
+int enigma_encode_index(struct enigma_ctx *ctx, int ec);
+
+#ifdef ENIGMA_STATS
+// Counts (in stats.h) the rotor steps which the next n key presses will make
+void enigma_count_steps(const struct enigma_ctx *ctx, uint64_t n);
+#endif
+
+// Prepares ctx for encryption through its tables. Returns 0 if the machine is not in
+// compiled mode (or the tables could not be built), in which case the tables may not
+// be used. Otherwise ctx->pos holds the current rotor position
+int enigma_table_ready(struct enigma_ctx *ctx);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef IO_H
+#define IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Ciphertext is written in blocks of BLOCK_SIZE letters separated by spaces
+#define BLOCK_SIZE 5
+#define END_BLOCK(x) ((x)%BLOCK_SIZE == 0)
+#define GROUPED_SIZE(n) ((n) + (n) / BLOCK_SIZE + 1) // room for n letters in blocks
+#define IS_LETTER(c) ((unsigned char)(((c) | 0x20) - 'a') < 26)
+
+size_t group(const char *letters, size_t n, uint64_t count, char *out);
+
+// Write everything or exit. writev_all modifies iov as the writes complete
+void write_all(int fd, const char *buf, size_t n);
+void writev_all(int fd, struct iovec *iov, int cnt);
+
+char *map_input(int fd, size_t *len);
+ssize_t read_full(int fd, char *buf, size_t len);
+char *read_input(int fd, size_t *len);
+
+// CRC-32 (as zlib's) of n bytes, continuing from crc, which starts at 0
+uint32_t crc32(uint32_t crc, const void *buf, size_t n);
+
+#endif
@@ -0,0 +1,508 @@
+#include "key.h"
+#include "enigma_internal.h"
+#include "io.h"
+#include "stats.h"
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define KEY_BOM    0x0102
+#define KEY_FIELDS 10     // space separated fields of a key line
+#define KEY_CRC_LEN offsetof(struct enigma_key, crc)
+
+_Static_assert(sizeof(struct enigma_key) == 64, "a key is 64 bytes");
+_Static_assert(sizeof(struct key_list_header) == 64, "a key list header is 64 bytes");
+
+static const char *rotor_names[ROTORS] = {
+	"I", "II", "III", "IV", "V", "VI", "VII", "VIII", "b", "g"
+};
+static const char *reflector_names[REFLECTORS] = { "B", "C", "Bt", "Ct" };
+
+void
+key_from_ctx(struct enigma_key *k, const enigma_ctx *ctx) {
+	int i, pos = ctx->pos;
+
+	memset(k, 0, sizeof(*k));
+	k->mode = ctx->mode;
+	k->reflector = ctx->reflector;
+	for (i = 0; i < RACK_SIZE; i++) {
+		k->rotor[i] = ctx->rack[i].code;
+		k->rotation[i] = ctx->rack[i].rotation;
+		k->ringset[i] = ctx->rack[i].ringset;
+	}
+	if (ctx->rotation_stale) { // compiled mode holds the positions in pos
+		for (i = 0; i < 3; i++, pos /= MAP_SIZE) {
+			k->rotation[i] = pos % MAP_SIZE;
+		}
+	}
+	if (k->mode == MODE_M3) {
+		k->rotor[3] = ROTOR_B;
+		k->rotation[3] = k->ringset[3] = 0;
+	}
+	for (i = 0; i < MAP_SIZE; i++) {
+		k->plug[i] = ctx->plugboard[i];
+	}
+	key_seal(k);
+}
+
+void
+key_to_ctx(const struct enigma_key *k, enigma_ctx *ctx) {
+	int i;
+
+	enigma_init_ctx(ctx);
+	enigma_set_mode_ctx(ctx, k->mode);
+	enigma_load_reflector_ctx(ctx, k->reflector);
+	for (i = 0; i < RACK_SIZE; i++) {
+		enigma_load_rotor_ctx(ctx, i, k->rotor[i]);
+		enigma_set_rotation_ctx(ctx, i, k->rotation[i]);
+		enigma_set_ringset_ctx(ctx, i, k->ringset[i]);
+	}
+	for (i = 0; i < MAP_SIZE; i++) {
+		if (k->plug[i] > i) {
+			enigma_plugboard_map_ctx(ctx, DECODE(i), DECODE(k->plug[i]));
+		}
+	}
+}
+
+void
+key_seal(struct enigma_key *k) {
+	k->crc = crc32(0, k, KEY_CRC_LEN);
+}
+
+static int
+valid_date(uint32_t d) {
+	int month = d / 100 % 100, day = d % 100;
+
+	return d >= 10000101 && d <= 99991231 && month >= 1 && month <= 12 &&
+		day >= 1 && day <= 31;
+}
+
+// every check of key_check but the checksum
+static int
+check_settings(const struct enigma_key *k) {
+	static const uint8_t zero[sizeof(k->reserved)];
+	int i, m4 = k->mode == MODE_M4;
+
+	if (k->mode > MODE_M4 || k->reflector >= REFLECTORS ||
+		(k->reflector >= REFLECTOR_B_THIN) != m4 ||
+		memcmp(k->reserved, zero, sizeof(zero)) || (k->date && !valid_date(k->date))) {
+		return KEY_ERANGE;
+	}
+	for (i = 0; i < RACK_SIZE; i++) {
+		if (k->rotation[i] >= MAP_SIZE || k->ringset[i] >= MAP_SIZE ||
+			(i < RACK_SIZE - 1 && k->rotor[i] >= ROTOR_B) ||
+			(i == RACK_SIZE - 1 && (k->rotor[i] < ROTOR_B || k->rotor[i] >= ROTORS))) {
+			return KEY_ERANGE;
+		}
+	}
+	if (!m4 && (k->rotor[3] != ROTOR_B || k->rotation[3] || k->ringset[3])) {
+		return KEY_ERANGE;
+	}
+	for (i = 0; i < MAP_SIZE; i++) {
+		if (k->plug[i] >= MAP_SIZE || k->plug[k->plug[i]] != i) {
+			return KEY_ERANGE;
+		}
+	}
+
+	return KEY_OK;
+}
+
+int
+key_check(const struct enigma_key *k) {
+	if (k->crc != crc32(0, k, KEY_CRC_LEN)) {
+		return KEY_ECHECKSUM;
+	}
+	return check_settings(k);
+}
+
+size_t
+key_format(const struct enigma_key *k, char *buf) {
+	int i, n = k->mode == MODE_M4 ? 4 : 3, pairs = 0;
+	char *p = buf;
+
+	p += sprintf(p, "K%d M%d %s ", KEY_VERSION, n, reflector_names[k->reflector]);
+	for (i = n - 1; i >= 0; i--) {
+		p += sprintf(p, "%s%c", rotor_names[k->rotor[i]], i ? '-' : ' ');
+	}
+	for (i = n - 1; i >= 0; i--) {
+		*p++ = DECODE(k->ringset[i]);
+	}
+	*p++ = ' ';
+	for (i = n - 1; i >= 0; i--) {
+		*p++ = DECODE(k->rotation[i]);
+	}
+	*p++ = ' ';
+	for (i = 0; i < MAP_SIZE; i++) {
+		if (k->plug[i] > i) {
+			if (pairs++) {
+				*p++ = '.';
+			}
+			*p++ = DECODE(i);
+			*p++ = DECODE(k->plug[i]);
+		}
+	}
+	if (!pairs) {
+		*p++ = '-';
+	}
+	p += sprintf(p, " %u %u", (unsigned)k->id, (unsigned)k->date);
+	p += sprintf(p, " %08X", (unsigned)crc32(0, buf, p - buf));
+
+	return p - buf;
+}
+
+// a decimal field of at most 10 digits, without leading zeros
+static int
+parse_uint(const char *f, size_t n, uint32_t *out) {
+	uint64_t v = 0;
+	size_t i;
+
+	if (n > 10 || (n > 1 && f[0] == '0')) {
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if ((unsigned)(f[i] - '0') > 9) {
+			return -1;
+		}
+		v = v * 10 + (f[i] - '0');
+	}
+	if (v > UINT32_MAX) {
+		return -1;
+	}
+
+	*out = v;
+	return 0;
+}
+
+// n upper case letters, slowest rotor first, into slots n-1 down to 0
+static int
+parse_letters(const char *f, size_t len, int n, uint8_t *out) {
+	int i;
+
+	if (len != (size_t)n) {
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if ((unsigned)(f[i] - 'A') >= MAP_SIZE) {
+			return -1;
+		}
+		out[n - 1 - i] = f[i] - 'A';
+	}
+
+	return 0;
+}
+
+static int
+parse_name(const char *f, size_t n, const char **names, int count) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (n && names[i][0] == f[0] && !strncmp(f, names[i], n) && !names[i][n]) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static int
+parse_wheels(const char *f, size_t len, int n, uint8_t *rotor) {
+	const char *end = f + len, *q;
+	int i, r;
+
+	for (i = n - 1; i >= 0; i--) {
+		for (q = f; q < end && *q != '-'; q++);
+		if ((r = parse_name(f, q - f, rotor_names, ROTORS)) < 0 || (i > 0) != (q < end)) {
+			return -1;
+		}
+		rotor[i] = r;
+		f = q + 1;
+	}
+
+	return 0;
+}
+
+// Sorted pairs of letters, the lower first, separated by dots. Letters used twice make
+// the plugboard impossible rather than the line malformed
+static int
+parse_plugs(const char *f, size_t len, uint8_t *plug, int *range) {
+	size_t i;
+	int a, b, last = -1;
+
+	for (i = 0; i < MAP_SIZE; i++) {
+		plug[i] = i;
+	}
+	if (len == 1 && f[0] == '-') {
+		return 0;
+	}
+	if (len % 3 != 2) {
+		return -1;
+	}
+	for (i = 0; i < len; i += 3) {
+		a = f[i] - 'A';
+		b = f[i + 1] - 'A';
+		if ((unsigned)a >= MAP_SIZE || (unsigned)b >= MAP_SIZE || a >= b || a <= last ||
+			(i + 2 < len && f[i + 2] != '.')) {
+			return -1;
+		}
+		if (plug[a] != a || plug[b] != b) {
+			*range = 1;
+		}
+		plug[a] = b;
+		plug[b] = a;
+		last = a;
+	}
+
+	return 0;
+}
+
+int
+key_parse(const char *s, size_t len, struct enigma_key *k) {
+	const char *f[KEY_FIELDS], *end = s + len, *p = s, *q;
+	size_t n[KEY_FIELDS];
+	uint32_t version, crc;
+	int i, rotors, range = 0;
+
+	// the version decides the rest of the line, so it is read first
+	for (q = s; q < end && *q != ' '; q++);
+	if (q - s < 2 || s[0] != 'K' || parse_uint(s + 1, q - s - 1, &version)) {
+		return KEY_ESYNTAX;
+	}
+	if (version != KEY_VERSION) {
+		return KEY_EVERSION;
+	}
+
+	for (i = 0; i < KEY_FIELDS; i++) {
+		for (q = p; q < end && *q != ' '; q++);
+		f[i] = p;
+		n[i] = q - p;
+		if (!n[i] || (q == end) != (i == KEY_FIELDS - 1)) {
+			return KEY_ESYNTAX;
+		}
+		p = q + 1;
+	}
+
+	memset(k, 0, sizeof(*k));
+	if (n[1] != 2 || f[1][0] != 'M' || (f[1][1] != '3' && f[1][1] != '4')) {
+		return KEY_ESYNTAX;
+	}
+	k->mode = f[1][1] == '4' ? MODE_M4 : MODE_M3;
+	rotors = k->mode == MODE_M4 ? 4 : 3;
+	k->rotor[3] = ROTOR_B;
+
+	if ((i = parse_name(f[2], n[2], reflector_names, REFLECTORS)) < 0 ||
+		parse_wheels(f[3], n[3], rotors, k->rotor) ||
+		parse_letters(f[4], n[4], rotors, k->ringset) ||
+		parse_letters(f[5], n[5], rotors, k->rotation) ||
+		parse_plugs(f[6], n[6], k->plug, &range) ||
+		parse_uint(f[7], n[7], &k->id) ||
+		parse_uint(f[8], n[8], &k->date) || (n[8] != 1 && n[8] != 8) ||
+		n[9] != 8) {
+		return KEY_ESYNTAX;
+	}
+	k->reflector = i;
+
+	for (crc = 0, i = 0; i < 8; i++) {
+		q = &f[9][i];
+		if ((unsigned)(*q - '0') <= 9) {
+			crc = crc << 4 | (*q - '0');
+		} else if ((unsigned)(*q - 'A') < 6) {
+			crc = crc << 4 | (*q - 'A' + 10);
+		} else {
+			return KEY_ESYNTAX;
+		}
+	}
+	if (crc != crc32(0, s, f[9] - 1 - s)) {
+		return KEY_ECHECKSUM;
+	}
+
+	if (range || check_settings(k)) {
+		return KEY_ERANGE;
+	}
+	key_seal(k);
+	return KEY_OK;
+}
+
+static int
+check_header(const struct key_list_header *h, size_t size) {
+	if (memcmp(h->magic, "EKEY", 4) || h->bom != KEY_BOM) {
+		return KEY_EFILE;
+	}
+	if (h->version != KEY_VERSION) {
+		return KEY_EVERSION;
+	}
+	if (h->crc != crc32(0, h, offsetof(struct key_list_header, crc))) {
+		return KEY_ECHECKSUM;
+	}
+	if (h->count > (size - sizeof(*h)) / sizeof(struct enigma_key) ||
+		size != sizeof(*h) + h->count * sizeof(struct enigma_key)) {
+		return KEY_EFILE;
+	}
+
+	return KEY_OK;
+}
+
+int
+key_list_load(struct key_list *l, const char *fname) {
+	struct stat st;
+	void *map;
+	int fd, err;
+
+	memset(l, 0, sizeof(*l));
+	fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		return KEY_EFILE;
+	}
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct key_list_header)) {
+		close(fd);
+		return KEY_EFILE;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return KEY_EFILE;
+	}
+
+	if ((err = check_header(map, st.st_size))) {
+		munmap(map, st.st_size);
+		return err;
+	}
+
+	l->keys = (const struct enigma_key *)((const struct key_list_header *)map + 1);
+	l->count = ((const struct key_list_header *)map)->count;
+	l->map = map;
+	l->map_len = st.st_size;
+	return KEY_OK;
+}
+
+void
+key_list_free(struct key_list *l) {
+	if (l->map) {
+		munmap(l->map, l->map_len);
+	}
+	memset(l, 0, sizeof(*l));
+}
+
+int
+key_list_get(const struct key_list *l, size_t i, struct enigma_key *k) {
+	if (i >= l->count) {
+		return KEY_EINDEX;
+	}
+	*k = l->keys[i];
+	return key_check(k);
+}
+
+int
+key_list_write(const char *fname, const struct enigma_key *keys, size_t n) {
+	struct key_list_header h = { .magic = "EKEY", .version = KEY_VERSION,
+		.bom = KEY_BOM, .count = n };
+	FILE *f;
+	int err = KEY_OK;
+
+	h.crc = crc32(0, &h, offsetof(struct key_list_header, crc));
+
+	if (!(f = fopen(fname, "wb"))) {
+		return KEY_EFILE;
+	}
+	if (fwrite(&h, sizeof(h), 1, f) != 1 || fwrite(keys, sizeof(*keys), n, f) != n) {
+		err = KEY_EFILE;
+	}
+	if (fclose(f)) {
+		err = KEY_EFILE;
+	}
+
+	return err;
+}
+
+// entry N of key list FILE, given as FILE#N
+static int
+load_entry(enigma_ctx *ctx, const char *settings) {
+	const char *hash = strrchr(settings, '#');
+	char fname[4096];
+	struct enigma_key k;
+	struct key_list l;
+	uint32_t i;
+	int err;
+
+	if (!hash || parse_uint(hash + 1, strlen(hash + 1), &i) ||
+		(size_t)(hash - settings) >= sizeof(fname)) {
+		return KEY_EFILE;
+	}
+	memcpy(fname, settings, hash - settings);
+	fname[hash - settings] = 0;
+
+	if ((err = key_list_load(&l, fname))) {
+		return err;
+	}
+	if (!(err = key_list_get(&l, i, &k))) {
+		key_to_ctx(&k, ctx);
+	}
+	key_list_free(&l);
+	return err;
+}
+
+int
+key_load_settings(enigma_ctx *ctx, const char *settings) {
+	char line[KEY_TEXT_MAX + 1];
+	struct enigma_key k;
+	size_t n;
+	FILE *f;
+	int err;
+	STATS_TIMER(t);
+
+	if (access(settings, F_OK) && strchr(settings, '#')) {
+		err = load_entry(ctx, settings);
+		STATS_TIMER_END(t, STAT_LOAD_NS);
+		return err;
+	}
+
+	// anything but a key line goes to the settings file parser
+	if (!(f = fopen(settings, "r"))) {
+		STATS_TIMER_END(t, STAT_LOAD_NS);
+		return KEY_EFILE;
+	}
+	n = fread(line, 1, sizeof(line), f);
+	fclose(f);
+	if (n < 2 || line[0] != 'K' || (unsigned)(line[1] - '0') > 9) {
+		switch (enigma_state_read_ctx(ctx, settings)) {
+		case 0:
+			return KEY_OK;
+		case -1:
+			return KEY_EFILE;
+		default:
+			return KEY_ERANGE;
+		}
+	}
+
+	line[n < sizeof(line) ? n : sizeof(line) - 1] = 0;
+	n = strcspn(line, "\n");
+	if (!(err = key_parse(line, n, &k))) {
+		key_to_ctx(&k, ctx);
+	}
+	STATS_TIMER_END(t, STAT_LOAD_NS);
+	return err;
+}
+
+const char *
+key_strerror(int err) {
+	static const char *msgs[] = {
+		"no error",
+		"not a key",
+		"unknown key version",
+		"setting out of range",
+		"checksum mismatch",
+		"not a readable file or key list",
+		"no such key",
+		"duplicate key id and date",
+		"out of memory"
+	};
+
+	if (err < 0 || err > KEY_ENOMEM) {
+		return "unknown error";
+	}
+	return msgs[err];
+}
@@ -0,0 +1,102 @@
+#ifndef KEY_H
+#define KEY_H
+
+#include "enigma.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define KEY_VERSION  1
+#define KEY_TEXT_MAX 128 // longest key line, with its terminating NUL
+
+// Errors returned by the functions below, 0 (KEY_OK) on success
+enum {
+	KEY_OK,
+	KEY_ESYNTAX,   // not a key in canonical form
+	KEY_EVERSION,  // a key or key list of a version this build does not know
+	KEY_ERANGE,    // a setting the machine can not take, e.g. a thin reflector in M3
+	KEY_ECHECKSUM, // damaged: the checksum does not match
+	KEY_EFILE,     // a file could not be read or written, or is not a key list
+	KEY_EINDEX,    // no such entry in a key list
+	KEY_EEXIST,    // a key database already holds a key with this id and date
+	KEY_ENOMEM     // out of memory
+};
+
+// A whole machine setting, as loaded from a settings file, in 64 bytes. Rotors are
+// given by slot, as in settings.conf. In MODE_M3 the fourth slot always holds ROTOR_B
+// at 0 0, so that every setting has exactly one key. Keys are stored in key lists as
+// they are in memory, so a mapped key list is an array of keys
+struct enigma_key {
+	uint32_t id;                           // key sheet entry, 0 if none
+	uint32_t date;                         // YYYYMMDD, 0 if none
+	uint8_t mode, reflector;
+	uint8_t rotor[4], rotation[4], ringset[4];
+	uint8_t plug[26];                      // stecker partner of each letter index
+	uint8_t reserved[12];                  // zero
+	uint32_t crc;                          // CRC-32 of the bytes above
+};
+
+// Reads the setting of ctx into k, with no id or date, and seals it
+void key_from_ctx(struct enigma_key *k, const enigma_ctx *ctx);
+
+// Sets ctx up as k describes. k should have passed key_check
+void key_to_ctx(const struct enigma_key *k, enigma_ctx *ctx);
+
+// recomputes the checksum of k, after changing its id, date or settings
+void key_seal(struct enigma_key *k);
+
+// Checks the checksum of k, and that the machine can take its settings
+int key_check(const struct enigma_key *k);
+
+// Writes k as a single line of text (no newline) to buf, which must hold KEY_TEXT_MAX
+// bytes, and returns its length. The line reads, for example
+//     K1 M3 B I-IV-III AQB CTN AM.QT 12 19410501 8D3F0A1C
+// version, mode, reflector, wheel order, ring settings, ground settings, plugboard
+// pairs (- for none), id, date and the CRC-32 of everything before it. Rotors, rings
+// and ground go slowest first, as on a key sheet, and the plugboard pairs are sorted
+size_t key_format(const struct enigma_key *k, char *buf);
+
+// Parses a key line of len bytes (with no newline) into k. Only the canonical form
+// written by key_format is accepted, so every key has a single line. Makes no
+// allocations and reads nothing past len
+int key_parse(const char *s, size_t len, struct enigma_key *k);
+
+// Key lists are files of keys, for key sheets of many settings: a struct
+// key_list_header, then count keys. They are written in the byte order of the machine
+// which built them, which bom records
+struct key_list_header {
+	char magic[4];        // "EKEY"
+	uint8_t version;      // KEY_VERSION
+	uint8_t reserved0;
+	uint16_t bom;         // 0x0102 as written
+	uint64_t count;
+	uint8_t reserved[44];
+	uint32_t crc;         // CRC-32 of the bytes above
+};
+
+// A key list mapped straight from its file. Loading only checks the header, so it
+// takes the same time however long the list is: keys should go through key_check (or
+// key_list_get) before use
+struct key_list {
+	const struct enigma_key *keys;
+	size_t count;
+	void *map;
+	size_t map_len;
+};
+
+int key_list_load(struct key_list *l, const char *fname);
+void key_list_free(struct key_list *l);
+
+// copies entry i of l to k, checking it
+int key_list_get(const struct key_list *l, size_t i, struct enigma_key *k);
+
+int key_list_write(const char *fname, const struct enigma_key *keys, size_t n);
+
+// Sets ctx up from a settings argument: entry N (from 0) of key list FILE given as
+// FILE#N, a file holding a key line, or else a settings file as read by
+// enigma_state_read_ctx. KEY_EFILE if the file can not be read, KEY_ERANGE if a line
+// of a settings file is not a setting the machine can take
+int key_load_settings(enigma_ctx *ctx, const char *settings);
+
+const char *key_strerror(int err);
+
+#endif
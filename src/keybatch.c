@@ -0,0 +1,306 @@
+#include "keybatch.h"
+#include "enigma_internal.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#define LANES KEYBATCH_LANES
+#define CHUNK 255 // letters per kernel call, so byte counters can not overflow
+#define NO_NOTCH 0xff
+
+// Wiring shared by every lane, as letter indexes. Tables are padded to 32 entries so
+// that they load as two 16 byte shuffle tables
+struct wiring {
+	int num_rotors;
+	unsigned char fwd[RACK_SIZE][32], inv[RACK_SIZE][32], refl[32];
+	unsigned char notch[2][MAX_NOTCHES]; // of rotors 1 and 2, NO_NOTCH if unused
+};
+
+// Per lane machine state, carried from one chunk of the ciphertext to the next
+struct lanes {
+	unsigned char rot[3][LANES];  // rotations of the stepping rotors
+	unsigned char ring[3][LANES];
+	unsigned char off3[LANES];    // core offset of the fourth rotor, which never moves
+	uint32_t count[MAP_SIZE][LANES]; // letters leaving the rotors, before the plugboard
+};
+
+
+typedef void (*kernel_fn)(const struct wiring *w, struct lanes *st,
+	const struct keybatch *kb, const unsigned char *in, size_t n);
+
+// one lane at a time, following spin_rotors and crypt in enigma.c
+static void
+kernel_scalar(const struct wiring *w, struct lanes *st, const struct keybatch *kb,
+	const unsigned char *in, size_t n) {
+	int lane, r0, r1, r2, m0, m1, off[RACK_SIZE], x, i, k;
+	size_t j;
+
+	for (lane = 0; lane < kb->lanes; lane++) {
+		r0 = st->rot[0][lane];
+		r1 = st->rot[1][lane];
+		r2 = st->rot[2][lane];
+		off[3] = st->off3[lane];
+
+		for (j = 0; j < n; j++) {
+			m1 = r1 == w->notch[1][0] || r1 == w->notch[1][1];
+			m0 = r0 == w->notch[0][0] || r0 == w->notch[0][1];
+			r1 = WRAP(r1 + m1 + m0);
+			r2 = WRAP(r2 + m1);
+			r0 = WRAP(r0 + 1);
+			off[0] = WRAP(r0 + MAP_SIZE - st->ring[0][lane]);
+			off[1] = WRAP(r1 + MAP_SIZE - st->ring[1][lane]);
+			off[2] = WRAP(r2 + MAP_SIZE - st->ring[2][lane]);
+
+			x = kb->plug[in[j]][lane];
+			for (i = 0; i < w->num_rotors; i++) {
+				k = w->fwd[i][WRAP(x + off[i])];
+				x = WRAP(k + MAP_SIZE - off[i]);
+			}
+			x = w->refl[x];
+			for (--i; i >= 0; i--) {
+				k = w->inv[i][WRAP(x + off[i])];
+				x = WRAP(k + MAP_SIZE - off[i]);
+			}
+			st->count[x][lane]++;
+		}
+
+		st->rot[0][lane] = r0;
+		st->rot[1][lane] = r1;
+		st->rot[2][lane] = r2;
+	}
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Every lane holds a letter index (0-25) in a byte. Sums wrap at 26 with a compare and
+// a masked subtract, and a 26 entry table lookup is two in-lane shuffles (the index
+// only uses its low four bits) with a blend picking the upper half for indexes >= 16
+#define ADD26(a, b) mod26_up(_mm256_add_epi8((a), (b)))
+#define SUB26(a, b) mod26_down(_mm256_sub_epi8((a), (b)))
+
+__attribute__((target("avx2")))
+static inline __m256i
+mod26_up(__m256i v) {
+	return _mm256_sub_epi8(v, _mm256_and_si256(
+		_mm256_cmpgt_epi8(v, _mm256_set1_epi8(MAP_SIZE - 1)), _mm256_set1_epi8(MAP_SIZE)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+mod26_down(__m256i v) {
+	return _mm256_add_epi8(v, _mm256_and_si256(
+		_mm256_cmpgt_epi8(_mm256_setzero_si256(), v), _mm256_set1_epi8(MAP_SIZE)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+lookup(__m256i lo, __m256i hi, __m256i x) {
+	return _mm256_blendv_epi8(_mm256_shuffle_epi8(lo, x), _mm256_shuffle_epi8(hi, x),
+		_mm256_cmpgt_epi8(x, _mm256_set1_epi8(15)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+table_half(const unsigned char *t) {
+	return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t));
+}
+
+// through one rotor: add the core offset, look up the wiring, take the offset off again
+__attribute__((target("avx2")))
+static inline __m256i
+rotor(__m256i lo, __m256i hi, __m256i off, __m256i x) {
+	return SUB26(lookup(lo, hi, ADD26(x, off)), off);
+}
+
+__attribute__((target("avx2")))
+static void
+kernel_avx2(const struct wiring *w, struct lanes *st, const struct keybatch *kb,
+	const unsigned char *in, size_t n) {
+	__m256i flo[RACK_SIZE], fhi[RACK_SIZE], ilo[RACK_SIZE], ihi[RACK_SIZE], rlo, rhi;
+	__m256i r0, r1, r2, g0, g1, g2, o0, o1, o2, o3, m0, m1, x, acc[MAP_SIZE];
+	const __m256i one = _mm256_set1_epi8(1);
+	const __m256i n0a = _mm256_set1_epi8(w->notch[0][0]);
+	const __m256i n0b = _mm256_set1_epi8(w->notch[0][1]);
+	const __m256i n1a = _mm256_set1_epi8(w->notch[1][0]);
+	const __m256i n1b = _mm256_set1_epi8(w->notch[1][1]);
+	unsigned char bytes[LANES];
+	int i, lane, m4 = w->num_rotors > 3;
+	size_t j;
+
+	for (i = 0; i < w->num_rotors; i++) {
+		flo[i] = table_half(w->fwd[i]);
+		fhi[i] = table_half(w->fwd[i] + 16);
+		ilo[i] = table_half(w->inv[i]);
+		ihi[i] = table_half(w->inv[i] + 16);
+	}
+	rlo = table_half(w->refl);
+	rhi = table_half(w->refl + 16);
+
+	r0 = _mm256_loadu_si256((const __m256i *)st->rot[0]);
+	r1 = _mm256_loadu_si256((const __m256i *)st->rot[1]);
+	r2 = _mm256_loadu_si256((const __m256i *)st->rot[2]);
+	g0 = _mm256_loadu_si256((const __m256i *)st->ring[0]);
+	g1 = _mm256_loadu_si256((const __m256i *)st->ring[1]);
+	g2 = _mm256_loadu_si256((const __m256i *)st->ring[2]);
+	o3 = _mm256_loadu_si256((const __m256i *)st->off3);
+	for (i = 0; i < MAP_SIZE; i++) {
+		acc[i] = _mm256_setzero_si256();
+	}
+
+	for (j = 0; j < n; j++) {
+		// spin_rotors for every lane: masks are -1 where a rotor sits at a notch
+		m1 = _mm256_or_si256(_mm256_cmpeq_epi8(r1, n1a), _mm256_cmpeq_epi8(r1, n1b));
+		m0 = _mm256_or_si256(_mm256_cmpeq_epi8(r0, n0a), _mm256_cmpeq_epi8(r0, n0b));
+		r1 = mod26_up(_mm256_sub_epi8(_mm256_sub_epi8(r1, m1), m0));
+		r2 = mod26_up(_mm256_sub_epi8(r2, m1));
+		r0 = ADD26(r0, one);
+		o0 = SUB26(r0, g0);
+		o1 = SUB26(r1, g1);
+		o2 = SUB26(r2, g2);
+
+		// the ciphertext letter is the same in every lane, so its plugboard row is
+		// already a vector
+		x = _mm256_loadu_si256((const __m256i *)kb->plug[in[j]]);
+		x = rotor(flo[0], fhi[0], o0, x);
+		x = rotor(flo[1], fhi[1], o1, x);
+		x = rotor(flo[2], fhi[2], o2, x);
+		if (m4) {
+			x = rotor(flo[3], fhi[3], o3, x);
+			x = lookup(rlo, rhi, x);
+			x = rotor(ilo[3], ihi[3], o3, x);
+		} else {
+			x = lookup(rlo, rhi, x);
+		}
+		x = rotor(ilo[2], ihi[2], o2, x);
+		x = rotor(ilo[1], ihi[1], o1, x);
+		x = rotor(ilo[0], ihi[0], o0, x);
+
+		for (i = 0; i < MAP_SIZE; i++) {
+			acc[i] = _mm256_sub_epi8(acc[i], _mm256_cmpeq_epi8(x, _mm256_set1_epi8(i)));
+		}
+	}
+
+	_mm256_storeu_si256((__m256i *)st->rot[0], r0);
+	_mm256_storeu_si256((__m256i *)st->rot[1], r1);
+	_mm256_storeu_si256((__m256i *)st->rot[2], r2);
+	for (i = 0; i < MAP_SIZE; i++) {
+		_mm256_storeu_si256((__m256i *)bytes, acc[i]);
+		for (lane = 0; lane < LANES; lane++) {
+			st->count[i][lane] += bytes[lane];
+		}
+	}
+}
+
+#endif
+
+static kernel_fn kernel = kernel_scalar;
+static kernel_fn best = kernel_scalar; // the fastest the CPU supports
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void
+select_kernel(void) {
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		best = kernel_avx2;
+	}
+#endif
+	kernel = best;
+}
+
+const char *
+keybatch_kernel(int scalar) {
+	pthread_once(&kernel_once, select_kernel);
+	kernel = scalar ? kernel_scalar : best;
+	return kernel == kernel_scalar ? "scalar" : "avx2";
+}
+
+static void
+load_wiring(struct wiring *w, const enigma_ctx *ctx) {
+	int i, j, r;
+
+	memset(w, 0, sizeof(*w));
+	w->num_rotors = ctx->num_rotors;
+	for (i = 0; i < ctx->num_rotors; i++) {
+		memcpy(w->fwd[i], enigma_rotor_fwd[ctx->rack[i].code], MAP_SIZE);
+		memcpy(w->inv[i], enigma_rotor_inv[ctx->rack[i].code], MAP_SIZE);
+	}
+	memcpy(w->refl, enigma_reflector_map[ctx->reflector], MAP_SIZE);
+	for (i = 0; i < 2; i++) {
+		for (j = 0, r = 0; j < MAX_NOTCHES; j++, r++) {
+			while (r < MAP_SIZE && !(ctx->rack[i].notches >> r & 1)) {
+				r++;
+			}
+			w->notch[i][j] = r < MAP_SIZE ? r : NO_NOTCH;
+		}
+	}
+}
+
+void
+keybatch_set(struct keybatch *kb, int lane, const enigma_ctx *ctx) {
+	int i, pos = ctx->pos;
+
+	for (i = 0; i < RACK_SIZE; i++) {
+		kb->rotation[i][lane] = ctx->rack[i].rotation;
+		kb->ringset[i][lane] = ctx->rack[i].ringset;
+	}
+	if (ctx->rotation_stale) { // compiled mode holds the positions in pos
+		for (i = 0; i < 3; i++, pos /= MAP_SIZE) {
+			kb->rotation[i][lane] = pos % MAP_SIZE;
+		}
+	}
+	for (i = 0; i < MAP_SIZE; i++) {
+		kb->plug[i][lane] = ctx->plugboard[i];
+	}
+	if (kb->lanes <= lane) {
+		kb->lanes = lane + 1;
+	}
+}
+
+void
+keybatch_score(const enigma_ctx *ctx, const struct keybatch *kb, const char *cipher,
+	size_t n, struct keybatch_scores *out) {
+	unsigned char in[CHUNK], ec;
+	struct wiring w;
+	struct lanes st;
+	size_t i, len;
+	int lane, x, c;
+
+	pthread_once(&kernel_once, select_kernel);
+	load_wiring(&w, ctx);
+
+	memset(&st, 0, sizeof(st));
+	for (lane = 0; lane < kb->lanes; lane++) {
+		for (x = 0; x < 3; x++) {
+			st.rot[x][lane] = kb->rotation[x][lane] % MAP_SIZE;
+			st.ring[x][lane] = kb->ringset[x][lane] % MAP_SIZE;
+		}
+		st.off3[lane] = (kb->rotation[3][lane] + MAP_SIZE -
+			kb->ringset[3][lane] % MAP_SIZE) % MAP_SIZE;
+	}
+
+	for (i = 0; i < n; ) {
+		for (len = 0; i < n && len < CHUNK; i++) {
+			ec = (cipher[i] | 0x20) - 'a';
+			if (ec < MAP_SIZE) {
+				in[len++] = ec;
+			}
+		}
+		kernel(&w, &st, kb, in, len);
+	}
+
+	memset(out, 0, sizeof(*out));
+	for (lane = 0; lane < kb->lanes; lane++) {
+		for (x = 0; x < MAP_SIZE; x++) {
+			out->freq[lane][kb->plug[x][lane]] = st.count[x][lane];
+		}
+		for (x = 0; x < MAP_SIZE; x++) {
+			c = out->freq[lane][x];
+			out->ioc[lane] += (uint64_t)c * (c ? c - 1 : 0);
+		}
+	}
+}
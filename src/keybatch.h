@@ -0,0 +1,42 @@
+#ifndef KEYBATCH_H
+#define KEYBATCH_H
+
+#include "enigma.h"
+#include <stdint.h>
+
+#define KEYBATCH_LANES 32
+
+// Up to KEYBATCH_LANES keys for machines which share a mode, wheel order and reflector,
+// one lane per key. Each field is stored for every lane side by side, so that the
+// value for all the lanes loads as a single vector
+struct keybatch {
+	int lanes;                                  // keys in use
+	unsigned char rotation[4][KEYBATCH_LANES];  // by rotor slot, as in settings.conf
+	unsigned char ringset[4][KEYBATCH_LANES];
+	unsigned char plug[26][KEYBATCH_LANES];     // stecker partner (0-25) of each letter
+};
+
+struct keybatch_scores {
+	uint32_t freq[KEYBATCH_LANES][26]; // letter counts of each lane's decryption
+	uint64_t ioc[KEYBATCH_LANES];      // sum of n(n-1) over freq, the index of
+	                                   // coincidence times letters * (letters - 1)
+};
+
+// Copies the rotor positions, ring settings and plugboard of ctx into a lane
+void keybatch_set(struct keybatch *kb, int lane, const enigma_ctx *ctx);
+
+// Decrypts cipher (anything but letters is ignored) under every key in kb, with the
+// mode, wheel order and reflector of ctx, and scores each decryption. ctx is not
+// changed, and the decryptions are never written out: the plugboard on the way out of
+// the machine only relabels letters, so lanes count the letters leaving the rotors and
+// the plugboard is applied to the counts at the end. On x86 with AVX2 a vector lane
+// decrypts each key, otherwise the keys are decrypted one after another
+void keybatch_score(const enigma_ctx *ctx, const struct keybatch *kb, const char *cipher,
+	size_t n, struct keybatch_scores *out);
+
+// Has keybatch_score decrypt the keys one after another if scalar is set, or else with
+// the fastest kernel the CPU supports, as it does by default. Returns the name of the
+// kernel now in use. For tests: it must not be called while keys are being scored
+const char *keybatch_kernel(int scalar);
+
+#endif
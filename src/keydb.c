@@ -0,0 +1,195 @@
+#include "keydb.h"
+#include "enigma_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define KEYDB_MIN 64 // entries room is first made for
+
+struct keydb {
+	struct enigma_ctx *states; // entry i, ready to copy
+	uint32_t *ids, *dates;
+	size_t count, cap;
+
+	// open addressing hash index of (id, date), holding entry + 1 (0 is an empty
+	// slot). It is never more than half full
+	uint32_t *slots;
+	size_t mask;
+};
+
+static size_t
+slot_of(const keydb *db, uint32_t id, uint32_t date) {
+	uint64_t h = ((uint64_t)date << 32 | id) * 0x9e3779b97f4a7c15ull; // Fibonacci hashing
+
+	return (h >> 32) & db->mask;
+}
+
+static int
+indexed(uint32_t id, uint32_t date) {
+	return id || date;
+}
+
+static void
+index_entry(keydb *db, size_t i) {
+	size_t s = slot_of(db, db->ids[i], db->dates[i]);
+
+	while (db->slots[s]) {
+		s = (s + 1) & db->mask;
+	}
+	db->slots[s] = i + 1;
+}
+
+// makes room for cap entries in all
+static int
+grow(keydb *db, size_t cap) {
+	struct enigma_ctx *states;
+	uint32_t *ids, *dates, *slots;
+	size_t nslots = 2 * KEYDB_MIN, i;
+
+	while (nslots < 2 * cap) {
+		nslots *= 2;
+	}
+
+	// sizeof(struct enigma_ctx) is a multiple of CACHE_LINE, as aligned_alloc needs
+	states = aligned_alloc(CACHE_LINE, cap * sizeof(*states));
+	ids = malloc(cap * sizeof(*ids));
+	dates = malloc(cap * sizeof(*dates));
+	slots = calloc(nslots, sizeof(*slots));
+	if (!states || !ids || !dates || !slots) {
+		free(states);
+		free(ids);
+		free(dates);
+		free(slots);
+		return -1;
+	}
+
+	if (db->count) {
+		memcpy(states, db->states, db->count * sizeof(*states));
+		memcpy(ids, db->ids, db->count * sizeof(*ids));
+		memcpy(dates, db->dates, db->count * sizeof(*dates));
+	}
+	free(db->states);
+	free(db->ids);
+	free(db->dates);
+	free(db->slots);
+	db->states = states;
+	db->ids = ids;
+	db->dates = dates;
+	db->slots = slots;
+	db->cap = cap;
+	db->mask = nslots - 1;
+
+	for (i = 0; i < db->count; i++) {
+		if (indexed(ids[i], dates[i])) {
+			index_entry(db, i);
+		}
+	}
+	return 0;
+}
+
+keydb *
+keydb_create(void) {
+	return calloc(1, sizeof(keydb));
+}
+
+void
+keydb_destroy(keydb *db) {
+	if (db) {
+		free(db->states);
+		free(db->ids);
+		free(db->dates);
+		free(db->slots);
+	}
+	free(db);
+}
+
+int
+keydb_add(keydb *db, const struct enigma_key *k) {
+	struct enigma_ctx *ctx;
+	int err;
+
+	if ((err = key_check(k))) {
+		return err;
+	}
+	if (indexed(k->id, k->date) && keydb_find(db, k->id, k->date) >= 0) {
+		return KEY_EEXIST;
+	}
+	if (db->count == db->cap && grow(db, db->cap ? db->cap * 2 : KEYDB_MIN)) {
+		return KEY_ENOMEM;
+	}
+
+	// entries never have compiled tables, so copying one shares nothing
+	ctx = &db->states[db->count];
+	memset(ctx, 0, sizeof(*ctx));
+	key_to_ctx(k, ctx);
+	db->ids[db->count] = k->id;
+	db->dates[db->count] = k->date;
+	if (indexed(k->id, k->date)) {
+		index_entry(db, db->count);
+	}
+	db->count++;
+
+	return KEY_OK;
+}
+
+int
+keydb_load(keydb *db, const char *fname) {
+	struct key_list l;
+	size_t i;
+	int err;
+
+	if ((err = key_list_load(&l, fname))) {
+		return err;
+	}
+	if (db->count + l.count > db->cap && grow(db, db->count + l.count)) {
+		key_list_free(&l);
+		return KEY_ENOMEM;
+	}
+	for (i = 0; i < l.count && !err; i++) {
+		err = keydb_add(db, &l.keys[i]);
+	}
+	key_list_free(&l);
+
+	return err;
+}
+
+size_t
+keydb_count(const keydb *db) {
+	return db->count;
+}
+
+long
+keydb_find(const keydb *db, uint32_t id, uint32_t date) {
+	size_t s, e;
+
+	if (!db->slots) {
+		return -1;
+	}
+	for (s = slot_of(db, id, date); (e = db->slots[s]); s = (s + 1) & db->mask) {
+		if (db->ids[e - 1] == id && db->dates[e - 1] == date) {
+			return e - 1;
+		}
+	}
+
+	return -1;
+}
+
+void
+keydb_copy(const keydb *db, size_t i, enigma_ctx *ctx) {
+	enigma_set_compiled_ctx(ctx, 0);
+	*ctx = db->states[i];
+}
+
+enigma_ctx *
+keydb_clone(const keydb *db, size_t i) {
+	return enigma_ctx_clone(&db->states[i]);
+}
+
+void
+keydb_usage(const keydb *db, struct keydb_usage *u) {
+	u->entries = db->count;
+	u->state_bytes = db->cap * sizeof(*db->states);
+	u->index_bytes = db->cap * (sizeof(*db->ids) + sizeof(*db->dates)) +
+		(db->slots ? (db->mask + 1) * sizeof(*db->slots) : 0);
+	u->total = sizeof(*db) + u->state_bytes + u->index_bytes;
+	u->per_entry = db->count ? u->total / db->count : 0;
+}
@@ -0,0 +1,51 @@
+#ifndef KEYDB_H
+#define KEYDB_H
+
+#include "enigma.h"
+#include "key.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// A key database holds many settings ready to run, for jobs which choose among
+// thousands of keys. Each entry is a whole machine state, stored as a context with its
+// rotors, reflector and plugboard already loaded, one after another in a single array.
+// Entries are found by key sheet id and date through a hash index, and a context is
+// set up from an entry by copying it, which costs the same for every key. Keys with
+// neither an id nor a date can only be reached by their index
+typedef struct keydb keydb;
+
+// Memory held by a database, in bytes
+struct keydb_usage {
+	size_t entries;
+	size_t state_bytes; // machine states, including room reserved for more
+	size_t index_bytes; // ids, dates and the hash index
+	size_t total;
+	size_t per_entry;   // total / entries, 0 when empty
+};
+
+keydb *keydb_create(void);
+void keydb_destroy(keydb *db);
+
+// Adds k (which is checked first) as the next entry. Two keys may not share an id and
+// date (KEY_EEXIST), unless both are 0. Returns KEY_OK or an error from key.h
+int keydb_add(keydb *db, const struct enigma_key *k);
+
+// Adds every key of the key list fname. Stops at the first key which can not be added
+int keydb_load(keydb *db, const char *fname);
+
+size_t keydb_count(const keydb *db);
+
+// Index of the entry with this id and date, or -1 if there is none
+long keydb_find(const keydb *db, uint32_t id, uint32_t date);
+
+// Sets ctx up as entry i, as key_to_ctx would. ctx leaves compiled mode, and is a
+// context of its own afterwards: nothing it does changes the entry
+void keydb_copy(const keydb *db, size_t i, enigma_ctx *ctx);
+
+// A new context set up as entry i, or NULL if it could not be allocated. Free it with
+// enigma_ctx_destroy
+enigma_ctx *keydb_clone(const keydb *db, size_t i);
+
+void keydb_usage(const keydb *db, struct keydb_usage *u);
+
+#endif
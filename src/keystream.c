@@ -0,0 +1,180 @@
+#include "keystream.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BUCKETS 256
+
+// the settings a table depends on
+struct settings {
+	unsigned char mode, reflector;
+	unsigned char rotor[RACK_SIZE];
+	unsigned char ringset[3];
+	unsigned char offset3;          // core offset of the fourth rotor in MODE_M4
+	unsigned char plug[MAP_SIZE];
+};
+
+struct entry {
+	struct settings key;
+	unsigned int hash;
+	size_t bytes;
+	struct enigma_table *table;     // holding a reference of the cache's own
+	struct entry *chain;            // next in the bucket
+	struct entry *newer, *older;
+};
+
+// Entries are found through the buckets and kept on a list from the most recently
+// used to the least, which is evicted first
+static struct {
+	pthread_mutex_t lock;
+	struct entry *bucket[BUCKETS];
+	struct entry *newest, *oldest;
+	struct keystream_usage usage;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static unsigned int
+settings_of(const struct enigma_ctx *ctx, struct settings *s) {
+	const unsigned char *p = (const unsigned char *)s;
+	unsigned int h = 2166136261u; // FNV-1a
+	size_t i;
+
+	memset(s, 0, sizeof(*s));
+	s->mode = ctx->mode;
+	s->reflector = ctx->reflector;
+	for (i = 0; i < (size_t)ctx->num_rotors; i++) {
+		s->rotor[i] = ctx->rack[i].code;
+	}
+	for (i = 0; i < 3; i++) {
+		s->ringset[i] = ctx->rack[i].ringset;
+	}
+	if (ctx->num_rotors > 3) {
+		s->offset3 = WRAP(ctx->rack[3].rotation + MAP_SIZE - ctx->rack[3].ringset);
+	}
+	memcpy(s->plug, ctx->plugboard, MAP_SIZE);
+
+	for (i = 0; i < sizeof(*s); i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h;
+}
+
+static struct entry *
+find(const struct settings *key, unsigned int hash) {
+	struct entry *e;
+
+	for (e = cache.bucket[hash % BUCKETS]; e; e = e->chain) {
+		if (e->hash == hash && !memcmp(&e->key, key, sizeof(*key))) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void
+unlink_lru(struct entry *e) {
+	*(e->newer ? &e->newer->older : &cache.newest) = e->older;
+	*(e->older ? &e->older->newer : &cache.oldest) = e->newer;
+}
+
+static void
+link_newest(struct entry *e) {
+	e->newer = NULL;
+	e->older = cache.newest;
+	*(cache.newest ? &cache.newest->newer : &cache.oldest) = e;
+	cache.newest = e;
+}
+
+static void
+evict(struct entry *e) {
+	struct entry **p = &cache.bucket[e->hash % BUCKETS];
+
+	while (*p != e) {
+		p = &(*p)->chain;
+	}
+	*p = e->chain;
+	unlink_lru(e);
+	cache.usage.entries--;
+	cache.usage.bytes -= e->bytes;
+	cache.usage.evictions++;
+	enigma_table_release(e->table);
+	free(e);
+}
+
+// evicts the least recently used tables until bytes more fit under the limit
+static void
+make_room(size_t bytes) {
+	while (cache.oldest && cache.usage.bytes + bytes > cache.usage.limit) {
+		evict(cache.oldest);
+	}
+}
+
+void
+keystream_cache_limit(size_t bytes) {
+	pthread_mutex_lock(&cache.lock);
+	cache.usage.limit = bytes;
+	make_room(0);
+	pthread_mutex_unlock(&cache.lock);
+}
+
+void
+keystream_cache_usage(struct keystream_usage *u) {
+	pthread_mutex_lock(&cache.lock);
+	*u = cache.usage;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+struct enigma_table *
+keystream_get(const struct enigma_ctx *ctx) {
+	struct enigma_table *t = NULL;
+	struct settings key;
+	unsigned int hash;
+	struct entry *e;
+
+	hash = settings_of(ctx, &key);
+	pthread_mutex_lock(&cache.lock);
+	if ((e = find(&key, hash))) {
+		unlink_lru(e);
+		link_newest(e);
+		t = e->table;
+		atomic_fetch_add(&t->refs, 1);
+		cache.usage.hits++;
+	} else if (cache.usage.limit) {
+		cache.usage.misses++;
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	return t;
+}
+
+struct enigma_table *
+keystream_put(const struct enigma_ctx *ctx, struct enigma_table *t) {
+	struct settings key;
+	unsigned int hash;
+	struct entry *e;
+	size_t bytes;
+
+	bytes = sizeof(*t) + (t->owns_rows ? sizeof(t->rows[0]) * POSITIONS : 0);
+	hash = settings_of(ctx, &key);
+	pthread_mutex_lock(&cache.lock);
+	if ((e = find(&key, hash))) {
+		// built by two threads at once: keep the first
+		enigma_table_release(t);
+		t = e->table;
+		atomic_fetch_add(&t->refs, 1);
+	} else if (bytes <= cache.usage.limit && (e = malloc(sizeof(*e)))) {
+		make_room(bytes);
+		e->key = key;
+		e->hash = hash;
+		e->bytes = bytes;
+		e->table = t;
+		atomic_fetch_add(&t->refs, 1);
+		e->chain = cache.bucket[hash % BUCKETS];
+		cache.bucket[hash % BUCKETS] = e;
+		link_newest(e);
+		cache.usage.entries++;
+		cache.usage.bytes += bytes;
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	return t;
+}
@@ -0,0 +1,43 @@
+#ifndef KEYSTREAM_H
+#define KEYSTREAM_H
+
+#include "enigma_internal.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Compiled tables shared between every machine with the same base settings: mode,
+// wheel order, reflector, ring settings, plugboard and (in MODE_M4) the core offset of
+// the fourth rotor. Ground settings play no part, since a table already holds the
+// substitution of every rotor position along the stepping schedule: a message which
+// starts at position p reads the rows of next[p], next[next[p]] and so on, so every
+// message under a daily key runs through the one table from its own start. The cache
+// keeps the tables most recently asked for, up to a memory limit, and evicts the least
+// recently used. Tables are never modified, so machines on any thread use them as
+// they are, and an evicted table is freed once the last machine using it lets go
+struct keystream_usage {
+	uint64_t hits;      // tables found in the cache
+	uint64_t misses;    // tables built because they were not
+	uint64_t evictions;
+	size_t entries;
+	size_t bytes;       // memory held by the tables in the cache
+	size_t limit;
+};
+
+// Sets the memory the cache may hold, in bytes, evicting tables down to it. 0, the
+// default, turns the cache off and empties it. Tables which point into a table cache
+// file (see tablecache.h) count for their header only, and must be evicted before the
+// file is closed
+void keystream_cache_limit(size_t bytes);
+
+void keystream_cache_usage(struct keystream_usage *u);
+
+// The table for the settings of ctx, with a reference taken for the caller, or NULL
+// if the cache has none
+struct enigma_table *keystream_get(const struct enigma_ctx *ctx);
+
+// Offers t, built for the settings of ctx, to the cache. Returns the table ctx should
+// use: t, or the one another thread cached for the same settings first, in which case
+// the reference to t is dropped
+struct enigma_table *keystream_put(const struct enigma_ctx *ctx, struct enigma_table *t);
+
+#endif
@@ -1,21 +1,146 @@
+#include "batch.h"
+#include "crib.h"
 #include "enigma.h"
+#include "io.h"
+#include "key.h"
+#include "keydb.h"
+#include "keystream.h"
+#include "ngram.h"
+#include "pool.h"
+#include "server.h"
+#include "solve.h"
+#include "stats.h"
+#include "tablecache.h"
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
-#define BLOCK_SIZE 5
-#define END_BLOCK(x) ((x)%BLOCK_SIZE == 0)
+#define CHUNK_SIZE 65536
+#define PAR_CHUNK_SIZE (1 << 20)
+#define OUT_SIZE (1 << 20)
+#define SOLVE_RESULTS 5 // settings printed by -S
 
 int g_verbose = 0;
+int g_compiled = 0;
+int g_threads = 1;
+int g_filter = 0;            // reading stdin rather than a file
+uint64_t g_flush = OUT_SIZE; // letters to buffer before writing them out
+uint64_t g_checkpoint = 0;   // letters between saves of the machine state
 char *g_settings = NULL;
+char *g_batch = NULL;        // manifest of messages to encrypt
+char *g_crib = NULL;         // known plaintext to search for settings with
+long g_crib_offset = -1;
+int g_crib_rings = -1;       // ring settings searched, -1 for the default
+int g_crib_mode = MODE_M3;
+char *g_solve = NULL;        // n-gram table to solve FILE with
+struct shard g_shard = {0};  // part of the -S search to run
+char *g_solve_state = NULL;  // checkpoint of the -S search
+int g_merge = 0;             // merge the -S checkpoints given as files
+char *g_ngrams = NULL;       // n-gram table to build from FILE
+int g_ngram_size = 4;
+char *g_key_list = NULL;     // key list to build from the key lines in FILE
+int g_print_key = 0;         // print the settings as a key line
+char *g_key_db = NULL;       // key list to report the key database memory use of
+char *g_stats = NULL;        // file to write the counters of stats.h to
+char *g_listen = NULL;       // address to serve sessions on
+char *g_build_tables = NULL; // table cache to build
+unsigned int g_table_rotors = 0; // rotors of the wheel orders of g_build_tables
+char *g_tables = NULL;       // table cache to take compiled tables from
+table_cache *g_table_cache = NULL;
+size_t g_keystream_mb = 64;  // tables kept for machines differing only in ground settings
+char *g_state = "settings.conf";
+enigma_ctx *g_machine = NULL;
 
-void
+// buffered output, written straight to file descriptor 1
+char g_out[OUT_SIZE];
+size_t g_out_len = 0;
+uint64_t g_count = 0;   // letters encrypted so far
+uint64_t g_flushed = 0; // letters written out so far
+
+// work shared by the threads of a parallel run. The input is cut into chunks, each of
+// which is encrypted by a separate clone of g_machine
+struct job {
+	const char *in;
+	size_t len, nchunks;
+	uint64_t *letters; // letters in each chunk, later letters before each chunk
+	char **out;        // encrypted chunks, split into blocks
+	size_t *out_len;
+	char **scratch;    // per worker
+};
+
+_Noreturn void
 usage(void) {
-	fprintf(stderr, "usage: enigma [-s SETTINGS] FILE\n");
+	fprintf(stderr, "usage: enigma [-c] [-j THREADS] [-s SETTINGS] [-o STATE] [-k N] [-f N] "
+		"[FILE]\n");
+	fprintf(stderr, "       enigma [-c] [-m MB] [-j THREADS] [-s SETTINGS] -b MANIFEST\n");
+	fprintf(stderr, "       enigma [-j THREADS] [-4] [-R RINGS] -C CRIB[@OFFSET] [FILE]\n");
+	fprintf(stderr, "       enigma [-j THREADS] [-4] [-P SHARDS] [-W CHECKPOINT] -S NGRAMS "
+		"[FILE]\n");
+	fprintf(stderr, "       enigma -J CHECKPOINT...\n");
+	fprintf(stderr, "       enigma [-n N] -G NGRAMS [FILE]\n");
+	fprintf(stderr, "       enigma [-s SETTINGS] -K\n");
+	fprintf(stderr, "       enigma -L KEYS [FILE]\n");
+	fprintf(stderr, "       enigma -D KEYS\n");
+	fprintf(stderr, "       enigma [-c] [-m MB] [-j THREADS] -l ADDRESS\n");
+	fprintf(stderr, "       enigma [-j THREADS] [-4] -T TABLES[@ROTORS]\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Encrypts FILE, or standard input if FILE is missing or -\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Enigma Arguments:\n");
-	fprintf(stderr, "\t-s Initialize enigma using SETTINGS file\n");
+	fprintf(stderr, "\t-s Initialize enigma using SETTINGS file, a file holding a key\n");
+	fprintf(stderr, "\t   line, or KEYS#N for entry N (from 0) of the key list KEYS\n");
+	fprintf(stderr, "\t-o Save the final state to STATE (default settings.conf,\n");
+	fprintf(stderr, "\t   not saved when reading standard input unless given)\n");
+	fprintf(stderr, "\t-k Also save the state every N letters\n");
+	fprintf(stderr, "\t-f Write output after every N letters (default 1 for\n");
+	fprintf(stderr, "\t   standard input, otherwise when the buffer fills)\n");
+	fprintf(stderr, "\t-c Precompute substitution tables (faster on long input)\n");
+	fprintf(stderr, "\t-t Take precomputed tables from the table cache TABLES\n");
+	fprintf(stderr, "\t-m Share up to MB megabytes of precomputed tables between\n");
+	fprintf(stderr, "\t   messages and sessions whose settings differ only in their\n");
+	fprintf(stderr, "\t   ground settings (default 64, 0 for none)\n");
+	fprintf(stderr, "\t-j Encrypt using THREADS threads (files only; -C, -S and -l use\n");
+	fprintf(stderr, "\t   every CPU unless given)\n");
+	fprintf(stderr, "\t-b Encrypt each message listed in MANIFEST, one \"SETTINGS FILE\"\n");
+	fprintf(stderr, "\t   pair per line (SETTINGS - uses -s), printing one line each\n");
+	fprintf(stderr, "\t-C Search for the settings which encrypted FILE, given that CRIB\n");
+	fprintf(stderr, "\t   is part of the plaintext (at letter OFFSET, or anywhere).\n");
+	fprintf(stderr, "\t   Every surviving setting is printed as a settings file\n");
+	fprintf(stderr, "\t-R Ring settings searched by -C: 0 none, 1 the fast rotor\n");
+	fprintf(stderr, "\t   (default), 2 the fast and middle rotors. With -S, 1\n");
+	fprintf(stderr, "\t   searches the fast rotor ring in the first pass too\n");
+	fprintf(stderr, "\t-S Search for the settings which encrypted FILE, knowing no\n");
+	fprintf(stderr, "\t   plaintext, scoring trial decryptions with the NGRAMS table.\n");
+	fprintf(stderr, "\t   The best settings found are printed as settings files\n");
+	fprintf(stderr, "\t-P Run only shards I to J of N of the -S search, given as I/N\n");
+	fprintf(stderr, "\t   or I-J/N (from 0)\n");
+	fprintf(stderr, "\t-W Save the progress of the -S search to CHECKPOINT every 30\n");
+	fprintf(stderr, "\t   seconds and when done, resuming from it if it exists\n");
+	fprintf(stderr, "\t-J Print the best settings in the finished -S checkpoints of\n");
+	fprintf(stderr, "\t   the shards of a search\n");
+	fprintf(stderr, "\t-G Build the NGRAMS table for -S from the text in FILE\n");
+	fprintf(stderr, "\t-n Letters in each n-gram built by -G, 2 to 4 (default 4)\n");
+	fprintf(stderr, "\t-K Print the settings as a single key line\n");
+	fprintf(stderr, "\t-L Build the key list KEYS from the key lines in FILE\n");
+	fprintf(stderr, "\t-D Load the key list KEYS into a key database and print the\n");
+	fprintf(stderr, "\t   memory it takes\n");
+	fprintf(stderr, "\t-l Serve encryption sessions on ADDRESS, unix:PATH or a TCP port\n");
+	fprintf(stderr, "\t   on localhost, until killed (see src/server.h). With -c the\n");
+	fprintf(stderr, "\t   sessions use precomputed tables\n");
+	fprintf(stderr, "\t-T Build the table cache TABLES for every M3 wheel order (M4\n");
+	fprintf(stderr, "\t   with -4) of ROTORS, given as digits 1-8 (default all),\n");
+	fprintf(stderr, "\t   leaving it as it is if it is up to date\n");
+	fprintf(stderr, "\t-M Write counters to FILE on exit and on SIGUSR1, as Prometheus\n");
+	fprintf(stderr, "\t   text if it ends in .prom, otherwise JSON (- for standard\n");
+	fprintf(stderr, "\t   error). Needs a build with make STATS=1\n");
+	fprintf(stderr, "\t-4 Search M4 settings with -C or -S, or build M4 tables with -T\n");
+	fprintf(stderr, "\t   (default M3)\n");
 	fprintf(stderr, "\t-v Verbose output\n");
 	fprintf(stderr, "\t-h Display this help message\n");
 	exit(1);
@@ -23,11 +148,12 @@ usage(void) {
 
 void 
 parse_args(int argc, char *argv[]) {    
-	int c;
+	int c, state = 0, flush = 0, threads = 0;
+	char *at;
 
 	opterr = 0;
 
-	while ((c = getopt (argc, argv, "vhs:")) != -1) {
+	while ((c = getopt (argc, argv, "vhc4KJj:s:o:k:f:b:C:R:S:G:n:L:D:M:l:P:W:T:t:m:")) != -1) {
 		switch (c) {        
 		case 'v':
 			g_verbose = 1;
@@ -35,77 +161,691 @@ parse_args(int argc, char *argv[]) {
 		case 's':
 			g_settings = optarg;
 			break;
+		case 'c':
+			g_compiled = 1;
+			break;
+		case 'j':
+			g_threads = atoi(optarg);
+			threads = 1;
+			if (g_threads < 1) {
+				fprintf(stderr, "Option -j requires a positive thread count.\n");
+				exit(1);
+			}
+			break;
+		case 'o':
+			g_state = optarg;
+			state = 1;
+			break;
+		case 'k':
+			g_checkpoint = strtoull(optarg, NULL, 10);
+			break;
+		case 'f':
+			g_flush = strtoull(optarg, NULL, 10);
+			flush = 1;
+			break;
+		case 'b':
+			g_batch = optarg;
+			break;
+		case 'C':
+			g_crib = optarg;
+			if ((at = strchr(optarg, '@'))) {
+				*at = 0;
+				g_crib_offset = atol(at + 1);
+			}
+			break;
+		case 'R':
+			g_crib_rings = atoi(optarg);
+			break;
+		case 'S':
+			g_solve = optarg;
+			break;
+		case 'P':
+			if (shard_parse(optarg, &g_shard)) {
+				fprintf(stderr, "Option -P requires shards as I/N or I-J/N.\n");
+				exit(1);
+			}
+			break;
+		case 'W':
+			g_solve_state = optarg;
+			break;
+		case 'J':
+			g_merge = 1;
+			break;
+		case 'T':
+			g_build_tables = optarg;
+			if ((at = strchr(optarg, '@'))) {
+				*at++ = 0;
+				for (; *at >= '1' && *at <= '8'; at++) {
+					g_table_rotors |= 1u << (*at - '1');
+				}
+				if (*at || !g_table_rotors) {
+					fprintf(stderr, "Option -T requires rotors as digits 1-8.\n");
+					exit(1);
+				}
+			}
+			break;
+		case 't':
+			g_tables = optarg;
+			break;
+		case 'm':
+			g_keystream_mb = strtoull(optarg, NULL, 10);
+			break;
+		case 'G':
+			g_ngrams = optarg;
+			break;
+		case 'n':
+			g_ngram_size = atoi(optarg);
+			break;
+		case '4':
+			g_crib_mode = MODE_M4;
+			break;
+		case 'K':
+			g_print_key = 1;
+			break;
+		case 'L':
+			g_key_list = optarg;
+			break;
+		case 'D':
+			g_key_db = optarg;
+			break;
+		case 'M':
+			g_stats = optarg;
+			break;
+		case 'l':
+			g_listen = optarg;
+			break;
 		case 'h':
 			usage();
 		case '?':
-			if (optopt == 'c') {
+			if (strchr("sjokfbCRSGnLDMlPWTtm", optopt)) {
 				fprintf(stderr, "Option -%c requires an argument.\n", optopt);
 			} else if (isprint(optopt)) {
 				fprintf(stderr, "Unknown option `-%c'.\n", optopt);
 			} else {
 				fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
 			}
+			// fall through
 		default:
 			exit(1);
 		}
 	}
+
+	if (g_crib_rings < 0) {
+		g_crib_rings = g_crib ? 1 : 0;
+	}
+	if ((g_crib || g_solve || g_listen || g_build_tables) && !threads) {
+		g_threads = sysconf(_SC_NPROCESSORS_ONLN); // a search or server wants every core
+		g_threads = g_threads < 1 ? 1 : g_threads;
+	}
+	if (g_merge && optind == argc) {
+		fprintf(stderr, "Option -J requires checkpoint files.\n");
+		exit(1);
+	}
+	if (g_batch || g_crib || g_solve || g_merge || g_ngrams || g_key_list || g_print_key ||
+		g_key_db || g_listen || g_build_tables) {
+		return;
+	}
+
+	if (optind == argc || !strcmp(argv[optind], "-")) {
+		g_filter = 1;
+		g_threads = 1;
+		if (!state) {
+			g_state = NULL;
+		}
+		if (!flush) {
+			g_flush = 1;
+		}
+	}
+
+	if (g_checkpoint && !g_state) {
+		fprintf(stderr, "Option -k requires -o when reading standard input.\n");
+		exit(1);
+	}
+	if (g_checkpoint) {
+		g_threads = 1; // chunks finish out of order, so checkpoints need a serial run
+	}
 }
 
 void
 initialize(int argc, char *argv[]) {
+	int err;
 
 	parse_args(argc, argv);
 
-	if (optind == argc) {
-		usage();
+	if (g_stats && stats_export(g_stats)) {
+		fprintf(stderr, "Unable to export counters%s\n",
+			stats_enabled() ? "" : ": built without ENIGMA_STATS");
+		exit(1);
 	}
 
-	enigma_init();
-	
-	if (g_settings) {
-		enigma_state_load(g_settings);
+	if (g_tables) {
+		if (!(g_table_cache = table_cache_open(g_tables))) {
+			exit(1);
+		}
+		table_cache_use(g_table_cache);
+	}
+	if (!g_solve && !g_crib && !g_build_tables) {
+		// searches build each table once, so would only fill it
+		keystream_cache_limit(g_keystream_mb << 20);
+	}
+
+	g_machine = enigma_ctx_create();
+	if (!g_machine) {
+		fprintf(stderr, "Unable to allocate enigma machine\n");
+		exit(1);
 	}
 
+	if (g_settings && (err = key_load_settings(g_machine, g_settings))) {
+		fprintf(stderr, "Unable to load %s: %s\n", g_settings, key_strerror(err));
+		exit(1);
+	}
+
+	enigma_set_compiled_ctx(g_machine, g_compiled);
+
 	if (g_verbose) {
-		enigma_print();
+		enigma_print_ctx(g_machine);
+	}
+}
+
+void
+count_chunk(void *arg, size_t task, int worker) {
+	struct job *job = arg;
+	const char *p = job->in + task * PAR_CHUNK_SIZE;
+	size_t i, len = PAR_CHUNK_SIZE;
+	uint64_t n = 0;
+
+	(void)worker;
+	if (task == job->nchunks - 1) {
+		len = job->len - task * PAR_CHUNK_SIZE;
+	}
+	for (i = 0; i < len; i++) {
+		n += isalpha((unsigned char)p[i]) != 0;
+	}
+
+	job->letters[task] = n;
+}
+
+void
+encrypt_chunk(void *arg, size_t task, int worker) {
+	struct job *job = arg;
+	char *scratch = job->scratch[worker];
+	enigma_ctx *ctx;
+	size_t n, len = PAR_CHUNK_SIZE;
+
+	if (task == job->nchunks - 1) {
+		len = job->len - task * PAR_CHUNK_SIZE;
+	}
+
+	job->out[task] = malloc(GROUPED_SIZE(len));
+	ctx = enigma_ctx_clone(g_machine);
+	if (!job->out[task] || !ctx) {
+		fprintf(stderr, "Unable to allocate memory for chunk %zu\n", task);
+		exit(1);
+	}
+
+	enigma_seek_ctx(ctx, job->letters[task]);
+	n = enigma_encode_buf_ctx(ctx, job->in + task * PAR_CHUNK_SIZE, scratch, len);
+	job->out_len[task] = group(scratch, n, job->letters[task], job->out[task]);
+
+	enigma_ctx_destroy(ctx);
+}
+
+void
+flush_output(void) {
+	write_all(STDOUT_FILENO, g_out, g_out_len);
+	g_out_len = 0;
+	g_flushed = g_count;
+}
+
+// Saves the machine state next to the state file and renames it into place, so the
+// state file is never seen half written. Output is flushed first, so the state never
+// runs ahead of what has been written
+void
+checkpoint(void) {
+	char tmp[PATH_MAX];
+
+	flush_output();
+	snprintf(tmp, sizeof(tmp), "%s.tmp", g_state);
+	enigma_state_save_ctx(g_machine, tmp);
+	if (rename(tmp, g_state)) {
+		perror("rename");
+	}
+}
+
+// bytes of in up to and including its nth letter, or len if it has fewer letters
+size_t
+letters_span(const char *in, size_t len, uint64_t n) {
+	size_t i;
+
+	for (i = 0; i < len && n; i++) {
+		n -= IS_LETTER(in[i]);
+	}
+
+	return i;
+}
+
+// Encrypts a piece of the message straight into the output buffer. Pieces are cut at
+// checkpoint boundaries, so checkpoints land exactly every g_checkpoint letters
+void
+encrypt_piece(const char *in, size_t len) {
+	static char letters[CHUNK_SIZE];
+	size_t n, k;
+
+	for (; len; in += n, len -= n) {
+		n = len < CHUNK_SIZE ? len : CHUNK_SIZE;
+		if (g_checkpoint) {
+			n = letters_span(in, n, g_checkpoint - g_count % g_checkpoint);
+		}
+		if (g_out_len + GROUPED_SIZE(n) > OUT_SIZE) {
+			flush_output();
+		}
+		k = enigma_encode_buf_ctx(g_machine, in, letters, n);
+		g_out_len += group(letters, k, g_count, g_out + g_out_len);
+		g_count += k;
+
+		if (k && g_checkpoint && g_count % g_checkpoint == 0) {
+			checkpoint();
+		} else if (g_count - g_flushed >= g_flush) {
+			flush_output();
+		}
+	}
+}
+
+// Encrypts an input which could not be mapped, as much as is available at a time, so
+// memory use stays constant however long the stream runs
+void
+encrypt_stream(int fd) {
+	static char buf[CHUNK_SIZE];
+	ssize_t n;
+
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("read");
+			exit(1);
+		}
+		STATS_ADD(STAT_BYTES_READ, n);
+		encrypt_piece(buf, n);
+	}
+}
+
+// Splits the input into chunks and encrypts them on g_threads threads. The first pass
+// counts the letters in each chunk, which tells each chunk how far to seek its machine.
+// Output is written in input order once every chunk is done
+void
+encrypt_parallel(const char *in, size_t len) {
+	struct job job = {0};
+	struct iovec *iov;
+	uint64_t n;
+	size_t i;
+	int w;
+
+	job.in = in;
+	job.len = len;
+	job.nchunks = (job.len + PAR_CHUNK_SIZE - 1) / PAR_CHUNK_SIZE;
+	job.letters = malloc(job.nchunks * sizeof(*job.letters));
+	job.out = calloc(job.nchunks, sizeof(*job.out));
+	job.out_len = malloc(job.nchunks * sizeof(*job.out_len));
+	job.scratch = calloc(g_threads, sizeof(*job.scratch));
+	iov = malloc(job.nchunks * sizeof(*iov));
+	if (!job.letters || !job.out || !job.out_len || !job.scratch || !iov) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		exit(1);
+	}
+	for (w = 0; w < g_threads; w++) {
+		if (!(job.scratch[w] = malloc(PAR_CHUNK_SIZE))) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			exit(1);
+		}
+	}
+
+	pool_run(g_threads, job.nchunks, count_chunk, &job);
+	for (i = 0; i < job.nchunks; i++) {
+		n = job.letters[i];
+		job.letters[i] = g_count;
+		g_count += n;
 	}
+
+	pool_run(g_threads, job.nchunks, encrypt_chunk, &job);
+	for (i = 0; i < job.nchunks; i++) {
+		iov[i].iov_base = job.out[i];
+		iov[i].iov_len = job.out_len[i];
+	}
+	writev_all(STDOUT_FILENO, iov, job.nchunks);
+
+	// leave the machine where a serial run would have
+	enigma_seek_ctx(g_machine, g_count);
+
+	for (i = 0; i < job.nchunks; i++) {
+		free(job.out[i]);
+	}
+	for (w = 0; w < g_threads; w++) {
+		free(job.scratch[w]);
+	}
+	free(iov);
+	free(job.scratch);
+	free(job.out_len);
+	free(job.out);
+	free(job.letters);
 }
 
 void
 encrypt(char *fname) {
-	FILE *f;
-	char c;
-	int i = 0;
+	char *in;
+	size_t len;
+	int fd, mapped;
 
-	f = fopen(fname, "r");
+	fd = g_filter ? STDIN_FILENO : open(fname, O_RDONLY);
 	
-	if (!f) {
+	if (fd < 0) {
 		fprintf(stderr, "Unable to open %s\n", fname);
 		exit(1);
 	}
 
-	while (!feof(f)) {
-		
-		c = fgetc(f);
+	fflush(stdout); // anything printed by -v goes first
+
+	in = map_input(fd, &len);
+	mapped = in != NULL;
+	if (!mapped && g_threads > 1 && !(in = read_input(fd, &len))) {
+		fprintf(stderr, "Unable to read %s\n", fname);
+		exit(1);
+	}
+
+	if (!in) {
+		encrypt_stream(fd);
+	} else if (g_threads > 1) {
+		encrypt_parallel(in, len);
+	} else {
+		encrypt_piece(in, len);
+	}
 
-		if (isalpha(c)) {
-			fprintf(stdout, "%c", enigma_encode(c) );			
-			
-			if (END_BLOCK(++i)) {
-				fprintf(stdout, " ");
+	g_out[g_out_len++] = '\n';
+	flush_output();
+
+	if (mapped) {
+		munmap(in, len);
+	} else {
+		free(in);
+	}
+	if (!g_filter) {
+		close(fd);
+	}
+}
+
+void
+print_candidate(const struct crib_result *r, void *arg) {
+	(void)arg;
+	crib_print(stdout, r);
+	printf("\n");
+}
+
+// the whole of FILE (or standard input), NULL if it could not be read
+char *
+slurp(char *fname, size_t *len) {
+	char *in;
+	int fd;
+
+	fd = (!fname || !strcmp(fname, "-")) ? STDIN_FILENO : open(fname, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open %s\n", fname);
+		return NULL;
+	}
+	if (!(in = read_input(fd, len))) {
+		fprintf(stderr, "Unable to read %s\n", fname ? fname : "standard input");
+	}
+	if (fd != STDIN_FILENO) {
+		close(fd);
+	}
+
+	return in;
+}
+
+// Reads the ciphertext in FILE (or standard input) and prints every setting which
+// survives a crib search. Returns 0 if the search ran
+int
+crack(char *fname) {
+	struct crib_search s = {0};
+	size_t len;
+	long found;
+	char *in;
+
+	if (!(in = slurp(fname, &len))) {
+		return 1;
+	}
+
+	s.cipher = in;
+	s.cipher_len = len;
+	s.crib = g_crib;
+	s.offset = g_crib_offset;
+	s.mode = g_crib_mode;
+	s.rings = g_crib_rings;
+	s.threads = g_threads;
+	s.found = print_candidate;
+
+	found = crib_search(&s);
+	if (g_verbose && found >= 0) {
+		fprintf(stderr, "%ld settings survived\n", found);
+	}
+
+	free(in);
+	return found < 0;
+}
+
+// Prints the best settings a ciphertext only search finds for FILE. Returns 0 if the
+// search ran
+int
+solve_file(char *fname) {
+	struct solve_result res[SOLVE_RESULTS];
+	struct solve_params p = {0};
+	struct ngrams g;
+	size_t len;
+	char *in;
+	int i, n;
+
+	if (ngrams_load(&g, g_solve)) {
+		return 1;
+	}
+	if (!(in = slurp(fname, &len))) {
+		ngrams_free(&g);
+		return 1;
+	}
+
+	p.cipher = in;
+	p.cipher_len = len;
+	p.ngrams = &g;
+	p.mode = g_crib_mode;
+	p.threads = g_threads;
+	p.rings = g_crib_rings;
+	p.verbose = g_verbose;
+	p.shard = g_shard;
+	p.checkpoint = g_solve_state;
+
+	n = solve(&p, res, SOLVE_RESULTS);
+	for (i = 0; i < n; i++) {
+		solve_print(stdout, &res[i]);
+		printf("\n");
+	}
+
+	free(in);
+	ngrams_free(&g);
+	return n < 0;
+}
+
+// Builds the table cache fname, or checks that it is up to date. Returns 0 if the cache
+// is ready for use
+int
+build_tables(char *fname) {
+	int mode = g_crib_mode, rc;
+
+	rc = table_cache_build(fname, mode, g_table_rotors, g_threads);
+	if (rc > 0) {
+		fprintf(stderr, "%s is up to date\n", fname);
+	}
+
+	return rc < 0;
+}
+
+// Prints the best settings in the checkpoints of the shards of a -S search. Returns 0
+// if they could be merged
+int
+merge_solved(char **files, int n) {
+	struct solve_result res[SOLVE_RESULTS];
+	int i;
+
+	n = solve_merge((const char *const *)files, n, res, SOLVE_RESULTS);
+	for (i = 0; i < n; i++) {
+		solve_print(stdout, &res[i]);
+		printf("\n");
+	}
+
+	return n < 0;
+}
+
+// Builds a key list from the key lines in FILE (or standard input), skipping blank
+// lines and lines starting with #. Returns 0 if every line held a valid key
+int
+build_key_list(char *fname) {
+	struct enigma_key *keys = NULL, *k;
+	size_t len, n = 0, cap = 0, line = 0;
+	char *in, *p, *end, *eol;
+	int err = 0;
+
+	if (!(in = slurp(fname, &len))) {
+		return 1;
+	}
+
+	for (p = in, end = in + len; p < end && !err; p = eol + 1) {
+		if (!(eol = memchr(p, '\n', end - p))) {
+			eol = end;
+		}
+		line++;
+		if (eol == p || *p == '#') {
+			continue;
+		}
+		if (n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			if (!(k = realloc(keys, cap * sizeof(*keys)))) {
+				fprintf(stderr, "Unable to allocate memory\n");
+				exit(1);
 			}
+			keys = k;
+		}
+		if ((err = key_parse(p, eol - p, &keys[n++]))) {
+			fprintf(stderr, "%s:%zu: %s\n", fname ? fname : "stdin", line,
+				key_strerror(err));
 		}
 	}
-	
-	fprintf(stdout, "\n");
 
-	fclose(f);
+	if (!err && (err = key_list_write(g_key_list, keys, n))) {
+		fprintf(stderr, "Unable to write %s: %s\n", g_key_list, key_strerror(err));
+	}
+	if (!err && g_verbose) {
+		fprintf(stderr, "%zu keys written to %s\n", n, g_key_list);
+	}
+
+	free(keys);
+	free(in);
+	return err != 0;
+}
+
+// Loads the key list fname into a key database and prints what it takes in memory.
+// Returns 0 if every key was loaded
+int
+report_key_db(char *fname) {
+	struct keydb_usage u;
+	keydb *db;
+	int err;
+
+	if (!(db = keydb_create())) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		exit(1);
+	}
+	if ((err = keydb_load(db, fname))) {
+		fprintf(stderr, "Unable to load %s: %s\n", fname, key_strerror(err));
+	} else {
+		keydb_usage(db, &u);
+		printf("keys %zu\nstate_bytes %zu\nindex_bytes %zu\ntotal_bytes %zu\n"
+			"bytes_per_key %zu\n", u.entries, u.state_bytes, u.index_bytes, u.total,
+			u.per_entry);
+	}
+
+	keydb_destroy(db);
+	return err != 0;
+}
+
+void
+report_keystreams(void) {
+	struct keystream_usage u;
+
+	keystream_cache_usage(&u);
+	fprintf(stderr, "shared tables: %llu hits, %llu misses, %llu evictions, %zu kept "
+		"in %zu bytes\n", (unsigned long long)u.hits, (unsigned long long)u.misses,
+		(unsigned long long)u.evictions, u.entries, u.bytes);
 }
 
 int
 main(int argc, char *argv[]) {
+	char line[KEY_TEXT_MAX];
+	struct enigma_key key;
+	int rc = EXIT_SUCCESS;
+	size_t len;
+	char *in;
+
 	initialize(argc, argv);
-	encrypt(argv[optind]);
-	enigma_state_save("settings.conf");
-	return EXIT_SUCCESS;
-}
\ No newline at end of file
+	if (g_print_key) {
+		key_from_ctx(&key, g_machine);
+		key_format(&key, line);
+		printf("%s\n", line);
+	} else if (g_listen) {
+		server_run(g_listen, g_threads, g_compiled);
+		rc = EXIT_FAILURE;
+	} else if (g_build_tables) {
+		if (build_tables(g_build_tables)) {
+			rc = EXIT_FAILURE;
+		}
+	} else if (g_key_db) {
+		if (report_key_db(g_key_db)) {
+			rc = EXIT_FAILURE;
+		}
+	} else if (g_key_list) {
+		if (build_key_list(argv[optind])) {
+			rc = EXIT_FAILURE;
+		}
+	} else if (g_ngrams) {
+		in = slurp(argv[optind], &len);
+		if (!in || ngrams_build(in, len, g_ngram_size, g_ngrams)) {
+			rc = EXIT_FAILURE;
+		}
+		free(in);
+	} else if (g_merge) {
+		if (merge_solved(argv + optind, argc - optind)) {
+			rc = EXIT_FAILURE;
+		}
+	} else if (g_solve) {
+		if (solve_file(argv[optind])) {
+			rc = EXIT_FAILURE;
+		}
+	} else if (g_crib) {
+		if (crack(argv[optind])) {
+			rc = EXIT_FAILURE;
+		}
+	} else if (g_batch) {
+		if (batch_run(g_batch, g_machine, g_threads, g_compiled)) {
+			rc = EXIT_FAILURE;
+		}
+	} else {
+		encrypt(argv[optind]);
+		if (g_state) {
+			enigma_state_save_ctx(g_machine, g_state);
+		}
+	}
+	enigma_ctx_destroy(g_machine);
+	if (g_verbose) {
+		report_keystreams();
+	}
+	keystream_cache_limit(0); // its tables may point into the table cache
+	table_cache_close(g_table_cache);
+	return rc;
+}
@@ -0,0 +1,154 @@
+#include "ngram.h"
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NGRAM_BOM 0x0102
+
+static size_t
+table_size(int n) {
+	size_t size = 1;
+
+	while (n--) {
+		size *= 26;
+	}
+
+	return size;
+}
+
+int
+ngrams_load(struct ngrams *g, const char *fname) {
+	const struct ngram_header *h;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open %s\n", fname);
+		return -1;
+	}
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*h)) {
+		fprintf(stderr, "%s is not an n-gram table\n", fname);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Unable to map %s\n", fname);
+		return -1;
+	}
+
+	h = map;
+	if (memcmp(h->magic, "NGRM", 4) || h->version != NGRAM_VERSION ||
+		h->n < 2 || h->n > 4 || h->bom != NGRAM_BOM ||
+		(size_t)st.st_size != sizeof(*h) + table_size(h->n) * sizeof(int16_t)) {
+		fprintf(stderr, "%s is not an n-gram table (or was built on another "
+			"architecture)\n", fname);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	g->n = h->n;
+	g->size = table_size(h->n);
+	g->score = (const int16_t *)(h + 1);
+	g->map = map;
+	g->map_len = st.st_size;
+	return 0;
+}
+
+void
+ngrams_free(struct ngrams *g) {
+	if (g->map) {
+		munmap(g->map, g->map_len);
+	}
+	memset(g, 0, sizeof(*g));
+}
+
+int
+ngrams_build(const char *corpus, size_t len, int n, const char *fname) {
+	struct ngram_header h = { .magic = "NGRM", .version = NGRAM_VERSION, .n = n,
+		.bom = NGRAM_BOM };
+	size_t size = table_size(n), i, idx = 0, seen = 0, total = 0;
+	uint32_t *count;
+	int16_t *score;
+	double lp;
+	FILE *f;
+	int c, rc = -1;
+
+	if (n < 2 || n > 4) {
+		fprintf(stderr, "N-grams must have 2 to 4 letters\n");
+		return -1;
+	}
+	count = calloc(size, sizeof(*count));
+	score = malloc(size * sizeof(*score));
+	if (!count || !score) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		free(count);
+		free(score);
+		return -1;
+	}
+
+	for (i = 0; i < len; i++) {
+		c = (corpus[i] | 0x20) - 'a';
+		if (c < 0 || c >= 26) {
+			continue;
+		}
+		idx = (idx * 26 + c) % size;
+		if (++seen >= (size_t)n) {
+			count[idx]++;
+			total++;
+		}
+	}
+
+	for (i = 0; i < size; i++) {
+		lp = log10((count[i] ? count[i] : 0.01) / (total ? (double)total : 1.0));
+		lp = lp * NGRAM_SCALE < INT16_MIN ? INT16_MIN : lp * NGRAM_SCALE;
+		score[i] = (int16_t)lrint(lp);
+	}
+
+	f = fopen(fname, "wb");
+	if (!f) {
+		fprintf(stderr, "Unable to open %s\n", fname);
+	} else {
+		if (fwrite(&h, sizeof(h), 1, f) == 1 &&
+			fwrite(score, sizeof(*score), size, f) == size) {
+			rc = 0;
+		}
+		if (fclose(f) || rc) {
+			fprintf(stderr, "Unable to write %s\n", fname);
+			rc = -1;
+		}
+	}
+
+	free(count);
+	free(score);
+	return rc;
+}
+
+long
+ngrams_score(const struct ngrams *g, const unsigned char *text, size_t len) {
+	size_t i, n = g->n, idx = 0, top = g->size / 26;
+	long total = 0;
+
+	if (len < n) {
+		return 0;
+	}
+	for (i = 0; i < n - 1; i++) {
+		idx = idx * 26 + text[i];
+	}
+	// slide along, dropping the oldest letter from idx once it has been scored
+	for (; i < len; i++) {
+		idx = idx * 26 + text[i];
+		total += g->score[idx];
+		idx -= text[i - n + 1] * top;
+	}
+
+	return total;
+}
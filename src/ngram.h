@@ -0,0 +1,40 @@
+#ifndef NGRAM_H
+#define NGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NGRAM_VERSION 1
+#define NGRAM_SCALE 1000 // scores are log10 probabilities in thousandths
+
+// File layout: the header below, then one int16_t score for each of the 26^n n-grams,
+// indexed by reading the n-gram as a base 26 number (AAAB is 1). Scores are written in
+// the byte order of the machine which built the file, which bom records
+struct ngram_header {
+	char magic[4];     // "NGRM"
+	uint8_t version;
+	uint8_t n;         // 2 (bigrams), 3 (trigrams) or 4 (quadgrams)
+	uint16_t bom;      // 0x0102 as written
+};
+
+// n-gram log probabilities, mapped straight from the file
+struct ngrams {
+	int n;
+	size_t size;           // 26^n
+	const int16_t *score;
+	void *map;
+	size_t map_len;
+};
+
+// Returns 0 on success, or -1 (having said why) if the file is missing or malformed
+int ngrams_load(struct ngrams *g, const char *fname);
+void ngrams_free(struct ngrams *g);
+
+// Counts the n-grams in the letters of corpus and writes them to fname as a table.
+// N-grams which never occur score as if seen a hundredth of a time. Returns 0 on success
+int ngrams_build(const char *corpus, size_t len, int n, const char *fname);
+
+// total score of the n-grams in text, a run of len letter indexes (0-25)
+long ngrams_score(const struct ngrams *g, const unsigned char *text, size_t len);
+
+#endif
@@ -0,0 +1,100 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+struct share {
+	atomic_size_t next; // next unclaimed task of this share
+	size_t end;
+	char pad[64 - sizeof(atomic_size_t) - sizeof(size_t)]; // one share per cache line
+};
+
+struct pool {
+	pool_task_fn fn;
+	void *arg;
+	int nthreads;
+	struct share *shares;
+};
+
+struct worker {
+	struct pool *pool;
+	int id;
+};
+
+static void *
+work(void *p) {
+	struct worker *w = p;
+	struct pool *pool = w->pool;
+	struct share *s;
+	size_t task;
+	int i;
+
+	// own share first, then everybody else's, starting with the neighbour
+	for (i = 0; i < pool->nthreads; i++) {
+		s = &pool->shares[(w->id + i) % pool->nthreads];
+		while ((task = atomic_fetch_add(&s->next, 1)) < s->end) {
+			pool->fn(pool->arg, task, w->id);
+		}
+	}
+
+	return NULL;
+}
+
+int
+pool_run(int nthreads, size_t ntasks, pool_task_fn fn, void *arg) {
+	struct pool pool = { .fn = fn, .arg = arg };
+	struct worker *workers;
+	pthread_t *threads;
+	size_t task;
+	int i, started, rc = 0;
+
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+	if ((size_t)nthreads > ntasks) {
+		nthreads = ntasks ? ntasks : 1;
+	}
+
+	pool.nthreads = nthreads;
+	pool.shares = aligned_alloc(64, nthreads * sizeof(*pool.shares));
+	workers = malloc(nthreads * sizeof(*workers));
+	threads = malloc(nthreads * sizeof(*threads));
+
+	if (!pool.shares || !workers || !threads) {
+		free(pool.shares); free(workers); free(threads);
+		for (task = 0; task < ntasks; task++) {
+			fn(arg, task, 0);
+		}
+		return -1;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		atomic_init(&pool.shares[i].next, ntasks * i / nthreads);
+		pool.shares[i].end = ntasks * (i + 1) / nthreads;
+		workers[i].pool = &pool;
+		workers[i].id = i;
+	}
+
+	// worker 0 is the calling thread
+	for (started = 1; started < nthreads; started++) {
+		if (pthread_create(&threads[started], NULL, work, &workers[started])) {
+			break;
+		}
+	}
+	if (started == 1 && nthreads > 1) {
+		rc = -1;
+	}
+
+	// shares of threads which failed to start are stolen by the others
+	work(&workers[0]);
+
+	for (i = 1; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(pool.shares);
+	free(workers);
+	free(threads);
+
+	return rc;
+}
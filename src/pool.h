@@ -0,0 +1,16 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// A task is identified by its index, and told which worker (0 to nthreads-1) is
+// running it, so that callers can keep per worker scratch space
+typedef void (*pool_task_fn)(void *arg, size_t task, int worker);
+
+// Runs tasks 0 to ntasks-1 on nthreads threads and waits for them all to finish. Each
+// worker starts on its own share of the tasks and, once that runs out, steals tasks
+// from the shares of the other workers. Returns 0 on success, -1 if no threads could
+// be started (the calling thread then runs every task itself)
+int pool_run(int nthreads, size_t ntasks, pool_task_fn fn, void *arg);
+
+#endif
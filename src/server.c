@@ -0,0 +1,415 @@
+#define _GNU_SOURCE // accept4
+
+#include "server.h"
+#include "ctxpool.h"
+#include "enigma.h"
+#include "key.h"
+#include "pool.h"
+#include "stats.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define HEADER      5    // type and length
+#define BUF_MIN     4096 // receive buffer a session starts with
+#define BATCH       64   // replies sent by a single sendmsg
+#define SCRATCH     512  // room for replies which are not written in place
+#define EVENTS      256
+#define LISTEN_BACKLOG 1024
+
+// Replies to E frames are written over their own request: the letters are encrypted
+// in place and the header rewritten in front of them, so they go out of the receive
+// buffer with no copying. Other replies are built in scratch. While a batch of replies
+// is being sent nothing more is read, which also holds back clients that do not read
+struct session {
+	int fd;
+	int worker;                 // the thread serving it
+	ctx_pool *ctxs;
+	int compiled;
+	enigma_ctx *ctx;            // NULL until the first O frame
+	char *buf;                  // bytes received but not yet answered
+	size_t len, cap;
+	size_t done;                // bytes of buf answered by the batch being sent
+	struct iovec iov[BATCH];    // the batch still to send
+	int iov_first, iov_cnt;
+	char scratch[SCRATCH];
+	size_t scratch_len;
+	int closing;                // close once the batch is sent
+	int writing;                // waiting for room to send, rather than for input
+};
+
+struct server {
+	int fd;
+	ctx_pool *ctxs;             // machines of the sessions, by worker
+	int compiled;
+};
+
+static uint32_t
+get_be32(const char *p) {
+	const unsigned char *u = (const unsigned char *)p;
+
+	return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 | u[3];
+}
+
+static void
+put_header(char *p, char type, uint32_t len) {
+	p[0] = type;
+	p[1] = len >> 24;
+	p[2] = len >> 16;
+	p[3] = len >> 8;
+	p[4] = len;
+}
+
+static void
+session_close(struct session *s) {
+	close(s->fd);
+	ctx_pool_put(s->ctxs, s->worker, s->ctx);
+	free(s->buf);
+	free(s);
+}
+
+// adds a reply of len payload bytes, built in scratch, to the batch. Returns 0 if
+// there was no room
+static int
+reply_scratch(struct session *s, char type, const char *payload, size_t len) {
+	char *p = s->scratch + s->scratch_len;
+
+	if (s->iov_cnt == BATCH || s->scratch_len + HEADER + len > SCRATCH) {
+		return 0;
+	}
+	put_header(p, type, len);
+	memcpy(p + HEADER, payload, len);
+	s->iov[s->iov_cnt].iov_base = p;
+	s->iov[s->iov_cnt++].iov_len = HEADER + len;
+	s->scratch_len += HEADER + len;
+	return 1;
+}
+
+static int
+reply_error(struct session *s, const char *msg) {
+	return reply_scratch(s, 'X', msg, strlen(msg));
+}
+
+// Answers the frame at p. Returns 0 if there was no room left in the batch for the
+// reply, so that the frame must wait for the next one
+static int
+handle_frame(struct session *s, char *p, uint32_t len) {
+	char line[KEY_TEXT_MAX];
+	struct enigma_key k;
+	char *in = p + HEADER;
+	size_t n;
+	int err;
+
+	switch (p[0]) {
+	case 'E':
+		if (!s->ctx) {
+			return reply_error(s, "no session");
+		}
+		if (s->iov_cnt == BATCH) {
+			return 0;
+		}
+		n = enigma_encode_buf_ctx(s->ctx, in, in, len);
+		put_header(p, 'E', n);
+		s->iov[s->iov_cnt].iov_base = p;
+		s->iov[s->iov_cnt++].iov_len = HEADER + n;
+		return 1;
+	case 'O':
+		if ((err = key_parse(in, len, &k))) {
+			return reply_error(s, key_strerror(err));
+		}
+		if (!s->ctx && !(s->ctx = ctx_pool_get(s->ctxs, s->worker))) {
+			return reply_error(s, "out of memory");
+		}
+		key_to_ctx(&k, s->ctx);
+		enigma_set_compiled_ctx(s->ctx, s->compiled);
+		return reply_scratch(s, 'O', "", 0);
+	case 'K':
+		if (!s->ctx) {
+			return reply_error(s, "no session");
+		}
+		key_from_ctx(&k, s->ctx);
+		n = key_format(&k, line);
+		return reply_scratch(s, 'K', line, n);
+	default:
+		// closing only once the error is queued, so that it waits for room like any
+		// other reply rather than being dropped
+		if (!reply_error(s, "unknown frame type")) {
+			return 0;
+		}
+		s->closing = 1;
+		return 1;
+	}
+}
+
+// Answers every whole frame in buf, up to the size of a batch
+static void
+handle_frames(struct session *s) {
+	uint32_t len;
+
+	s->done = 0;
+	while (!s->closing && s->len - s->done >= HEADER) {
+		len = get_be32(s->buf + s->done + 1);
+		if (len > SERVER_FRAME_MAX) {
+			if (reply_error(s, "frame too large")) {
+				s->closing = 1;
+			}
+			break;
+		}
+		if (s->len - s->done - HEADER < len ||
+			!handle_frame(s, s->buf + s->done, len)) {
+			break;
+		}
+		s->done += HEADER + len;
+	}
+}
+
+// Sends what is left of the batch. Returns 0 once it is all sent, 1 if the socket is
+// full and -1 on error
+static int
+send_batch(struct session *s) {
+	struct msghdr msg = {0};
+	ssize_t w;
+
+	while (s->iov_cnt) {
+		msg.msg_iov = s->iov + s->iov_first;
+		msg.msg_iovlen = s->iov_cnt;
+		if ((w = sendmsg(s->fd, &msg, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+		}
+		STATS_ADD(STAT_BYTES_WRITTEN, w);
+		for (; s->iov_cnt && (size_t)w >= s->iov[s->iov_first].iov_len; s->iov_cnt--) {
+			w -= s->iov[s->iov_first++].iov_len;
+		}
+		if (s->iov_cnt) {
+			s->iov[s->iov_first].iov_base = (char *)s->iov[s->iov_first].iov_base + w;
+			s->iov[s->iov_first].iov_len -= w;
+		}
+	}
+
+	// drop the answered frames
+	memmove(s->buf, s->buf + s->done, s->len - s->done);
+	s->len -= s->done;
+	s->done = 0;
+	s->iov_first = 0;
+	s->scratch_len = 0;
+	return 0;
+}
+
+// Answers and sends batches until the frames run out or the socket fills up. Returns
+// -1 if the session is over
+static int
+flush(struct session *s, int ep) {
+	struct epoll_event ev = { .data.ptr = s };
+	int rc;
+
+	for (;;) {
+		if ((rc = send_batch(s)) < 0) {
+			return -1;
+		}
+		if (rc) {
+			if (!s->writing) {
+				ev.events = EPOLLOUT;
+				epoll_ctl(ep, EPOLL_CTL_MOD, s->fd, &ev);
+				s->writing = 1;
+			}
+			return 0;
+		}
+		if (s->closing) {
+			return -1;
+		}
+		handle_frames(s);
+		if (!s->iov_cnt) {
+			break;
+		}
+	}
+
+	if (s->writing) {
+		ev.events = EPOLLIN;
+		epoll_ctl(ep, EPOLL_CTL_MOD, s->fd, &ev);
+		s->writing = 0;
+	}
+	return 0;
+}
+
+// Reads what has arrived. Returns -1 if the session is over
+static int
+receive(struct session *s, int ep) {
+	size_t need, cap;
+	ssize_t n;
+	char *buf;
+
+	// a frame which does not fit yet: the buffer holds nothing else, as every frame
+	// before it has been answered
+	if (s->len == s->cap) {
+		need = HEADER + get_be32(s->buf + 1);
+		for (cap = s->cap * 2; cap < need; cap *= 2) {
+			;
+		}
+		if (!(buf = realloc(s->buf, cap))) {
+			return -1;
+		}
+		s->buf = buf;
+		s->cap = cap;
+	}
+
+	if ((n = read(s->fd, s->buf + s->len, s->cap - s->len)) <= 0) {
+		return n < 0 && (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	}
+	STATS_ADD(STAT_BYTES_READ, n);
+	s->len += n;
+
+	handle_frames(s);
+	return s->iov_cnt || s->closing ? flush(s, ep) : 0;
+}
+
+static void
+accept_all(struct server *srv, int ep, int worker) {
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct session *s;
+	int fd, one = 1;
+
+	while ((fd = accept4(srv->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails on UNIX
+		if (!(s = calloc(1, sizeof(*s))) || !(s->buf = malloc(BUF_MIN))) {
+			free(s);
+			close(fd);
+			continue;
+		}
+		s->fd = fd;
+		s->worker = worker;
+		s->ctxs = srv->ctxs;
+		s->compiled = srv->compiled;
+		s->cap = BUF_MIN;
+		ev.data.ptr = s;
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev)) {
+			session_close(s);
+		}
+	}
+}
+
+// Each worker waits on its own epoll set, which holds the listening socket (handed to
+// a single worker per connection by EPOLLEXCLUSIVE) and the sessions it accepted
+static void
+serve(void *arg, size_t task, int worker) {
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+	struct epoll_event events[EVENTS];
+	struct server *srv = arg;
+	struct session *s;
+	int ep, i, n, rc;
+
+	(void)task;
+	if ((ep = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+		epoll_ctl(ep, EPOLL_CTL_ADD, srv->fd, &ev)) {
+		perror("epoll");
+		return;
+	}
+
+	for (;;) {
+		if ((n = epoll_wait(ep, events, EVENTS, -1)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (!(s = events[i].data.ptr)) {
+				accept_all(srv, ep, worker);
+				continue;
+			}
+			// frames sent before a hang up are still answered: receive reads on
+			// until the end of input, and only then closes the session
+			if (events[i].events & EPOLLOUT) {
+				rc = flush(s, ep);
+			} else if (events[i].events & EPOLLIN) {
+				rc = receive(s, ep);
+			} else {
+				rc = -1; // EPOLLERR or EPOLLHUP, with nothing left to read
+			}
+			if (rc) {
+				session_close(s);
+			}
+		}
+	}
+
+	close(ep);
+}
+
+static int
+listen_on(const char *addr) {
+	struct sockaddr_un un = { .sun_family = AF_UNIX };
+	struct sockaddr_in in = { .sin_family = AF_INET };
+	char *end;
+	long port;
+	int fd, one = 1;
+
+	if (!strncmp(addr, "unix:", 5)) {
+		if (strlen(addr + 5) >= sizeof(un.sun_path)) {
+			fprintf(stderr, "Socket path too long: %s\n", addr + 5);
+			return -1;
+		}
+		strcpy(un.sun_path, addr + 5);
+		unlink(un.sun_path);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr *)&un, sizeof(un))) {
+			perror(addr);
+			return -1;
+		}
+	} else {
+		port = strtol(addr, &end, 10);
+		if (*end || port < 1 || port > 65535) {
+			fprintf(stderr, "Not a port or unix:PATH: %s\n", addr);
+			return -1;
+		}
+		in.sin_port = htons(port);
+		in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd >= 0) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		}
+		if (fd < 0 || bind(fd, (struct sockaddr *)&in, sizeof(in))) {
+			perror(addr);
+			return -1;
+		}
+	}
+
+	if (listen(fd, LISTEN_BACKLOG)) {
+		perror("listen");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int
+server_run(const char *addr, int threads, int compiled) {
+	struct server srv = { .compiled = compiled };
+
+	threads = threads < 1 ? 1 : threads;
+	if (!(srv.ctxs = ctx_pool_create(threads))) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return -1;
+	}
+	if ((srv.fd = listen_on(addr)) < 0) {
+		ctx_pool_destroy(srv.ctxs);
+		return -1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	pool_run(threads, threads, serve, &srv);
+	close(srv.fd);
+	ctx_pool_destroy(srv.ctxs);
+	return -1;
+}
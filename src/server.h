@@ -0,0 +1,25 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+// A long running server which keeps a machine per connection, so clients pay neither
+// process startup nor settings parsing per message. Every message either way is a
+// frame: a type byte, a 4 byte big endian payload length (at most SERVER_FRAME_MAX)
+// and the payload. Requests are
+//     O  open a session, or reset it: the payload is a key line as printed by -K
+//     E  encrypt (or, as it is the same thing, decrypt) the payload, the machine
+//        carrying on from where the last chunk left it
+//     K  the current settings of the session as a key line
+// and each is answered in order by a frame of the same type (O with no payload, E with
+// the letters of the chunk, K with the key line), or by X with an error message. A
+// frame which can not be read as any of these is answered by X and the connection
+// is closed. Connections are spread over the threads, each of which waits on its own
+// epoll set and never passes a session to another
+#define SERVER_FRAME_MAX (1 << 20)
+
+// Serves on addr, unix:PATH for a UNIX socket or a TCP port on localhost, with threads
+// threads. With compiled set, sessions run in compiled mode, so that sessions under
+// the same key share their tables (see keystream.h). Only returns if the server could
+// not be started
+int server_run(const char *addr, int threads, int compiled);
+
+#endif
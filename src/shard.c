@@ -0,0 +1,120 @@
+#include "shard.h"
+#include "io.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SHARD_BOM 0x0102
+
+// a number from 0 to INT_MAX at *s, moving s past it. Returns -1 if there is none
+static int
+number(const char **s) {
+	long n = 0;
+
+	if (**s < '0' || **s > '9') {
+		return -1;
+	}
+	while (**s >= '0' && **s <= '9') {
+		n = n * 10 + *(*s)++ - '0';
+		if (n > INT_MAX) {
+			return -1;
+		}
+	}
+
+	return n;
+}
+
+int
+shard_parse(const char *str, struct shard *s) {
+	const char *p = str;
+
+	s->first = s->last = number(&p);
+	if (*p == '-') {
+		p++;
+		s->last = number(&p);
+	}
+	if (*p++ != '/') {
+		return -1;
+	}
+	s->count = number(&p);
+
+	return *p || s->first < 0 || s->last < s->first || s->count <= s->last ? -1 : 0;
+}
+
+void
+shard_range(const struct shard *s, size_t units, size_t *begin, size_t *end) {
+	if (s->count <= 0) {
+		*begin = 0;
+		*end = units;
+		return;
+	}
+	*begin = (uint64_t)units * s->first / s->count;
+	*end = (uint64_t)units * (s->last + 1) / s->count;
+}
+
+int
+shard_save(const char *fname, const void *buf, size_t len) {
+	struct shard_header h = { .magic = "ESHD", .version = SHARD_VERSION,
+		.bom = SHARD_BOM, .len = len };
+	char tmp[PATH_MAX];
+	FILE *f;
+	int err = 0;
+
+	h.crc = crc32(0, buf, len);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+	if (!(f = fopen(tmp, "wb"))) {
+		fprintf(stderr, "Unable to write %s\n", tmp);
+		return -1;
+	}
+	if (fwrite(&h, sizeof(h), 1, f) != 1 || fwrite(buf, 1, len, f) != len) {
+		err = -1;
+	}
+	if (fclose(f) || err || rename(tmp, fname)) {
+		fprintf(stderr, "Unable to write %s\n", fname);
+		remove(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+shard_load(const char *fname, void **buf, size_t *len) {
+	struct shard_header h;
+	FILE *f;
+
+	*buf = NULL;
+	if (!(f = fopen(fname, "rb"))) {
+		if (errno == ENOENT) {
+			return 1;
+		}
+		fprintf(stderr, "Unable to open %s\n", fname);
+		return -1;
+	}
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, "ESHD", 4) ||
+		h.version != SHARD_VERSION || h.bom != SHARD_BOM || h.len > SIZE_MAX) {
+		fprintf(stderr, "%s is not a checkpoint (or was written on another "
+			"architecture)\n", fname);
+		fclose(f);
+		return -1;
+	}
+	if (!(*buf = malloc(h.len ? h.len : 1))) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		fclose(f);
+		return -1;
+	}
+	if (fread(*buf, 1, h.len, f) != h.len || fgetc(f) != EOF ||
+		crc32(0, *buf, h.len) != h.crc) {
+		fprintf(stderr, "Checkpoint %s is damaged\n", fname);
+		free(*buf);
+		*buf = NULL;
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	*len = h.len;
+	return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Long key searches are split into numbered units of work, always listed in the same
+// order, so that separate processes can each take a shard of them with nothing to
+// coordinate them but the shard numbers. Shard i of n takes units i * units / n up to
+// (i + 1) * units / n, so the shards cover every unit once, and a process can take a
+// range of neighbouring shards
+struct shard {
+	int first, last; // shards taken, first to last
+	int count;       // shards the search is split into, 0 for an unsplit search
+};
+
+// Parses I/N (shard I of N, from 0) or I-J/N (shards I to J). Returns 0 on success
+int shard_parse(const char *str, struct shard *s);
+
+// the units [*begin, *end) which s takes of units
+void shard_range(const struct shard *s, size_t units, size_t *begin, size_t *end);
+
+// Checkpoint files hold the progress of a shard: a struct shard_header, then len bytes
+// laid out by the search. They are written in the byte order of the machine which
+// wrote them, which bom records, next to fname and then renamed into place, so a
+// process killed while saving leaves the last checkpoint whole
+struct shard_header {
+	char magic[4];   // "ESHD"
+	uint8_t version; // SHARD_VERSION
+	uint8_t reserved0;
+	uint16_t bom;    // 0x0102 as written
+	uint64_t len;
+	uint32_t crc;    // CRC-32 of the bytes after the header
+	uint32_t reserved;
+};
+
+#define SHARD_VERSION 1
+
+// Returns 0 on success
+int shard_save(const char *fname, const void *buf, size_t len);
+
+// Reads the checkpoint fname into a buffer which the caller frees. Returns 0 on
+// success, 1 if there is no such file, -1 (with a message) if it can not be used
+int shard_load(const char *fname, void **buf, size_t *len);
+
+#endif
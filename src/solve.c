@@ -0,0 +1,723 @@
+#include "solve.h"
+#include "enigma_internal.h"
+#include "io.h"
+#include "pool.h"
+#include "shard.h"
+#include "trace.h"
+#include "wheels.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_CANDIDATES 500
+#define DEFAULT_RESTARTS 4
+#define DEFAULT_PLUGS 10
+#define RANDOM_PLUGS 5 // pairs a restart (other than the first) starts from
+#define DEFAULT_SAVE_SECS 30
+#define UNIT_GROUNDS (MAP_SIZE * MAP_SIZE) // ground settings in a unit of the first pass
+
+enum { RANKING, CLIMBING, FINISHED };
+
+// A setting on its way through the search. The first pass fills in the wheel order
+// and ground (with rings at 0), the hill climbs the rest
+struct candidate {
+	long key;      // index of coincidence of the unplugged decryption, for ranking
+	int wheels;    // index into the wheel order list
+	int ground;    // rotor core offsets at the start of the message
+	int ring0, ring1;
+	double score;
+	unsigned char plug[MAP_SIZE];
+};
+
+// Everything a thread needs, allocated before the search starts
+struct worker {
+	enigma_ctx *ctx;
+	int wheels;                  // wheel order of table, -1 for none
+	struct enigma_table *table;
+	struct trace trace;          // table rows under the ciphertext, and a decryption
+	struct candidate *best;      // heap of the best grounds of one wheel order
+	uint64_t rng;
+};
+
+// The search as saved in a checkpoint: this, then a done flag for each unit of the
+// shard (while ranking) or each candidate (while climbing), then the candidates. A
+// checkpoint is only resumed by the search it was saved from
+struct progress {
+	uint64_t units;          // units of the whole keyspace
+	uint32_t cipher_crc;     // of the ciphertext letters
+	uint32_t ngrams_crc;
+	uint32_t rotor_mask;
+	int32_t mode, rings, candidates, restarts, max_plugs;
+	int32_t shard_first, shard_last, shard_count;
+	int32_t phase, num_cands;
+	int32_t reserved;
+};
+
+struct solver {
+	const struct solve_params *p;
+	unsigned char *cipher;
+	size_t len;
+	struct wheels *wheels;
+	size_t num_wheels, ranked;
+	struct candidate *cands; // heap of the best candidates during the first pass
+	int num_cands, max_cands, max_plugs;
+	struct worker *workers;
+	pthread_mutex_t lock;
+
+	// the first pass is split into units of one wheel order and slow rotor ground, unit
+	// u being wheel order u / MAP_SIZE, and the shard takes units begin to end
+	size_t begin, end;
+	size_t *tasks;           // units or candidates still to be done
+	unsigned char *done;     // of each unit of the shard, then of each candidate
+	struct progress head;
+	time_t saved;
+};
+
+typedef long (*score_fn)(struct solver *sv, struct worker *w, const unsigned char *plug);
+
+// Keeps the cap candidates with the highest keys in a min heap
+static void
+heap_add(struct candidate *h, int *n, int cap, const struct candidate *c) {
+	int i, child;
+
+	if (*n < cap) {
+		for (i = (*n)++; i > 0 && h[(i - 1) / 2].key > c->key; i = (i - 1) / 2) {
+			h[i] = h[(i - 1) / 2];
+		}
+		h[i] = *c;
+		return;
+	}
+	if (c->key <= h[0].key) {
+		return;
+	}
+	for (i = 0; (child = 2 * i + 1) < *n; i = child) {
+		if (child + 1 < *n && h[child + 1].key < h[child].key) {
+			child++;
+		}
+		if (h[child].key >= c->key) {
+			break;
+		}
+		h[i] = h[child];
+	}
+	h[i] = *c;
+}
+
+static int
+by_wheels(const void *a, const void *b) {
+	const struct candidate *x = a, *y = b;
+
+	return (x->wheels > y->wheels) - (x->wheels < y->wheels);
+}
+
+static int
+by_score(const void *a, const void *b) {
+	const struct candidate *x = a, *y = b;
+
+	return (x->score < y->score) - (x->score > y->score);
+}
+
+static uint64_t
+next_random(struct worker *w) {
+	w->rng ^= w->rng << 13; // xorshift64
+	w->rng ^= w->rng >> 7;
+	w->rng ^= w->rng << 17;
+	return w->rng;
+}
+
+// the compiled tables of wheel order i, rebuilt only when the worker changes order
+static struct enigma_table *
+worker_table(struct solver *sv, struct worker *w, int i) {
+	if (w->wheels != i) {
+		w->table = wheels_table(w->ctx, sv->p->mode, &sv->wheels[i], 0);
+		w->wheels = w->table ? i : -1;
+	}
+	return w->table;
+}
+
+// sum of n(n-1) over the letter counts, the index of coincidence up to a constant
+static long
+coincidences(const int *counts) {
+	long sum = 0;
+	int i;
+
+	for (i = 0; i < MAP_SIZE; i++) {
+		sum += (long)counts[i] * (counts[i] - 1);
+	}
+
+	return sum;
+}
+
+// Writes the progress of the search to its checkpoint, called with the lock held
+static void
+save(struct solver *sv) {
+	size_t done = sv->head.phase == RANKING ? sv->end - sv->begin :
+		sv->head.phase == CLIMBING ? (size_t)sv->num_cands : 0;
+	size_t len = sizeof(sv->head) + done + sv->num_cands * sizeof(*sv->cands);
+	unsigned char *buf;
+
+	if (!(buf = malloc(len))) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return;
+	}
+	sv->head.num_cands = sv->num_cands;
+	memcpy(buf, &sv->head, sizeof(sv->head));
+	memcpy(buf + sizeof(sv->head), sv->done, done);
+	memcpy(buf + sizeof(sv->head) + done, sv->cands, sv->num_cands * sizeof(*sv->cands));
+	shard_save(sv->p->checkpoint, buf, len);
+	free(buf);
+	sv->saved = time(NULL);
+}
+
+// saves the checkpoint if it is due, called with the lock held
+static void
+tick(struct solver *sv) {
+	int secs = sv->p->save_secs > 0 ? sv->p->save_secs : DEFAULT_SAVE_SECS;
+
+	if (sv->p->checkpoint && time(NULL) - sv->saved >= secs) {
+		save(sv);
+	}
+}
+
+// Picks the search up from its checkpoint, if it has one. Returns 0 if it was resumed
+// or there was nothing to resume, -1 if the checkpoint is not of this search
+static int
+resume(struct solver *sv) {
+	struct progress head;
+	size_t len, done;
+	void *buf;
+	int err;
+
+	if (!sv->p->checkpoint || (err = shard_load(sv->p->checkpoint, &buf, &len)) > 0) {
+		return 0;
+	}
+	if (err) {
+		return -1;
+	}
+	if (len < sizeof(head)) {
+		fprintf(stderr, "Checkpoint %s is damaged\n", sv->p->checkpoint);
+		free(buf);
+		return -1;
+	}
+
+	memcpy(&head, buf, sizeof(head));
+	sv->head.phase = head.phase;
+	sv->head.num_cands = head.num_cands;
+	done = head.phase == RANKING ? sv->end - sv->begin :
+		head.phase == CLIMBING ? (size_t)head.num_cands : 0;
+	if (memcmp(&head, &sv->head, sizeof(head)) || head.phase < RANKING ||
+		head.phase > FINISHED || head.num_cands < 0 || head.num_cands > sv->max_cands ||
+		len != sizeof(head) + done + head.num_cands * sizeof(*sv->cands)) {
+		fprintf(stderr, "Checkpoint %s is not of this search\n", sv->p->checkpoint);
+		free(buf);
+		return -1;
+	}
+
+	sv->num_cands = head.num_cands;
+	memcpy(sv->done, (unsigned char *)buf + sizeof(head), done);
+	memcpy(sv->cands, (unsigned char *)buf + sizeof(head) + done,
+		head.num_cands * sizeof(*sv->cands));
+	free(buf);
+	return 0;
+}
+
+// First pass: the index of coincidence of the unplugged decryption at every ground
+// setting of one unit, and every ring setting of the fast rotor if asked for
+static void
+rank_unit(void *arg, size_t task, int worker) {
+	struct solver *sv = arg;
+	struct worker *w = &sv->workers[worker];
+	size_t u = sv->tasks[task];
+	struct candidate c = { .wheels = u / MAP_SIZE };
+	struct enigma_table *t;
+	int counts[MAP_SIZE], n = 0, g, p, x, r0, rings0 = sv->p->rings >= 1 ? MAP_SIZE : 1;
+	int start = u % MAP_SIZE * UNIT_GROUNDS;
+	size_t i;
+
+	if (!(t = worker_table(sv, w, c.wheels))) {
+		fprintf(stderr, "Unable to build tables for wheel order %d\n", c.wheels);
+		return;
+	}
+
+	for (g = start; g < start + UNIT_GROUNDS; g++) {
+		for (r0 = 0; r0 < rings0; r0++) {
+			memset(counts, 0, sizeof(counts));
+			p = g - g % MAP_SIZE + (g % MAP_SIZE + r0) % MAP_SIZE;
+			for (i = 0; i < sv->len; i++) {
+				p = t->next[p];
+				x = p % MAP_SIZE < r0 ? p + MAP_SIZE - r0 : p - r0;
+				counts[t->perm[x][sv->cipher[i]]]++;
+			}
+			c.key = coincidences(counts);
+			c.ground = g;
+			c.ring0 = r0;
+			heap_add(w->best, &n, sv->max_cands, &c);
+		}
+	}
+
+	pthread_mutex_lock(&sv->lock);
+	for (g = 0; g < n; g++) {
+		heap_add(sv->cands, &sv->num_cands, sv->max_cands, &w->best[g]);
+	}
+	sv->done[u - sv->begin] = 1;
+	if (sv->p->verbose) {
+		fprintf(stderr, "\rRanked %zu of %zu units", ++sv->ranked, sv->end - sv->begin);
+	}
+	tick(sv);
+	pthread_mutex_unlock(&sv->lock);
+}
+
+// Looks up the table row under each ciphertext letter. The rotors start at the core
+// offsets of the ground plus the ring settings, and step from there, while the wiring
+// is found at the rotation less the ring setting
+static void
+set_rows(struct solver *sv, struct worker *w, const struct candidate *c) {
+	const struct enigma_table *t = w->table;
+	int a = c->ground % MAP_SIZE, b = c->ground / MAP_SIZE % MAP_SIZE;
+	int p, x, y;
+	size_t i;
+
+	p = (a + c->ring0) % MAP_SIZE + MAP_SIZE * ((b + c->ring1) % MAP_SIZE) +
+		c->ground - c->ground % (MAP_SIZE * MAP_SIZE);
+	for (i = 0; i < sv->len; i++) {
+		p = t->next[p];
+		x = (p % MAP_SIZE + MAP_SIZE - c->ring0) % MAP_SIZE;
+		y = (p / MAP_SIZE % MAP_SIZE + MAP_SIZE - c->ring1) % MAP_SIZE;
+		w->trace.rows[i] = t->perm[x + MAP_SIZE * y + p - p % (MAP_SIZE * MAP_SIZE)];
+	}
+}
+
+// index of coincidence of the unplugged decryption
+static long
+score_rings(struct solver *sv, struct worker *w) {
+	int counts[MAP_SIZE] = {0};
+	size_t i;
+
+	for (i = 0; i < sv->len; i++) {
+		counts[w->trace.rows[i][sv->cipher[i]]]++;
+	}
+
+	return coincidences(counts);
+}
+
+// Scores the decryption under plug, which differs from the plugboard of the trace by
+// a move, leaving the trace as it is
+static long
+score_ioc(struct solver *sv, struct worker *w, const unsigned char *plug) {
+	(void)sv;
+	return trace_ioc(&w->trace, plug);
+}
+
+static long
+score_ngrams(struct solver *sv, struct worker *w, const unsigned char *plug) {
+	long s = ngrams_score(sv->p->ngrams, trace_try(&w->trace, plug), sv->len);
+
+	trace_undo(&w->trace);
+	return s;
+}
+
+static int
+pairs(const unsigned char *plug) {
+	int i, n = 0;
+
+	for (i = 0; i < MAP_SIZE; i++) {
+		n += plug[i] > i;
+	}
+
+	return n;
+}
+
+// Changes the plugboard a pair at a time while that improves the score. A move either
+// removes a pair, or joins two letters after freeing them from their partners. The
+// trace follows the plugboard, so each move only redoes the letters it reaches
+static long
+climb(struct solver *sv, struct worker *w, unsigned char *plug, score_fn score) {
+	unsigned char trial[MAP_SIZE];
+	long best, s;
+	int a, b, improved;
+
+	trace_update(&w->trace, plug);
+	best = score(sv, w, plug);
+
+	do {
+		improved = 0;
+		for (a = 0; a < MAP_SIZE; a++) {
+			for (b = a + 1; b < MAP_SIZE; b++) {
+				memcpy(trial, plug, MAP_SIZE);
+				if (trial[a] == b) {
+					trial[a] = a;
+					trial[b] = b;
+				} else {
+					trial[trial[a]] = trial[a];
+					trial[trial[b]] = trial[b];
+					trial[a] = b;
+					trial[b] = a;
+					if (pairs(trial) > sv->max_plugs) {
+						continue;
+					}
+				}
+				if ((s = score(sv, w, trial)) > best) {
+					best = s;
+					memcpy(plug, trial, MAP_SIZE);
+					improved = 1;
+				}
+				trace_update(&w->trace, plug);
+			}
+		}
+	} while (improved);
+
+	return best;
+}
+
+// Second pass: ring settings, then the plugboard from a few starting points
+static void
+climb_candidate(void *arg, size_t task, int worker) {
+	struct solver *sv = arg;
+	struct worker *w = &sv->workers[worker];
+	size_t k = sv->tasks[task];
+	struct candidate cand = sv->cands[k], *c = &cand;
+	unsigned char plug[MAP_SIZE];
+	long s, best = -1;
+	int r0, r1, ring0 = 0, ring1 = 0, i, a, b, restart;
+
+	c->score = -1e300;
+	if (!worker_table(sv, w, c->wheels)) {
+		fprintf(stderr, "Unable to build tables for wheel order %d\n", c->wheels);
+		goto done;
+	}
+
+	for (r1 = 0; r1 < MAP_SIZE; r1++) {
+		for (r0 = 0; r0 < MAP_SIZE; r0++) {
+			c->ring0 = r0;
+			c->ring1 = r1;
+			set_rows(sv, w, c);
+			if ((s = score_rings(sv, w)) > best) {
+				best = s;
+				ring0 = r0;
+				ring1 = r1;
+			}
+		}
+	}
+	c->ring0 = ring0;
+	c->ring1 = ring1;
+	set_rows(sv, w, c);
+
+	w->rng = (k + 1) * 0x9e3779b97f4a7c15ull;
+	for (restart = 0; restart < sv->p->restarts; restart++) {
+		for (i = 0; i < MAP_SIZE; i++) {
+			plug[i] = i;
+		}
+		for (i = 0; restart && i < RANDOM_PLUGS && i < sv->max_plugs; i++) {
+			a = next_random(w) % MAP_SIZE;
+			b = next_random(w) % MAP_SIZE;
+			if (plug[a] == a && plug[b] == b) {
+				plug[a] = b;
+				plug[b] = a;
+			}
+		}
+
+		trace_set_plug(&w->trace, plug);
+		climb(sv, w, plug, score_ioc);
+		s = climb(sv, w, plug, score_ngrams);
+		if (s / (double)(sv->len - sv->p->ngrams->n + 1) > c->score) {
+			c->score = s / (double)(sv->len - sv->p->ngrams->n + 1);
+			memcpy(c->plug, plug, MAP_SIZE);
+		}
+	}
+
+done:
+	pthread_mutex_lock(&sv->lock);
+	sv->cands[k] = cand;
+	sv->done[k] = 1;
+	if (sv->p->verbose) {
+		fprintf(stderr, "\rClimbed %zu of %d candidates", ++sv->ranked, sv->num_cands);
+	}
+	tick(sv);
+	pthread_mutex_unlock(&sv->lock);
+}
+
+static void
+result(struct solver *sv, const struct candidate *c, struct solve_result *r) {
+	const struct wheels *w = &sv->wheels[c->wheels];
+	int i;
+
+	memset(r, 0, sizeof(*r));
+	r->score = c->score / NGRAM_SCALE;
+	r->mode = sv->p->mode;
+	r->reflector = w->reflector;
+	for (i = 0; i < RACK_SIZE; i++) {
+		r->rotor[i] = w->rotor[i];
+	}
+	r->rotation[0] = (c->ground % MAP_SIZE + c->ring0) % MAP_SIZE;
+	r->rotation[1] = (c->ground / MAP_SIZE % MAP_SIZE + c->ring1) % MAP_SIZE;
+	r->rotation[2] = c->ground / (MAP_SIZE * MAP_SIZE);
+	r->rotation[3] = w->rotation3;
+	r->ringset[0] = c->ring0;
+	r->ringset[1] = c->ring1;
+	for (i = 0; i < MAP_SIZE; i++) {
+		r->plugboard[i] = DECODE(c->plug[i]);
+	}
+}
+
+static void
+free_workers(struct solver *sv, int n) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		enigma_ctx_destroy(sv->workers[i].ctx);
+		trace_free(&sv->workers[i].trace);
+		free(sv->workers[i].best);
+	}
+	free(sv->workers);
+}
+
+// lists the tasks of a phase of n which are not done yet, returning how many
+static size_t
+pending(struct solver *sv, size_t n, size_t first) {
+	size_t i, k = 0;
+
+	for (i = 0; i < n; i++) {
+		if (!sv->done[i]) {
+			sv->tasks[k++] = first + i;
+		}
+	}
+
+	return k;
+}
+
+int
+solve(const struct solve_params *p, struct solve_result *out, int nout) {
+	struct solver sv = {0};
+	struct solve_params params = *p;
+	int threads = p->threads > 0 ? p->threads : 1, i, n = -1, workers = 0;
+	struct worker *w;
+	size_t k, units;
+
+	if (!params.candidates) {
+		params.candidates = DEFAULT_CANDIDATES;
+	}
+	if (!params.restarts) {
+		params.restarts = DEFAULT_RESTARTS;
+	}
+	sv.p = &params;
+	sv.max_cands = params.candidates;
+	sv.max_plugs = params.max_plugs ? params.max_plugs : DEFAULT_PLUGS;
+
+	sv.cipher = malloc(p->cipher_len ? p->cipher_len : 1);
+	if (!sv.cipher) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		return -1;
+	}
+	for (k = 0; k < p->cipher_len; k++) {
+		i = ENCODE(toupper((unsigned char)p->cipher[k]));
+		if (IS_VALID(i)) {
+			sv.cipher[sv.len++] = i;
+		}
+	}
+	if (sv.len < (size_t)p->ngrams->n || sv.len < 2) {
+		fprintf(stderr, "Ciphertext is too short to solve\n");
+		goto done;
+	}
+
+	if (!(sv.num_wheels = wheels_list(p->mode, p->rotor_mask, &sv.wheels))) {
+		fprintf(stderr, "No wheel orders to search\n");
+		goto done;
+	}
+	shard_range(&p->shard, sv.num_wheels * MAP_SIZE, &sv.begin, &sv.end);
+	units = sv.end - sv.begin;
+	units = units > (size_t)sv.max_cands ? units : (size_t)sv.max_cands;
+
+	sv.cands = malloc(sv.max_cands * sizeof(*sv.cands));
+	sv.tasks = malloc(units * sizeof(*sv.tasks));
+	sv.done = calloc(units, 1);
+	sv.workers = calloc(threads, sizeof(*sv.workers));
+	if (!sv.cands || !sv.tasks || !sv.done || !sv.workers) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		goto done;
+	}
+	for (workers = 0; workers < threads; workers++) {
+		w = &sv.workers[workers];
+		w->wheels = -1;
+		w->ctx = enigma_ctx_create();
+		w->best = malloc(sv.max_cands * sizeof(*w->best));
+		if (!w->ctx || trace_init(&w->trace, sv.cipher, sv.len) || !w->best) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			workers++;
+			goto done;
+		}
+	}
+
+	sv.head.units = sv.num_wheels * MAP_SIZE;
+	sv.head.cipher_crc = crc32(0, sv.cipher, sv.len);
+	sv.head.ngrams_crc = crc32(0, p->ngrams->score, p->ngrams->size *
+		sizeof(*p->ngrams->score));
+	sv.head.rotor_mask = p->rotor_mask;
+	sv.head.mode = p->mode;
+	sv.head.rings = p->rings;
+	sv.head.candidates = sv.max_cands;
+	sv.head.restarts = params.restarts;
+	sv.head.max_plugs = sv.max_plugs;
+	sv.head.shard_first = p->shard.count > 0 ? p->shard.first : 0;
+	sv.head.shard_last = p->shard.count > 0 ? p->shard.last : 0;
+	sv.head.shard_count = p->shard.count > 0 ? p->shard.count : 0;
+	if (resume(&sv)) {
+		goto done;
+	}
+	sv.saved = time(NULL);
+
+	pthread_mutex_init(&sv.lock, NULL);
+	if (sv.head.phase == RANKING) {
+		k = pending(&sv, sv.end - sv.begin, sv.begin);
+		sv.ranked = sv.end - sv.begin - k;
+		pool_run(threads, k, rank_unit, &sv);
+		if (p->verbose) {
+			fprintf(stderr, "\n");
+		}
+
+		// neighbouring tasks then tend to share a wheel order, and with it the tables
+		qsort(sv.cands, sv.num_cands, sizeof(*sv.cands), by_wheels);
+		memset(sv.done, 0, sv.num_cands);
+		sv.head.phase = CLIMBING;
+		if (p->checkpoint) {
+			save(&sv);
+		}
+	}
+	if (sv.head.phase == CLIMBING) {
+		k = pending(&sv, sv.num_cands, 0);
+		sv.ranked = sv.num_cands - k;
+		pool_run(threads, k, climb_candidate, &sv);
+		if (p->verbose) {
+			fprintf(stderr, "\n");
+		}
+		sv.head.phase = FINISHED;
+		if (p->checkpoint) {
+			save(&sv);
+		}
+	}
+	pthread_mutex_destroy(&sv.lock);
+
+	qsort(sv.cands, sv.num_cands, sizeof(*sv.cands), by_score);
+	for (n = 0; n < nout && n < sv.num_cands; n++) {
+		result(&sv, &sv.cands[n], &out[n]);
+	}
+
+done:
+	if (sv.workers) {
+		free_workers(&sv, workers);
+	}
+	free(sv.done);
+	free(sv.tasks);
+	free(sv.cands);
+	free(sv.wheels);
+	free(sv.cipher);
+	return n;
+}
+
+int
+solve_merge(const char *const *files, int nfiles, struct solve_result *out, int nout) {
+	struct solve_params params = {0};
+	struct solver sv = {0};
+	struct progress head, first = {0}, same;
+	unsigned char *covered = NULL;
+	struct candidate *cands;
+	size_t len;
+	void *buf;
+	int i, j, err, missing = 0, n = -1;
+
+	for (i = 0; i < nfiles; i++) {
+		if ((err = shard_load(files[i], &buf, &len))) {
+			if (err > 0) {
+				fprintf(stderr, "Unable to open %s\n", files[i]);
+			}
+			goto done;
+		}
+		if (len >= sizeof(head)) {
+			memcpy(&head, buf, sizeof(head));
+		}
+		if (len < sizeof(head) || head.phase != FINISHED || head.num_cands < 0 ||
+			len != sizeof(head) + head.num_cands * sizeof(*sv.cands)) {
+			fprintf(stderr, "Checkpoint %s is not of a finished search\n", files[i]);
+			free(buf);
+			goto done;
+		}
+
+		if (!i) {
+			first = head;
+			covered = calloc(head.shard_count > 0 ? head.shard_count : 1, 1);
+		}
+		same = first;
+		same.shard_first = head.shard_first;
+		same.shard_last = head.shard_last;
+		same.num_cands = head.num_cands;
+		if (memcmp(&same, &head, sizeof(head))) {
+			fprintf(stderr, "Checkpoint %s is not of the same search as %s\n", files[i],
+				files[0]);
+			free(buf);
+			goto done;
+		}
+		for (j = head.shard_first; j <= head.shard_last && covered; j++) {
+			if (covered[j]++) {
+				fprintf(stderr, "Shard %d is in more than one checkpoint\n", j);
+				free(buf);
+				goto done;
+			}
+		}
+
+		cands = realloc(sv.cands, (sv.num_cands + head.num_cands) * sizeof(*cands) + 1);
+		if (!cands || !covered) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			free(buf);
+			goto done;
+		}
+		sv.cands = cands;
+		memcpy(sv.cands + sv.num_cands, (unsigned char *)buf + sizeof(head),
+			head.num_cands * sizeof(*sv.cands));
+		sv.num_cands += head.num_cands;
+		free(buf);
+	}
+
+	for (j = 0; j < first.shard_count; j++) {
+		if (!covered[j]) {
+			fprintf(stderr, "%s %d", missing++ ? "," : "Shards missing:", j);
+		}
+	}
+	if (missing) {
+		fprintf(stderr, "\nThe results are of part of the keyspace only\n");
+	}
+
+	params.mode = first.mode;
+	sv.p = &params;
+	sv.num_wheels = wheels_list(first.mode, first.rotor_mask, &sv.wheels);
+	if (sv.num_wheels * MAP_SIZE != first.units) {
+		fprintf(stderr, "Unable to list the wheel orders of the search\n");
+		goto done;
+	}
+	qsort(sv.cands, sv.num_cands, sizeof(*sv.cands), by_score);
+	for (n = 0; n < nout && n < sv.num_cands; n++) {
+		result(&sv, &sv.cands[n], &out[n]);
+	}
+
+done:
+	free(covered);
+	free(sv.cands);
+	free(sv.wheels);
+	return n;
+}
+
+void
+solve_print(FILE *f, const struct solve_result *r) {
+	int i;
+
+	fprintf(f, "# score %.3f\n", r->score);
+	fprintf(f, "mode=%d\n", r->mode);
+	for (i = 0; i < (r->mode == MODE_M4 ? RACK_SIZE : RACK_SIZE - 1); i++) {
+		fprintf(f, "r%d=%d %d %d\n", i, r->rotor[i], r->rotation[i], r->ringset[i]);
+	}
+	fprintf(f, "reflector=%d\n", r->reflector);
+	for (i = 0; i < MAP_SIZE; i++) {
+		if (r->plugboard[i] > DECODE(i)) {
+			fprintf(f, "%c=%c\n", DECODE(i), r->plugboard[i]);
+		}
+	}
+}
@@ -0,0 +1,72 @@
+#ifndef SOLVE_H
+#define SOLVE_H
+
+#include "enigma.h"
+#include "ngram.h"
+#include "shard.h"
+#include <stdio.h>
+
+// A recovered setting. Rotors are given by slot, as in settings.conf
+struct solve_result {
+	double score;        // n-gram score of the decryption, log10 probability per n-gram
+	int mode, reflector;
+	int rotor[4], rotation[4], ringset[4];
+	char plugboard[26];  // partner of each letter, the letter itself if unplugged
+};
+
+// Ciphertext only attack, after Gillogly. Unplugged trial decryptions are scored by
+// their index of coincidence for every wheel order and ground setting, and the best
+// candidates go on to hill climbs: first the ring settings of the fast and middle
+// rotors (by index of coincidence), then the plugboard, a pair at a time, by index of
+// coincidence and finally by n-gram score. The wheel orders of the first pass, and
+// the candidates (with their restarts) of the second, are spread over threads.
+//
+// With rings at 0 in the first pass, a fast rotor ring far from 0 puts the middle
+// rotor out of step for much of the message, which on heavily plugged messages can
+// push the right setting out of the candidates. Searching the ring of the fast rotor
+// in the first pass as well avoids that, at 26 times the cost.
+//
+// Trial decryptions run through the compiled tables of the unplugged machine: the
+// table rows under each letter are looked up once per candidate (a trace, see
+// trace.h), after which a decryption with any plugboard is three lookups a letter,
+// with no allocation. A move of the plugboard climb only redoes the letters it
+// reaches, about a quarter of them.
+//
+// The first pass is split into units of one wheel order and slow rotor ground (676
+// ground settings), which shards of the search divide between them (see shard.h).
+// Each shard keeps its own best candidates, climbs them, and can save its progress to
+// a checkpoint every so often, from which a restarted search picks up: the units ranked
+// and the candidates kept while ranking, the candidates climbed after. The finished
+// checkpoints of every shard merge into one list with solve_merge. As each shard keeps
+// as many candidates as a whole search would, a sharded search climbs more of them.
+struct solve_params {
+	const char *cipher;           // ciphertext, anything but letters is ignored
+	size_t cipher_len;
+	const struct ngrams *ngrams;
+	int mode;                     // MODE_M3 or MODE_M4
+	int threads;
+	unsigned int rotor_mask;      // rotors allowed in slots 0-2, as for crib_search
+	int rings;                    // 1 to search the fast rotor ring in the first pass
+	int candidates;               // settings kept from the first pass (0 for 500)
+	int restarts;                 // plugboard climbs per candidate (0 for 4)
+	int max_plugs;                // most plugboard pairs tried (0 for 10)
+	int verbose;                  // report progress on stderr
+	struct shard shard;           // part of the search to run, count 0 for all of it
+	const char *checkpoint;       // file to save progress to and resume from, or NULL
+	int save_secs;                // seconds between saves (0 for 30)
+};
+
+// Writes up to nout of the best settings found to out, best first, and returns how
+// many were written, or -1 if the search could not be run
+int solve(const struct solve_params *p, struct solve_result *out, int nout);
+
+// Merges the checkpoints of finished shards of one search, writing up to nout of the
+// best settings in them all to out as solve does. Missing shards are reported, but
+// the rest are still merged
+int solve_merge(const char *const *files, int nfiles, struct solve_result *out,
+	int nout);
+
+// writes a result in the format of a settings file
+void solve_print(FILE *f, const struct solve_result *r);
+
+#endif
@@ -0,0 +1,243 @@
+#include "stats.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ENIGMA_STATS
+
+_Thread_local struct stats_block *stats_local = NULL;
+
+// every block ever made. Blocks are never freed, so the counts of threads which have
+// finished still add up
+static _Atomic(struct stats_block *) blocks = NULL;
+
+struct stats_block *
+stats_block_new(void) {
+	struct stats_block *b = calloc(1, sizeof(*b));
+
+	if (b) {
+		b->next = atomic_load(&blocks);
+		while (!atomic_compare_exchange_weak(&blocks, &b->next, b)) {
+			;
+		}
+		stats_local = b;
+	}
+
+	return b;
+}
+
+int
+stats_enabled(void) {
+	return 1;
+}
+
+void
+stats_read(uint64_t count[STATS]) {
+	struct stats_block *b;
+	int i;
+
+	memset(count, 0, STATS * sizeof(*count));
+	for (b = atomic_load(&blocks); b; b = b->next) {
+		for (i = 0; i < STATS; i++) {
+			count[i] += atomic_load_explicit(&b->count[i], memory_order_relaxed);
+		}
+	}
+}
+
+#else
+
+int
+stats_enabled(void) {
+	return 0;
+}
+
+void
+stats_read(uint64_t count[STATS]) {
+	memset(count, 0, STATS * sizeof(*count));
+}
+
+#endif
+
+static struct {
+	pthread_mutex_t lock;
+	void (*read)(const void *arg, uint64_t gauge[GAUGES]);
+	const void *arg;
+	uint64_t last[GAUGES];      // as read when the source was dropped
+} gauges = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void
+stats_gauges(void (*read)(const void *arg, uint64_t gauge[GAUGES]), const void *arg) {
+	pthread_mutex_lock(&gauges.lock);
+	gauges.read = read;
+	gauges.arg = arg;
+	pthread_mutex_unlock(&gauges.lock);
+}
+
+void
+stats_gauges_drop(const void *arg) {
+	pthread_mutex_lock(&gauges.lock);
+	if (gauges.read && gauges.arg == arg) {
+		gauges.read(arg, gauges.last);
+		gauges.read = NULL;
+		gauges.arg = NULL;
+	}
+	pthread_mutex_unlock(&gauges.lock);
+}
+
+static void
+read_gauges(uint64_t gauge[GAUGES]) {
+	pthread_mutex_lock(&gauges.lock);
+	memcpy(gauge, gauges.last, GAUGES * sizeof(*gauge));
+	if (gauges.read) {
+		gauges.read(gauges.arg, gauge);
+	}
+	pthread_mutex_unlock(&gauges.lock);
+}
+
+void
+stats_write_json(FILE *f) {
+	uint64_t c[STATS], g[GAUGES];
+
+	stats_read(c);
+	read_gauges(g);
+	fprintf(f, "{\"encoded\": %llu, \"skipped\": %llu, \"rotor_steps\": [%llu, %llu, %llu], "
+		"\"double_steps\": %llu, \"bytes_read\": %llu, \"bytes_written\": %llu, "
+		"\"load_ns\": %llu, \"encode_ns\": %llu, \"save_ns\": %llu, "
+		"\"ctxs_in_use\": %llu, \"ctxs_peak\": %llu, \"ctxs_capacity\": %llu, "
+		"\"ctx_bytes\": %llu}\n",
+		(unsigned long long)c[STAT_ENCODED], (unsigned long long)c[STAT_SKIPPED],
+		(unsigned long long)c[STAT_STEPS_0], (unsigned long long)c[STAT_STEPS_1],
+		(unsigned long long)c[STAT_STEPS_2], (unsigned long long)c[STAT_DOUBLE_STEPS],
+		(unsigned long long)c[STAT_BYTES_READ], (unsigned long long)c[STAT_BYTES_WRITTEN],
+		(unsigned long long)c[STAT_LOAD_NS], (unsigned long long)c[STAT_ENCODE_NS],
+		(unsigned long long)c[STAT_SAVE_NS], (unsigned long long)g[GAUGE_CTXS_IN_USE],
+		(unsigned long long)g[GAUGE_CTXS_PEAK], (unsigned long long)g[GAUGE_CTXS_CAPACITY],
+		(unsigned long long)g[GAUGE_CTX_BYTES]);
+}
+
+static void
+prometheus_counter(FILE *f, const char *name, const char *help, uint64_t v) {
+	fprintf(f, "# HELP enigma_%s %s\n# TYPE enigma_%s counter\nenigma_%s %llu\n", name,
+		help, name, name, (unsigned long long)v);
+}
+
+static void
+prometheus_gauge(FILE *f, const char *name, const char *help, uint64_t v) {
+	fprintf(f, "# HELP enigma_%s %s\n# TYPE enigma_%s gauge\nenigma_%s %llu\n", name,
+		help, name, name, (unsigned long long)v);
+}
+
+static void
+prometheus_seconds(FILE *f, const char *name, const char *help, uint64_t ns) {
+	fprintf(f, "# HELP enigma_%s %s\n# TYPE enigma_%s counter\nenigma_%s %.9f\n", name,
+		help, name, name, ns * 1e-9);
+}
+
+void
+stats_write_prometheus(FILE *f) {
+	uint64_t c[STATS], g[GAUGES];
+	int i;
+
+	stats_read(c);
+	read_gauges(g);
+	prometheus_counter(f, "letters_encoded_total", "Letters encrypted.", c[STAT_ENCODED]);
+	prometheus_counter(f, "chars_skipped_total", "Characters passed over as not letters.",
+		c[STAT_SKIPPED]);
+	fprintf(f, "# HELP enigma_rotor_steps_total Rotor steps by rack slot.\n"
+		"# TYPE enigma_rotor_steps_total counter\n");
+	for (i = 0; i < 3; i++) {
+		fprintf(f, "enigma_rotor_steps_total{slot=\"%d\"} %llu\n", i,
+			(unsigned long long)c[STAT_STEPS_0 + i]);
+	}
+	prometheus_counter(f, "double_steps_total", "Double steps of the middle rotor.",
+		c[STAT_DOUBLE_STEPS]);
+	prometheus_counter(f, "bytes_read_total", "Bytes of input read.", c[STAT_BYTES_READ]);
+	prometheus_counter(f, "bytes_written_total", "Bytes of output written.",
+		c[STAT_BYTES_WRITTEN]);
+	prometheus_seconds(f, "load_seconds_total", "Time spent loading settings.",
+		c[STAT_LOAD_NS]);
+	prometheus_seconds(f, "encode_seconds_total", "Time spent encrypting buffers.",
+		c[STAT_ENCODE_NS]);
+	prometheus_seconds(f, "save_seconds_total", "Time spent saving settings.",
+		c[STAT_SAVE_NS]);
+	prometheus_gauge(f, "pooled_machines_in_use", "Pooled machines in use.",
+		g[GAUGE_CTXS_IN_USE]);
+	prometheus_gauge(f, "pooled_machines_peak", "Most pooled machines in use at once.",
+		g[GAUGE_CTXS_PEAK]);
+	prometheus_gauge(f, "pooled_machines_capacity", "Pooled machines, in use or free.",
+		g[GAUGE_CTXS_CAPACITY]);
+	prometheus_gauge(f, "pooled_machine_bytes", "Memory held by the context pool.",
+		g[GAUGE_CTX_BYTES]);
+}
+
+#ifdef ENIGMA_STATS
+
+static const char *export_name;
+static int export_prometheus;
+
+static void
+export(void) {
+	FILE *f = strcmp(export_name, "-") ? fopen(export_name, "w") : stderr;
+
+	if (!f) {
+		fprintf(stderr, "Unable to open %s\n", export_name);
+		return;
+	}
+	if (export_prometheus) {
+		stats_write_prometheus(f);
+	} else {
+		stats_write_json(f);
+	}
+	if (f == stderr) {
+		fflush(f);
+	} else {
+		fclose(f);
+	}
+}
+
+// Signals are taken by sigwait in a thread of their own, so the counters are written
+// with ordinary stdio rather than from a signal handler
+static void *
+export_thread(void *arg) {
+	sigset_t *set = arg;
+	int sig;
+
+	for (;;) {
+		if (!sigwait(set, &sig)) {
+			export();
+		}
+	}
+
+	return NULL;
+}
+
+int
+stats_export(const char *fname) {
+	static sigset_t set;
+	pthread_t t;
+	size_t n = strlen(fname);
+
+	export_name = fname;
+	export_prometheus = n >= 5 && !strcmp(fname + n - 5, ".prom");
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	if (pthread_sigmask(SIG_BLOCK, &set, NULL) ||
+		pthread_create(&t, NULL, export_thread, &set)) {
+		return -1;
+	}
+	pthread_detach(t);
+
+	return atexit(export);
+}
+
+#else
+
+int
+stats_export(const char *fname) {
+	(void)fname;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Counters of what the machines and the program are doing, for sizing deployments and
+// spotting regressions. They are only built in when ENIGMA_STATS is defined (make
+// STATS=1); otherwise STATS_ADD and the timers compile to nothing and every counter
+// reads 0. Each thread counts into a block of its own, so counting takes no locks and
+// no atomic read-modify-writes, and stats_read adds the blocks up, including those of
+// threads which have finished.
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum {
+	STAT_ENCODED,       // letters encrypted by enigma_encode_ctx and enigma_encode_buf_ctx
+	STAT_SKIPPED,       // characters they passed over, not being letters
+	STAT_STEPS_0,       // steps of the rotor in each slot (the fourth never steps)
+	STAT_STEPS_1,
+	STAT_STEPS_2,
+	STAT_DOUBLE_STEPS,  // key presses which moved the middle rotor on at its own notch
+	STAT_BYTES_READ,
+	STAT_BYTES_WRITTEN,
+	STAT_LOAD_NS,       // time spent loading settings
+	STAT_ENCODE_NS,     // time spent in enigma_encode_buf_ctx
+	STAT_SAVE_NS,       // time spent saving settings
+	STATS
+};
+
+// Levels which go up as well as down, read from their source when the counters are
+// written rather than counted
+enum {
+	GAUGE_CTXS_IN_USE,  // machines got from a context pool (ctxpool.h) and not yet put
+	GAUGE_CTXS_PEAK,    // the most it has had in use at once
+	GAUGE_CTXS_CAPACITY,
+	GAUGE_CTX_BYTES,    // memory held by its slabs
+	GAUGES
+};
+
+#ifdef ENIGMA_STATS
+
+#include <stdatomic.h>
+#include <time.h>
+
+struct stats_block {
+	_Atomic uint64_t count[STATS];
+	struct stats_block *next;
+};
+
+extern _Thread_local struct stats_block *stats_local;
+
+struct stats_block *stats_block_new(void);
+
+// Only the owning thread writes a block, so a relaxed load and store is enough, and
+// readers in other threads never see a torn value
+static inline void
+stats_add(int c, uint64_t n) {
+	struct stats_block *b = stats_local ? stats_local : stats_block_new();
+
+	if (b) {
+		atomic_store_explicit(&b->count[c],
+			atomic_load_explicit(&b->count[c], memory_order_relaxed) + n,
+			memory_order_relaxed);
+	}
+}
+
+static inline uint64_t
+stats_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+#define STATS_ADD(c, n) stats_add((c), (n))
+#define STATS_TIMER(t) uint64_t t = stats_now()
+#define STATS_TIMER_END(t, c) stats_add((c), stats_now() - (t))
+
+#else
+
+#define STATS_ADD(c, n) ((void)0)
+#define STATS_TIMER(t) ((void)0)
+#define STATS_TIMER_END(t, c) ((void)0)
+
+#endif
+
+// Whether counters were built in
+int stats_enabled(void);
+
+// Adds up the counters of every thread into count
+void stats_read(uint64_t count[STATS]);
+
+// Sets the source of the gauges: read fills them in from arg whenever they are
+// written. Gauges read 0 until there is one
+void stats_gauges(void (*read)(const void *arg, uint64_t gauge[GAUGES]), const void *arg);
+
+// Stops reading the gauges from arg, if it is still their source, waiting for any
+// write in progress to finish with it. They keep the values arg last gave
+void stats_gauges_drop(const void *arg);
+
+// Writes the counters and gauges to f as a JSON object, or as Prometheus text exposition
+void stats_write_json(FILE *f);
+void stats_write_prometheus(FILE *f);
+
+// Sets the source of the gauges: read fills them in from arg whenever they are
+// written. Gauges read 0 until there is one
+void stats_gauges(void (*read)(const void *arg, uint64_t gauge[GAUGES]), const void *arg);
+
+// Stops reading the gauges from arg, if it is still their source, waiting for any
+// write in progress to finish with it. They keep the values arg last gave
+void stats_gauges_drop(const void *arg);
+
+// Writes the counters and gauges to fname (- for standard error) when the program exits and
+// whenever it gets SIGUSR1, as Prometheus text if fname ends in .prom and JSON
+// otherwise. Call before starting any threads, so that they all leave SIGUSR1 to the
+// thread which handles it. Returns 0 on success
+int stats_export(const char *fname);
+
+#endif
@@ -0,0 +1,323 @@
+#include "tablecache.h"
+#include "io.h"
+#include "pool.h"
+#include "wheels.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TABLE_CACHE_BOM 0x0102
+#define PAGE 4096
+#define TABLE_BYTES ((size_t)POSITIONS * ROW_SIZE)
+#define TABLE_SPAN ((TABLE_BYTES + PAGE - 1) / PAGE * PAGE) // from one table to the next
+#define PAGES(n) (((n) + PAGE - 1) / PAGE * PAGE)
+
+struct table_cache {
+	const struct table_cache_header *h;
+	const struct table_cache_entry *e;
+	void *map;
+	size_t len;
+};
+
+// tables being built into a file, one task each
+struct build {
+	int mode;
+	struct wheels *wheels;
+	struct table_cache_entry *e;
+	int *index;                // into wheels, of each entry
+	unsigned char *map;
+	enigma_ctx **ctx;          // per worker
+	atomic_int failed;
+};
+
+static _Atomic(table_cache *) current;
+
+// Packs the wheels of a table: rotors by ROTOR_ code and, in MODE_M4, the core offset
+// of the fourth (its rotation less its ring setting)
+static uint32_t
+table_key(int mode, const int *rotor, int offset3, int reflector) {
+	uint32_t k = mode | reflector << 1 | rotor[0] << 20 | rotor[1] << 16 | rotor[2] << 12;
+
+	if (mode == MODE_M4) {
+		k |= rotor[3] << 8 | offset3 << 3;
+	}
+	return k;
+}
+
+static table_cache *
+map_cache(const char *fname, int quiet) {
+	const struct table_cache_header *h;
+	const struct table_cache_entry *e;
+	struct table_cache *c;
+	struct stat st;
+	size_t i, head;
+	void *map;
+	int fd;
+
+	if ((fd = open(fname, O_RDONLY)) < 0) {
+		if (!quiet) {
+			fprintf(stderr, "Unable to open %s\n", fname);
+		}
+		return NULL;
+	}
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*h)) {
+		if (!quiet) {
+			fprintf(stderr, "%s is not a table cache\n", fname);
+		}
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		if (!quiet) {
+			fprintf(stderr, "Unable to map %s\n", fname);
+		}
+		return NULL;
+	}
+
+	h = map;
+	head = sizeof(*h) + (size_t)h->count * sizeof(struct table_cache_entry);
+	if (memcmp(h->magic, "ETBL", 4) || h->version != TABLE_CACHE_VERSION ||
+		h->bom != TABLE_CACHE_BOM || h->count > (size_t)st.st_size / TABLE_SPAN ||
+		head > (size_t)st.st_size ||
+		h->crc != crc32(crc32(0, h, offsetof(struct table_cache_header, crc)),
+			h + 1, head - sizeof(*h))) {
+		if (!quiet) {
+			fprintf(stderr, "%s is not a table cache (or was built on another "
+				"architecture)\n", fname);
+		}
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	if (h->wiring_crc != enigma_wiring_crc()) {
+		if (!quiet) {
+			fprintf(stderr, "%s was built for different wiring\n", fname);
+		}
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	for (e = (const struct table_cache_entry *)(h + 1), i = 0; i < h->count; i++, e++) {
+		if (e->offset % PAGE || e->offset < head ||
+			e->offset > (uint64_t)st.st_size - TABLE_BYTES) {
+			if (!quiet) {
+				fprintf(stderr, "Table cache %s is damaged\n", fname);
+			}
+			munmap(map, st.st_size);
+			return NULL;
+		}
+	}
+
+	if (!(c = malloc(sizeof(*c)))) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	c->h = h;
+	c->e = (const struct table_cache_entry *)(h + 1);
+	c->map = map;
+	c->len = st.st_size;
+	return c;
+}
+
+table_cache *
+table_cache_open(const char *fname) {
+	return map_cache(fname, 0);
+}
+
+void
+table_cache_close(table_cache *c) {
+	if (c) {
+		munmap(c->map, c->len);
+		free(c);
+	}
+}
+
+size_t
+table_cache_verify(const table_cache *c) {
+	size_t i, bad = 0;
+
+	for (i = 0; i < c->h->count; i++) {
+		bad += crc32(0, (const char *)c->map + c->e[i].offset, TABLE_BYTES) !=
+			c->e[i].crc;
+	}
+
+	return bad;
+}
+
+void
+table_cache_use(table_cache *c) {
+	atomic_store(&current, c);
+}
+
+const table_row *
+table_cache_rows(const struct enigma_ctx *ctx) {
+	const table_cache *c = atomic_load(&current);
+	int rotor[RACK_SIZE] = {0}, i, lo, hi, mid;
+	uint32_t k;
+
+	if (!c) {
+		return NULL;
+	}
+	for (i = 0; i < ctx->num_rotors; i++) {
+		rotor[i] = ctx->rack[i].code;
+	}
+	k = table_key(ctx->mode, rotor,
+		WRAP(ctx->rack[3].rotation + MAP_SIZE - ctx->rack[3].ringset), ctx->reflector);
+
+	for (lo = 0, hi = c->h->count; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (c->e[mid].key < k) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == (int)c->h->count || c->e[lo].key != k) {
+		return NULL;
+	}
+
+	return (const table_row *)((const char *)c->map + c->e[lo].offset);
+}
+
+static int
+by_key(const void *a, const void *b) {
+	const struct table_cache_entry *x = a, *y = b;
+
+	return (x->key > y->key) - (x->key < y->key);
+}
+
+static void
+build_one(void *arg, size_t task, int worker) {
+	struct build *b = arg;
+	struct table_cache_entry *e = &b->e[task];
+	struct enigma_table *t;
+
+	if (!(t = wheels_table(b->ctx[worker], b->mode, &b->wheels[b->index[task]], 1))) {
+		atomic_store(&b->failed, 1);
+		return;
+	}
+	memcpy(b->map + e->offset, t->perm, TABLE_BYTES);
+	e->crc = crc32(0, b->map + e->offset, TABLE_BYTES);
+}
+
+// whether the cache fname already holds what table_cache_build would write
+static int
+up_to_date(const char *fname, int mode, unsigned int mask, size_t count) {
+	table_cache *c = map_cache(fname, 1);
+	int ok;
+
+	if (!c) {
+		return 0;
+	}
+	ok = c->h->mode == mode && c->h->rotor_mask == mask && c->h->count == count &&
+		!table_cache_verify(c);
+	table_cache_close(c);
+	return ok;
+}
+
+int
+table_cache_build(const char *fname, int mode, unsigned int mask, int threads) {
+	struct table_cache_header h = { .magic = "ETBL", .version = TABLE_CACHE_VERSION,
+		.mode = mode, .bom = TABLE_CACHE_BOM };
+	struct build b = { .mode = mode };
+	char tmp[PATH_MAX];
+	size_t n, i, head, len;
+	int fd = -1, err = -1, rotor[RACK_SIZE];
+
+	threads = threads > 0 ? threads : 1;
+	mask = mask ? mask & ALL_ROTORS : ALL_ROTORS;
+	if (!(n = wheels_list(mode, mask, &b.wheels))) {
+		fprintf(stderr, "No wheel orders to build tables for\n");
+		return -1;
+	}
+	if (up_to_date(fname, mode, mask, n)) {
+		free(b.wheels);
+		return 1;
+	}
+
+	head = PAGES(sizeof(h) + n * sizeof(*b.e));
+	len = head + n * TABLE_SPAN;
+	b.e = calloc(n, sizeof(*b.e));
+	b.index = malloc(n * sizeof(*b.index));
+	b.ctx = calloc(threads, sizeof(*b.ctx));
+	if (!b.e || !b.index || !b.ctx) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		goto done;
+	}
+	for (i = 0; i < (size_t)threads; i++) {
+		if (!(b.ctx[i] = enigma_ctx_create())) {
+			fprintf(stderr, "Unable to allocate memory\n");
+			goto done;
+		}
+	}
+
+	// entries sorted by key, each with its wheels, and the tables in the same order
+	for (i = 0; i < n; i++) {
+		memcpy(rotor, b.wheels[i].rotor, sizeof(rotor));
+		b.e[i].key = table_key(mode, rotor, b.wheels[i].rotation3, b.wheels[i].reflector);
+		b.e[i].offset = i; // which wheels, until sorted
+	}
+	qsort(b.e, n, sizeof(*b.e), by_key);
+	for (i = 0; i < n; i++) {
+		b.index[i] = b.e[i].offset;
+		b.e[i].offset = head + i * TABLE_SPAN;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, len)) {
+		fprintf(stderr, "Unable to write %s\n", tmp);
+		goto done;
+	}
+	b.map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (b.map == MAP_FAILED) {
+		b.map = NULL;
+		fprintf(stderr, "Unable to map %s\n", tmp);
+		goto done;
+	}
+
+	pool_run(threads, n, build_one, &b);
+	if (atomic_load(&b.failed)) {
+		fprintf(stderr, "Unable to build tables\n");
+		goto done;
+	}
+
+	h.count = n;
+	h.rotor_mask = mask;
+	h.wiring_crc = enigma_wiring_crc();
+	h.crc = crc32(crc32(0, &h, offsetof(struct table_cache_header, crc)), b.e,
+		n * sizeof(*b.e));
+	memcpy(b.map, &h, sizeof(h));
+	memcpy(b.map + sizeof(h), b.e, n * sizeof(*b.e));
+	if (msync(b.map, len, MS_SYNC) || rename(tmp, fname)) {
+		fprintf(stderr, "Unable to write %s\n", fname);
+		goto done;
+	}
+	err = 0;
+
+done:
+	if (b.map) {
+		munmap(b.map, len);
+	}
+	if (fd >= 0) {
+		close(fd);
+		if (err) {
+			remove(tmp);
+		}
+	}
+	for (i = 0; b.ctx && i < (size_t)threads; i++) {
+		enigma_ctx_destroy(b.ctx[i]);
+	}
+	free(b.ctx);
+	free(b.index);
+	free(b.e);
+	free(b.wheels);
+	return err;
+}
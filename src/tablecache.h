@@ -0,0 +1,67 @@
+#ifndef TABLECACHE_H
+#define TABLECACHE_H
+
+#include "enigma_internal.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// A file of compiled tables, which processes map rather than build, so that any number
+// of them share one copy through the page cache. It holds the tables of unplugged
+// machines with every ring at 0: one for each wheel order and reflector (and, in
+// MODE_M4, fourth rotor and its ground), as the key searches use. Machines with other
+// ring settings or a plugboard take their tables from the same ones: a ring setting
+// only turns the core against the rotation, so the row for rotations p with rings r is
+// the cached row for p - r, and the plugboard wraps each row. Their tables are copied
+// out of the file, while those of unplugged machines with rings at 0 point into it.
+//
+// File layout: a struct table_cache_header, count struct table_cache_entry sorted by
+// key, then the tables, POSITIONS rows of ROW_SIZE bytes each, every one starting on a
+// page. The file is written in the byte order of the machine which built it, which bom
+// records, and only holds for the wiring it was built with
+struct table_cache_header {
+	char magic[4];        // "ETBL"
+	uint8_t version;      // TABLE_CACHE_VERSION
+	uint8_t mode;
+	uint16_t bom;         // 0x0102 as written
+	uint32_t count;
+	uint32_t rotor_mask;  // rotors of the wheel orders, as for wheels_list
+	uint32_t wiring_crc;  // enigma_wiring_crc of the builder
+	uint32_t reserved[2];
+	uint32_t crc;         // CRC-32 of the bytes above and the entries
+};
+
+struct table_cache_entry {
+	uint32_t key;         // wheels of the table, as packed by table_key in tablecache.c
+	uint32_t crc;         // CRC-32 of the table
+	uint64_t offset;      // of the table in the file
+};
+
+#define TABLE_CACHE_VERSION 1
+
+typedef struct table_cache table_cache;
+typedef unsigned char table_row[ROW_SIZE];
+
+// Builds the cache fname for every wheel order of mode whose rotors are in mask, as
+// listed by wheels_list, on threads threads. An existing file which already holds
+// them, undamaged, is left as it is. Returns 0 if the file was built, 1 if it was left
+// and -1 if it could not be built
+int table_cache_build(const char *fname, int mode, unsigned int mask, int threads);
+
+// Maps the cache fname, checking its header and entries. The tables are only checked
+// by table_cache_verify, which costs as much as building them. NULL (with a message)
+// if the file can not be used
+table_cache *table_cache_open(const char *fname);
+void table_cache_close(table_cache *c);
+
+// the number of tables in c whose checksums are wrong
+size_t table_cache_verify(const table_cache *c);
+
+// Has compiled machines take their tables from c from now on, or build them if c is
+// NULL. c must stay open while any machine which took tables from it is in use
+void table_cache_use(table_cache *c);
+
+// The rows the cache in use holds for the wheels of ctx, with rings at 0 and no
+// plugboard, or NULL if it has none
+const table_row *table_cache_rows(const struct enigma_ctx *ctx);
+
+#endif
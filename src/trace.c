@@ -0,0 +1,212 @@
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+
+int
+trace_init(struct trace *t, const unsigned char *cipher, size_t len) {
+	uint32_t fill[MAP_SIZE];
+	size_t i;
+	int x;
+
+	memset(t, 0, sizeof(*t));
+	t->len = len;
+	t->cipher = cipher;
+	t->rows = malloc((len ? len : 1) * sizeof(*t->rows));
+	t->mid = malloc(len ? len : 1);
+	t->plain = malloc(len ? len : 1);
+	t->by_cipher = malloc((len ? len : 1) * sizeof(*t->by_cipher));
+	t->mid_next = malloc((len ? len : 1) * sizeof(*t->mid_next));
+	t->mid_prev = malloc((len ? len : 1) * sizeof(*t->mid_prev));
+	t->undo = malloc((len ? len : 1) * sizeof(*t->undo));
+	t->undo_letter = malloc(len ? len : 1);
+	if (!t->rows || !t->mid || !t->plain || !t->by_cipher || !t->mid_next ||
+		!t->mid_prev || !t->undo || !t->undo_letter) {
+		trace_free(t);
+		return -1;
+	}
+
+	for (i = 0; i < len; i++) {
+		t->cipher_start[cipher[i] + 1]++;
+	}
+	for (x = 0; x < MAP_SIZE; x++) {
+		t->cipher_start[x + 1] += t->cipher_start[x];
+		fill[x] = t->cipher_start[x];
+	}
+	for (i = 0; i < len; i++) {
+		t->by_cipher[fill[cipher[i]]++] = i;
+	}
+
+	return 0;
+}
+
+void
+trace_free(struct trace *t) {
+	free(t->rows);
+	free(t->mid);
+	free(t->plain);
+	free(t->by_cipher);
+	free(t->mid_next);
+	free(t->mid_prev);
+	free(t->undo);
+	free(t->undo_letter);
+	memset(t, 0, sizeof(*t));
+}
+
+static void
+link_mid(struct trace *t, int32_t i, int x) {
+	t->mid[i] = x;
+	t->mid_prev[i] = -1;
+	t->mid_next[i] = t->mid_head[x];
+	if (t->mid_head[x] >= 0) {
+		t->mid_prev[t->mid_head[x]] = i;
+	}
+	t->mid_head[x] = i;
+}
+
+static void
+unlink_mid(struct trace *t, int32_t i) {
+	if (t->mid_prev[i] >= 0) {
+		t->mid_next[t->mid_prev[i]] = t->mid_next[i];
+	} else {
+		t->mid_head[t->mid[i]] = t->mid_next[i];
+	}
+	if (t->mid_next[i] >= 0) {
+		t->mid_prev[t->mid_next[i]] = t->mid_prev[i];
+	}
+}
+
+void
+trace_set_plug(struct trace *t, const unsigned char *plug) {
+	size_t i;
+
+	memcpy(t->plug, plug, MAP_SIZE);
+	memset(t->counts, 0, sizeof(t->counts));
+	memset(t->mid_head, 0xff, sizeof(t->mid_head));
+	for (i = t->len; i-- > 0;) { // so each list runs in message order
+		link_mid(t, i, t->rows[i][plug[t->cipher[i]]]);
+		t->plain[i] = plug[t->mid[i]];
+		t->counts[t->plain[i]]++;
+	}
+}
+
+// the letters whose partner differs between the plugboard of t and plug
+static int
+changed(const struct trace *t, const unsigned char *plug, unsigned char *set,
+	unsigned char *in) {
+	int x, n = 0;
+
+	for (x = 0; x < MAP_SIZE; x++) {
+		in[x] = plug[x] != t->plug[x];
+		if (in[x]) {
+			set[n++] = x;
+		}
+	}
+
+	return n;
+}
+
+void
+trace_update(struct trace *t, const unsigned char *plug) {
+	unsigned char set[MAP_SIZE], in[MAP_SIZE];
+	int n, k, y;
+	int32_t i;
+	uint32_t j;
+
+	if (!(n = changed(t, plug, set, in))) {
+		return;
+	}
+
+	// a changed ciphertext letter can send the letter through a different path
+	for (k = 0; k < n; k++) {
+		for (j = t->cipher_start[set[k]]; j < t->cipher_start[set[k] + 1]; j++) {
+			i = t->by_cipher[j];
+			y = t->rows[i][plug[set[k]]];
+			if (y != t->mid[i]) {
+				unlink_mid(t, i);
+				link_mid(t, i, y);
+			}
+			t->counts[t->plain[i]]--;
+			t->plain[i] = plug[y];
+			t->counts[t->plain[i]]++;
+		}
+	}
+	// while a changed letter leaving the rotors only changes the plugboard's output
+	for (k = 0; k < n; k++) {
+		for (i = t->mid_head[set[k]]; i >= 0; i = t->mid_next[i]) {
+			if (!in[t->cipher[i]]) {
+				t->counts[t->plain[i]]--;
+				t->plain[i] = plug[set[k]];
+				t->counts[t->plain[i]]++;
+			}
+		}
+	}
+	memcpy(t->plug, plug, MAP_SIZE);
+}
+
+static void
+put(struct trace *t, int32_t i, int x) {
+	t->undo[t->undo_len] = i;
+	t->undo_letter[t->undo_len++] = t->plain[i];
+	t->plain[i] = x;
+}
+
+const unsigned char *
+trace_try(struct trace *t, const unsigned char *plug) {
+	unsigned char set[MAP_SIZE], in[MAP_SIZE];
+	int n, k;
+	int32_t i;
+	uint32_t j;
+
+	n = changed(t, plug, set, in);
+	for (k = 0; k < n; k++) {
+		for (j = t->cipher_start[set[k]]; j < t->cipher_start[set[k] + 1]; j++) {
+			i = t->by_cipher[j];
+			put(t, i, plug[t->rows[i][plug[set[k]]]]);
+		}
+		for (i = t->mid_head[set[k]]; i >= 0; i = t->mid_next[i]) {
+			if (!in[t->cipher[i]]) {
+				put(t, i, plug[set[k]]);
+			}
+		}
+	}
+
+	return t->plain;
+}
+
+void
+trace_undo(struct trace *t) {
+	while (t->undo_len > 0) {
+		t->undo_len--;
+		t->plain[t->undo[t->undo_len]] = t->undo_letter[t->undo_len];
+	}
+}
+
+long
+trace_ioc(const struct trace *t, const unsigned char *plug) {
+	unsigned char set[MAP_SIZE], in[MAP_SIZE];
+	int counts[MAP_SIZE], n, k, x;
+	int32_t i;
+	uint32_t j;
+	long sum = 0;
+
+	memcpy(counts, t->counts, sizeof(counts));
+	n = changed(t, plug, set, in);
+	for (k = 0; k < n; k++) {
+		for (j = t->cipher_start[set[k]]; j < t->cipher_start[set[k] + 1]; j++) {
+			i = t->by_cipher[j];
+			counts[t->plain[i]]--;
+			counts[plug[t->rows[i][plug[set[k]]]]]++;
+		}
+		for (i = t->mid_head[set[k]]; i >= 0; i = t->mid_next[i]) {
+			if (!in[t->cipher[i]]) {
+				counts[t->plain[i]]--;
+				counts[plug[set[k]]]++;
+			}
+		}
+	}
+	for (x = 0; x < MAP_SIZE; x++) {
+		sum += (long)counts[x] * (counts[x] - 1);
+	}
+
+	return sum;
+}
@@ -0,0 +1,54 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "enigma_internal.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// The scrambler trace of a ciphertext: the substitution made by the rotors and
+// reflector (everything but the plugboard) at each letter of the message, for one
+// wheel order, ring setting and ground. The trace does not depend on the plugboard, so
+// a plugboard search fills it in once and then only decrypts through it. Along with
+// the trace goes the decryption under one plugboard, and changing the plugboard only
+// touches the letters which the change can reach: those whose ciphertext letter, or
+// whose letter leaving the rotors, changes partner. A pair swapped in or out reaches
+// around a quarter of the message.
+struct trace {
+	size_t len;
+	const unsigned char *cipher;     // letter indexes
+	const unsigned char **rows;      // substitution at each letter, filled in by the user
+	unsigned char plug[MAP_SIZE];    // plugboard of the decryption
+	unsigned char *mid;              // letter leaving the rotors, rows[i][plug[cipher[i]]]
+	unsigned char *plain;            // decryption, plug[mid[i]]
+	int counts[MAP_SIZE];            // letters of the decryption
+
+	// letters of the message by ciphertext letter, and linked lists of them by mid
+	uint32_t *by_cipher, cipher_start[MAP_SIZE + 1];
+	int32_t mid_head[MAP_SIZE], *mid_next, *mid_prev;
+
+	uint32_t *undo;                  // letters of plain written over by trace_try
+	unsigned char *undo_letter;
+	size_t undo_len;
+};
+
+// Allocates a trace for a ciphertext of len letter indexes, which must outlive it.
+// Returns 0 on success
+int trace_init(struct trace *t, const unsigned char *cipher, size_t len);
+void trace_free(struct trace *t);
+
+// Decrypts the whole message under plug, after the rows have been filled in
+void trace_set_plug(struct trace *t, const unsigned char *plug);
+
+// Moves the decryption to plug, redoing only the letters the change reaches
+void trace_update(struct trace *t, const unsigned char *plug);
+
+// Writes the decryption under plug over plain, only where it differs, and returns it.
+// trace_undo must be called before anything else is done with the trace
+const unsigned char *trace_try(struct trace *t, const unsigned char *plug);
+void trace_undo(struct trace *t);
+
+// sum of n(n-1) over the letter counts of the decryption under plug, the index of
+// coincidence up to a constant. The trace is left as it is
+long trace_ioc(const struct trace *t, const unsigned char *plug);
+
+#endif
@@ -0,0 +1,68 @@
+#include "wheels.h"
+#include <stdlib.h>
+
+size_t
+wheels_list(int mode, unsigned int mask, struct wheels **out) {
+	int greek = mode == MODE_M4 ? 2 : 1, grounds = mode == MODE_M4 ? MAP_SIZE : 1;
+	int refl = mode == MODE_M4 ? REFLECTOR_B_THIN : REFLECTOR_B;
+	int a, b, c, f, g, r;
+	struct wheels *w;
+	size_t n = 0;
+
+	mask = mask ? mask & ALL_ROTORS : ALL_ROTORS;
+	w = malloc(ROTOR_B * ROTOR_B * ROTOR_B * greek * grounds * 2 * sizeof(*w));
+	if (!w) {
+		return 0;
+	}
+
+	for (a = 0; a < ROTOR_B; a++) {
+		for (b = 0; b < ROTOR_B; b++) {
+			for (c = 0; c < ROTOR_B; c++) {
+				if (a == b || a == c || b == c ||
+					!(mask >> a & 1) || !(mask >> b & 1) || !(mask >> c & 1)) {
+					continue;
+				}
+				for (f = 0; f < greek; f++) {
+					for (g = 0; g < grounds; g++) {
+						for (r = refl; r < refl + 2; r++) {
+							w[n].rotor[0] = a;
+							w[n].rotor[1] = b;
+							w[n].rotor[2] = c;
+							w[n].rotor[3] = ROTOR_B + f;
+							w[n].rotation3 = g;
+							w[n].reflector = r;
+							n++;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	if (!n) {
+		free(w);
+	}
+	*out = n ? w : NULL;
+	return n;
+}
+
+struct enigma_table *
+wheels_table(enigma_ctx *ctx, int mode, const struct wheels *w, int build) {
+	int i;
+
+	enigma_init_ctx(ctx);
+	enigma_set_mode_ctx(ctx, mode);
+	for (i = 0; i < ctx->num_rotors; i++) {
+		enigma_load_rotor_ctx(ctx, i, w->rotor[i]);
+	}
+	enigma_set_rotation_ctx(ctx, RACK_SIZE - 1, w->rotation3);
+	enigma_load_reflector_ctx(ctx, w->reflector);
+	if (build) {
+		ctx->table = enigma_table_build(ctx);
+		ctx->compiled = 1;
+	} else {
+		enigma_set_compiled_ctx(ctx, 1);
+	}
+
+	return ctx->table;
+}
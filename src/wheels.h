@@ -0,0 +1,31 @@
+#ifndef WHEELS_H
+#define WHEELS_H
+
+#include "enigma.h"
+#include "enigma_internal.h"
+
+#define ALL_ROTORS ((1u << ROTOR_B) - 1) // rotors I-VIII
+
+// A wheel order and reflector, which is everything about a machine but its ground and
+// ring settings and its plugboard. Key searches split their work by wheel order
+struct wheels {
+	int rotor[RACK_SIZE];
+	int rotation3; // ground of the fourth rotor, which never moves
+	int reflector;
+};
+
+// Lists every wheel order of mode whose first three rotors are in mask (bit 1 << ROTOR_x
+// for each rotor allowed, 0 for rotors I-VIII), with each reflector and, in MODE_M4,
+// each fourth rotor at each of its grounds. Returns how many there are, 0 if out of
+// memory. The list is freed by the caller
+size_t wheels_list(int mode, unsigned int mask, struct wheels **out);
+
+// Sets ctx up as an unplugged machine with the wheels w and every ring at 0, and
+// returns its compiled tables (NULL if they could not be built). With rings at 0 the
+// table row for position p is the substitution made with the rotor cores at offsets p,
+// whatever the ring settings of the machine being searched for. With build set the
+// tables are built from the wiring, never taken from a cache, as for writing one
+struct enigma_table *wheels_table(enigma_ctx *ctx, int mode, const struct wheels *w,
+	int build);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef WIRING_H
+#define WIRING_H
+
+// Wiring of the rotors and reflectors, shared by the rotor tables in enigma.c and the
+// fixed machines in enigma_fixed.h. MAP is the forward pass, INV the backward pass and
+// NOTCHES the rotations at which a rotor turns its neighbour (-1 for none)
+
+#define ROTOR_I_MAP        "EKMFLGDQVZNTOWYHXUSPAIBRCJ"
+#define ROTOR_I_INV        "UWYGADFPVZBECKMTHXSLRINQOJ"
+#define ROTOR_I_NOTCHES    16, -1
+
+#define ROTOR_II_MAP       "AJDKSIRUXBLHWTMCQGZNPYFVOE"
+#define ROTOR_II_INV       "AJPCZWRLFBDKOTYUQGENHXMIVS"
+#define ROTOR_II_NOTCHES   4, -1
+
+#define ROTOR_III_MAP      "BDFHJLCPRTXVZNYEIWGAKMUSQO"
+#define ROTOR_III_INV      "TAGBPCSDQEUFVNZHYIXJWLRKOM"
+#define ROTOR_III_NOTCHES  21, -1
+
+#define ROTOR_IV_MAP       "ESOVPZJAYQUIRHXLNFTGKDCMWB"
+#define ROTOR_IV_INV       "HZWVARTNLGUPXQCEJMBSKDYOIF"
+#define ROTOR_IV_NOTCHES   9, -1
+
+#define ROTOR_V_MAP        "VZBRGITYUPSDNHLXAWMJQOFECK"
+#define ROTOR_V_INV        "QCYLXWENFTZOSMVJUDKGIARPHB"
+#define ROTOR_V_NOTCHES    25, -1
+
+#define ROTOR_VI_MAP       "JPGVOUMFYQBENHZRDKASXLICTW"
+#define ROTOR_VI_INV       "SKXQLHCNWARVGMEBJPTYFDZUIO"
+#define ROTOR_VI_NOTCHES   25, 12
+
+#define ROTOR_VII_MAP      "NZJHGRCXMYSWBOUFAIVLPEKQDT"
+#define ROTOR_VII_INV      "QMGYVPEDRCWTIANUXFKZOSLHJB"
+#define ROTOR_VII_NOTCHES  25, 12
+
+#define ROTOR_VIII_MAP     "FKQHTLXOCBJSPDZRAMEWNIUYGV"
+#define ROTOR_VIII_INV     "QJINSAYDVKBFRUHMCPLEWZTGXO"
+#define ROTOR_VIII_NOTCHES 25, 12
+
+#define ROTOR_B_MAP        "LEYJVCNIXWPBQMDRTAKZGFUHOS" // beta
+#define ROTOR_B_INV        "RLFOBVUXHDSANGYKMPZQWEJICT"
+#define ROTOR_B_NOTCHES    -1, -1
+
+#define ROTOR_G_MAP        "FSOKANUERHMBTIYCWLQPZXVGJD" // gamma
+#define ROTOR_G_INV        "ELPZHAXJNYDRKFCTSIBMGWQVOU"
+#define ROTOR_G_NOTCHES    -1, -1
+
+#define REFLECTOR_B_MAP      "YRUHQSLDPXNGOKMIEBFZCWVJAT"
+#define REFLECTOR_C_MAP      "FVPJIAOYEDRZXWGCTKUQSBNMHL"
+#define REFLECTOR_B_THIN_MAP "ENKQAUYWJICOPBLMDXZVFTHRGS"
+#define REFLECTOR_C_THIN_MAP "RDOBJNTKVEHMLFCWZAXGYIPSUQ"
+
+#endif
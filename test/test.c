@@ -0,0 +1,293 @@
+// Checks that the library's fast paths give the same results as enigma_encode_ctx, the
+// machine they stand in for, on random settings from a fixed seed. Each check reports
+// its first mismatch. Exits 1 if any check failed.
+
+#include "enigma.h"
+#include "enigma_fixed.h"
+#include "keybatch.h"
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEXT_MAX 4000 // bytes of text a check encrypts, at most
+#define BATCHES  200  // keybatch_score runs per kernel
+#define KEYS     50   // keys each fixed machine is checked with
+
+static uint64_t g_seed = 88172645463325252ull;
+static int g_failed = 0;
+
+static unsigned int
+rnd(unsigned int n) {
+	g_seed ^= g_seed << 13; g_seed ^= g_seed >> 7; g_seed ^= g_seed << 17; // xorshift64
+	return g_seed % n;
+}
+
+// Reports a failed check, printing only its first failure
+static void
+fail(const char *check, int *failed, const char *what) {
+	g_failed = 1;
+	if (!*failed) {
+		fprintf(stderr, "FAIL %s: %s\n", check, what);
+	}
+	*failed = 1;
+}
+
+static void
+pass(const char *check, int failed) {
+	if (!failed) {
+		printf("ok %s\n", check);
+	}
+}
+
+// n bytes of text: letters of both cases, with spaces and punctuation
+static void
+random_text(char *buf, size_t n) {
+	static const char other[] = " .,\n0";
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (rnd(100) < 85) {
+			buf[i] = 'A' + rnd(26) + (rnd(2) ? 'a' - 'A' : 0);
+		} else {
+			buf[i] = other[rnd(sizeof(other) - 1)];
+		}
+	}
+}
+
+// three different rotors from I-VIII and, in MODE_M4, beta or gamma in the fourth slot
+static void
+random_wheels(int mode, int *rotor, int *reflector) {
+	int i, j;
+
+	for (i = 0; i < 3; i++) {
+		do {
+			rotor[i] = ROTOR_I + rnd(8);
+			for (j = 0; j < i && rotor[j] != rotor[i]; j++) {
+				;
+			}
+		} while (j < i);
+	}
+	rotor[3] = rnd(2) ? ROTOR_B : ROTOR_G;
+	*reflector = (mode == MODE_M4 ? REFLECTOR_B_THIN : REFLECTOR_B) + rnd(2);
+}
+
+static enigma_ctx *
+make_machine(int mode, const int *rotor, int reflector) {
+	enigma_ctx *ctx = enigma_ctx_create();
+	int i;
+
+	if (!ctx) {
+		fprintf(stderr, "Unable to allocate enigma machine\n");
+		exit(1);
+	}
+	enigma_set_mode_ctx(ctx, mode);
+	for (i = 0; i < 4; i++) {
+		enigma_load_rotor_ctx(ctx, i, rotor[i]);
+	}
+	enigma_load_reflector_ctx(ctx, reflector);
+	return ctx;
+}
+
+// Rotor positions and rings by slot, and plugboard pairs: the first 2 * pairs letters
+// of a shuffled alphabet, wired two by two
+struct key {
+	int rotation[4], ringset[4];
+	char plugs[26];
+	int pairs;
+};
+
+// random positions and rings, and up to 13 pairs
+static void
+random_key(struct key *k) {
+	int i, j;
+	char c;
+
+	for (i = 0; i < 4; i++) {
+		k->rotation[i] = rnd(26);
+		k->ringset[i] = rnd(26);
+	}
+	for (i = 0; i < 26; i++) {
+		k->plugs[i] = 'A' + i;
+	}
+	for (i = 25; i > 0; i--) {
+		j = rnd(i + 1);
+		c = k->plugs[i]; k->plugs[i] = k->plugs[j]; k->plugs[j] = c;
+	}
+	k->pairs = rnd(14);
+}
+
+static void
+key_to_machine(const struct key *k, enigma_ctx *ctx) {
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		enigma_set_rotation_ctx(ctx, i, k->rotation[i]);
+		enigma_set_ringset_ctx(ctx, i, k->ringset[i]);
+	}
+	for (i = 0; i < k->pairs; i++) {
+		enigma_plugboard_map_ctx(ctx, k->plugs[2 * i], k->plugs[2 * i + 1]);
+	}
+}
+
+// keybatch_score against decrypting under each lane's key with enigma_encode_ctx and
+// counting the letters
+static void
+check_keybatch(int scalar) {
+	static char text[TEXT_MAX];
+	struct keybatch_scores scores;
+	enigma_ctx *base, *lane[KEYBATCH_LANES];
+	uint32_t freq[26];
+	uint64_t ioc;
+	struct keybatch kb;
+	struct key k;
+	int rotor[4], reflector, mode, lanes, b, i, x, failed = 0;
+	char check[64], what[128];
+	size_t n, j;
+
+	snprintf(check, sizeof(check), "keybatch_score/%s", keybatch_kernel(scalar));
+	for (b = 0; b < BATCHES; b++) {
+		mode = b & 1 ? MODE_M4 : MODE_M3;
+		random_wheels(mode, rotor, &reflector);
+		base = make_machine(mode, rotor, reflector);
+		n = rnd(TEXT_MAX);
+		random_text(text, n);
+
+		memset(&kb, 0, sizeof(kb));
+		lanes = 1 + rnd(KEYBATCH_LANES);
+		for (i = 0; i < lanes; i++) {
+			if (!(lane[i] = enigma_ctx_clone(base))) {
+				fprintf(stderr, "Unable to allocate enigma machine\n");
+				exit(1);
+			}
+			random_key(&k);
+			key_to_machine(&k, lane[i]);
+			keybatch_set(&kb, i, lane[i]);
+		}
+		keybatch_score(base, &kb, text, n, &scores);
+
+		for (i = 0; i < lanes; i++) {
+			memset(freq, 0, sizeof(freq));
+			for (j = 0; j < n; j++) {
+				if (isalpha((unsigned char)text[j])) {
+					freq[enigma_encode_ctx(lane[i], text[j]) - 'A']++;
+				}
+			}
+			for (ioc = 0, x = 0; x < 26; x++) {
+				ioc += (uint64_t)freq[x] * (freq[x] ? freq[x] - 1 : 0);
+			}
+			if (memcmp(freq, scores.freq[i], sizeof(freq)) || ioc != scores.ioc[i]) {
+				snprintf(what, sizeof(what), "%s batch %d lane %d of %d, %zu bytes",
+					mode == MODE_M4 ? "M4" : "M3", b, i, lanes, n);
+				fail(check, &failed, what);
+			}
+			enigma_ctx_destroy(lane[i]);
+		}
+		enigma_ctx_destroy(base);
+	}
+	keybatch_kernel(0);
+	pass(check, failed);
+}
+
+// Fixed machines of both modes, with rotors VI-VIII (which have two notches) among them
+ENIGMA_FIXED(fixed_m3_b, MODE_M3, ROTOR_III, ROTOR_II, ROTOR_I, ROTOR_B, REFLECTOR_B)
+ENIGMA_FIXED(fixed_m3_c, MODE_M3, ROTOR_VI, ROTOR_VIII, ROTOR_V, ROTOR_B, REFLECTOR_C)
+ENIGMA_FIXED(fixed_m4_b, MODE_M4, ROTOR_I, ROTOR_VII, ROTOR_IV, ROTOR_B, REFLECTOR_B_THIN)
+ENIGMA_FIXED(fixed_m4_c, MODE_M4, ROTOR_VIII, ROTOR_VI, ROTOR_II, ROTOR_G,
+	REFLECTOR_C_THIN)
+
+struct fixed_machine {
+	const char *name;
+	int mode, rotor[4], reflector;
+	char (*encode)(struct enigma_fixed *m, char c);
+	size_t (*encode_buf)(struct enigma_fixed *m, const char *in, char *out, size_t n);
+};
+
+static const struct fixed_machine fixed_machines[] = {
+	{ "M3/III-II-I/B", MODE_M3, { ROTOR_III, ROTOR_II, ROTOR_I, ROTOR_B },
+		REFLECTOR_B, fixed_m3_b_encode, fixed_m3_b_encode_buf },
+	{ "M3/VI-VIII-V/C", MODE_M3, { ROTOR_VI, ROTOR_VIII, ROTOR_V, ROTOR_B },
+		REFLECTOR_C, fixed_m3_c_encode, fixed_m3_c_encode_buf },
+	{ "M4/I-VII-IV-b/Bt", MODE_M4, { ROTOR_I, ROTOR_VII, ROTOR_IV, ROTOR_B },
+		REFLECTOR_B_THIN, fixed_m4_b_encode, fixed_m4_b_encode_buf },
+	{ "M4/VIII-VI-II-g/Ct", MODE_M4, { ROTOR_VIII, ROTOR_VI, ROTOR_II, ROTOR_G },
+		REFLECTOR_C_THIN, fixed_m4_c_encode, fixed_m4_c_encode_buf },
+};
+
+static void
+key_to_fixed(const struct key *k, struct enigma_fixed *m) {
+	int i;
+
+	enigma_fixed_init(m);
+	for (i = 0; i < 4; i++) {
+		enigma_fixed_set_rotation(m, i, k->rotation[i]);
+		enigma_fixed_set_ringset(m, i, k->ringset[i]);
+	}
+	for (i = 0; i < k->pairs; i++) {
+		enigma_fixed_plugboard_map(m, k->plugs[2 * i], k->plugs[2 * i + 1]);
+	}
+}
+
+// name_encode and name_encode_buf of a fixed machine against enigma_encode_ctx and
+// enigma_encode_buf_ctx on a context with the same rotors, under random keys. The
+// buffers are encrypted in two pieces, so the second starts where the first left off
+static void
+check_fixed(const struct fixed_machine *f) {
+	static char text[TEXT_MAX], want[TEXT_MAX], got[TEXT_MAX];
+	struct enigma_fixed m;
+	enigma_ctx *ctx;
+	struct key k;
+	size_t n, cut, i, nw, ng;
+	char check[64], what[128];
+	int key, failed = 0;
+
+	snprintf(check, sizeof(check), "enigma_fixed/%s", f->name);
+	for (key = 0; key < KEYS; key++) {
+		random_key(&k);
+		n = rnd(TEXT_MAX);
+		random_text(text, n);
+
+		ctx = make_machine(f->mode, f->rotor, f->reflector);
+		key_to_machine(&k, ctx);
+		key_to_fixed(&k, &m);
+		for (i = 0; i < n; i++) {
+			want[i] = enigma_encode_ctx(ctx, text[i]);
+			got[i] = f->encode(&m, text[i]);
+		}
+		if (memcmp(want, got, n)) {
+			snprintf(what, sizeof(what), "encode, key %d, %zu bytes", key, n);
+			fail(check, &failed, what);
+		}
+		enigma_ctx_destroy(ctx);
+
+		ctx = make_machine(f->mode, f->rotor, f->reflector);
+		key_to_machine(&k, ctx);
+		key_to_fixed(&k, &m);
+		cut = rnd(n + 1);
+		nw = enigma_encode_buf_ctx(ctx, text, want, cut);
+		nw += enigma_encode_buf_ctx(ctx, text + cut, want + nw, n - cut);
+		ng = f->encode_buf(&m, text, got, cut);
+		ng += f->encode_buf(&m, text + cut, got + ng, n - cut);
+		if (nw != ng || memcmp(want, got, nw)) {
+			snprintf(what, sizeof(what), "encode_buf, key %d, %zu bytes cut at %zu",
+				key, n, cut);
+			fail(check, &failed, what);
+		}
+		enigma_ctx_destroy(ctx);
+	}
+	pass(check, failed);
+}
+
+int
+main(void) {
+	size_t i;
+
+	check_keybatch(1);
+	check_keybatch(0);
+	for (i = 0; i < sizeof(fixed_machines) / sizeof(fixed_machines[0]); i++) {
+		check_fixed(&fixed_machines[i]);
+	}
+
+	return g_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}